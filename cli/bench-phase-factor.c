@@ -0,0 +1,101 @@
+/* bench-phase-factor: compare the phase factors of the kernels,
+   cmpl_phase_factor and cmpl_phase_factor_planes, with the libm cexp for
+   accuracy and speed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <time.h>
+
+#include "cmpl.h"
+
+#define NB_POINTS 4096
+
+/* Phase arguments -2 I omega n th for wavelengths from 200 to 1000 nm,
+   thicknesses up to 2 um and RIs with n from 1.3 to 4 and k up to 1. */
+static void
+fill_arguments(double z_re[], double z_im[], int n)
+{
+    int i;
+    srand(1);
+    for (i = 0; i < n; i++) {
+        const double lambda = 200.0 + 800.0 * rand() / RAND_MAX;
+        const double th = 2000.0 * rand() / RAND_MAX;
+        const double nr = 1.3 + 2.7 * rand() / RAND_MAX;
+        const double ni = - 1.0 * rand() / RAND_MAX;
+        const double ph = 4 * M_PI / lambda * th;
+        z_re[i] = ph * ni;
+        z_im[i] = - ph * nr;
+    }
+}
+
+/* Relative deviation of "p" from "ref" in units of DBL_EPSILON. */
+static double
+deviation(cmpl p, cmpl ref)
+{
+    return sqrt(CSQABS(p - ref) / CSQABS(ref)) / DBL_EPSILON;
+}
+
+static double
+elapsed_ns(clock_t start, int n)
+{
+    return 1.0E9 * (clock() - start) / CLOCKS_PER_SEC / n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static double z_re[NB_POINTS], z_im[NB_POINTS];
+    static double p_re[NB_POINTS], p_im[NB_POINTS];
+    static cmpl z[NB_POINTS], ref[NB_POINTS];
+    const int repeat = (argc > 1 ? atoi(argv[1]) : 2000);
+    double dev_scalar = 0.0, dev_planes = 0.0, sum = 0.0;
+    clock_t start;
+    int i, k;
+
+    fill_arguments(z_re, z_im, NB_POINTS);
+    for (i = 0; i < NB_POINTS; i++) {
+        z[i] = z_re[i] + I * z_im[i];
+        ref[i] = cexp(z[i]);
+    }
+
+    cmpl_phase_factor_planes(NB_POINTS, z_re, z_im, p_re, p_im);
+    for (i = 0; i < NB_POINTS; i++) {
+        const double ds = deviation(cmpl_phase_factor(z[i]), ref[i]);
+        const double dp = deviation(p_re[i] + I * p_im[i], ref[i]);
+        dev_scalar = (ds > dev_scalar ? ds : dev_scalar);
+        dev_planes = (dp > dev_planes ? dp : dev_planes);
+    }
+
+    printf("%d phase arguments, %d repetitions\n", NB_POINTS, repeat);
+    printf("maximum relative deviation from cexp: %.2f eps scalar, %.2f eps planes\n",
+           dev_scalar, dev_planes);
+
+    start = clock();
+    for (k = 0; k < repeat; k++) {
+        for (i = 0; i < NB_POINTS; i++) {
+            sum += creal(cexp(z[i] + k * 1.0E-9));
+        }
+    }
+    printf("cexp                      %6.2f ns\n", elapsed_ns(start, repeat * NB_POINTS));
+
+    start = clock();
+    for (k = 0; k < repeat; k++) {
+        for (i = 0; i < NB_POINTS; i++) {
+            sum += creal(cmpl_phase_factor(z[i] + k * 1.0E-9));
+        }
+    }
+    printf("cmpl_phase_factor         %6.2f ns\n", elapsed_ns(start, repeat * NB_POINTS));
+
+    start = clock();
+    for (k = 0; k < repeat; k++) {
+        z_re[k % NB_POINTS] += 1.0E-9;
+        cmpl_phase_factor_planes(NB_POINTS, z_re, z_im, p_re, p_im);
+        sum += p_re[k % NB_POINTS];
+    }
+    printf("cmpl_phase_factor_planes  %6.2f ns\n", elapsed_ns(start, repeat * NB_POINTS));
+
+    /* Printed so that the loops are not optimized away. */
+    fprintf(stderr, "checksum %g\n", sum);
+    return 0;
+}
@@ -0,0 +1,20 @@
+/* check-disp-deriv: compare the analytic derivatives of the Tauc-Lorentz
+   refractive index with numeric derivatives. Exits with a failure status
+   if any of them has a relative error above TEST_DERIV_TOLERANCE. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dispers-classes.h"
+#include "test-deriv.h"
+
+int
+main(int argc, char *argv[])
+{
+    init_class_list();
+    if (test_tauc_lorentz_deriv() > 0) {
+        fprintf(stderr, "check-disp-deriv: derivatives above the tolerance %g\n", TEST_DERIV_TOLERANCE);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
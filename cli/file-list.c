@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "batch.h"
+#include "str.h"
+#include "file-list.h"
+
+void
+file_list_add(struct file_list *lst, const char *name)
+{
+    if (lst->number >= lst->alloc) {
+        lst->alloc = (lst->alloc > 0 ? 2 * lst->alloc : 16);
+        lst->names = erealloc(lst->names, lst->alloc * sizeof(char *));
+    }
+    lst->names[lst->number ++] = strdup(name);
+}
+
+void
+file_list_free(struct file_list *lst)
+{
+    int i;
+    for (i = 0; i < lst->number; i++) {
+        free(lst->names[i]);
+    }
+    free(lst->names);
+}
+
+int
+file_list_read(struct file_list *lst, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    str_t line;
+
+    if (f == NULL) {
+        return 1;
+    }
+
+    str_init(line, 127);
+    while (str_getline(line, f) >= 0) {
+        const char *name = CSTR(line);
+        while (*name == ' ' || *name == '\t') {
+            name++;
+        }
+        if (name[0] != 0) {
+            file_list_add(lst, name);
+        }
+    }
+    str_free(line);
+    fclose(f);
+    return 0;
+}
+
+int
+file_list_pattern(struct file_list *lst, const char *pattern)
+{
+    struct spectra_lst batch[1];
+    str_t name;
+    int iter;
+
+    str_init(batch->name, 64);
+    if (batch_descr_parse(pattern, batch, 1)) {
+        str_free(batch->name);
+        return 1;
+    }
+    batch->single_file = 0;
+
+    str_init(name, 64);
+    for (iter = batch->start; get_batch_filename(name, batch, &iter); ) {
+        file_list_add(lst, CSTR(name));
+    }
+    str_free(name);
+    str_free(batch->name);
+    return 0;
+}
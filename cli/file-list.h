@@ -0,0 +1,17 @@
+#ifndef FILE_LIST_H
+#define FILE_LIST_H
+
+/* List of spectra filenames given on the command line, in a list file
+   or with a pattern like spectrum###.dat[1-49,2]. */
+struct file_list {
+    char **names;
+    int number;
+    int alloc;
+};
+
+extern void file_list_add(struct file_list *lst, const char *name);
+extern void file_list_free(struct file_list *lst);
+extern int  file_list_read(struct file_list *lst, const char *filename);
+extern int  file_list_pattern(struct file_list *lst, const char *pattern);
+
+#endif
@@ -0,0 +1,267 @@
+/* regress-batch: fit a list of spectra with a recipe without the GUI.
+   The results are written as a table with one row per spectrum giving
+   the value of each fit parameter and the chi-square. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "batch.h"
+#include "batch-fit.h"
+#include "batch-recipe.h"
+#include "dispers-classes.h"
+#include "dispers-library.h"
+#include "spectra-archive.h"
+#include "str.h"
+#include "file-list.h"
+
+struct output_table {
+    FILE *f;
+    char sep;
+};
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "Usage: regress-batch [options] <recipe-file> [<spectrum-file> ...]\n"
+            "Options:\n"
+            "  -o <file>     write the results to <file> instead of the standard output\n"
+            "  -t            write tab-separated values instead of comma-separated\n"
+            "  -l <file>     read the names of the spectra from <file>, one per line\n"
+            "  -p <pattern>  fit the spectra given by <pattern>, like spectrum###.dat[1-49,2]\n"
+            "  -a <archive>  fit the spectra of an archive created with regress-pack\n"
+            "  -m <file>     fit the spectra as a wafer map, seeding each fit with the\n"
+            "                results of the nearest site; <file> gives the x and y\n"
+            "                coordinates of each spectrum, one site per line\n"
+            "  -j <n>        use <n> threads, by default one for each processor\n"
+            "  -h            print this help\n");
+}
+
+/* Read the coordinates of the sites, one "x y" pair per line. Returns
+   the number of sites read or -1 if the file cannot be read. */
+static int
+read_sites(const char *filename, struct batch_site **sites)
+{
+    FILE *f = fopen(filename, "r");
+    int number = 0, alloc = 0;
+    str_t line;
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    *sites = NULL;
+    str_init(line, 63);
+    while (str_getline(line, f) >= 0) {
+        struct batch_site site;
+        char tail;
+        int n = sscanf(CSTR(line), "%lf %lf %c", &site.x, &site.y, &tail);
+        if (n == EOF) {
+            continue;
+        }
+        if (n != 2) {
+            free(*sites);
+            number = -1;
+            break;
+        }
+        if (number >= alloc) {
+            alloc = (alloc > 0 ? 2 * alloc : 64);
+            *sites = erealloc(*sites, alloc * sizeof(struct batch_site));
+        }
+        (*sites)[number ++] = site;
+    }
+    str_free(line);
+    fclose(f);
+    return number;
+}
+
+static void
+write_header(struct output_table *out, struct fit_parameters *fps)
+{
+    str_t pname;
+    size_t k;
+
+    str_init(pname, 16);
+    fprintf(out->f, "Filename");
+    for (k = 0; k < fps->number; k++) {
+        get_param_name(&fps->values[k], pname);
+        fprintf(out->f, "%c%s", out->sep, CSTR(pname));
+    }
+    fprintf(out->f, "%cChi Square\n", out->sep);
+    str_free(pname);
+}
+
+static void
+write_result(void *data, int index, const char *filename, const struct batch_result *result)
+{
+    struct output_table *out = data;
+    size_t k;
+
+    if (result->status != 0) {
+        fprintf(stderr, "%s: %s\n", filename, CSTR(result->error_msg));
+        return;
+    }
+
+    fprintf(out->f, "%s", filename);
+    for (k = 0; k < result->x->size; k++) {
+        fprintf(out->f, "%c%g", out->sep, gsl_vector_get(result->x, k));
+    }
+    fprintf(out->f, "%c%g\n", out->sep, result->chisq);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct file_list files[1] = {{NULL, 0, 0}};
+    struct output_table out[1] = {{stdout, ','}};
+    const char *output_filename = NULL;
+    const char *archive_filename = NULL;
+    const char *sites_filename = NULL;
+    struct spectra_archive *archive = NULL;
+    struct batch_site *sites = NULL;
+    int sites_number = 0;
+    struct batch_recipe *recipe;
+    str_ptr error_msg;
+    int threads_number = 0;
+    int opt, failed, k;
+
+    while ((opt = getopt(argc, argv, "o:tl:p:a:m:j:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            output_filename = optarg;
+            break;
+        case 't':
+            out->sep = '\t';
+            break;
+        case 'l':
+            if (file_list_read(files, optarg)) {
+                fprintf(stderr, "regress-batch: cannot read file list \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            if (file_list_pattern(files, optarg)) {
+                fprintf(stderr, "regress-batch: invalid spectra pattern \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            archive_filename = optarg;
+            break;
+        case 'm':
+            sites_filename = optarg;
+            break;
+        case 'j':
+            threads_number = atoi(optarg);
+            if (threads_number <= 0) {
+                fprintf(stderr, "regress-batch: invalid number of threads \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    for (k = optind + 1; k < argc; k++) {
+        file_list_add(files, argv[k]);
+    }
+
+    if (archive_filename && files->number > 0) {
+        fprintf(stderr, "regress-batch: spectra files cannot be given together with an archive\n");
+        file_list_free(files);
+        return EXIT_FAILURE;
+    }
+
+    if (sites_filename) {
+        sites_number = read_sites(sites_filename, &sites);
+        if (sites_number < 0) {
+            fprintf(stderr, "regress-batch: cannot read the sites from \"%s\"\n", sites_filename);
+            file_list_free(files);
+            return EXIT_FAILURE;
+        }
+    }
+
+    init_class_list();
+    dispers_library_init();
+
+    recipe = batch_recipe_load(argv[optind], &error_msg);
+    if (!recipe) {
+        fprintf(stderr, "regress-batch: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        file_list_free(files);
+        return EXIT_FAILURE;
+    }
+
+    if (archive_filename) {
+        archive = spectra_archive_open(archive_filename, &error_msg);
+        if (!archive) {
+            fprintf(stderr, "regress-batch: %s\n", CSTR(error_msg));
+            free_error_message(error_msg);
+            batch_recipe_free(recipe);
+            free(sites);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sites && sites_number != (archive ? archive->number : files->number)) {
+        fprintf(stderr, "regress-batch: the number of sites in \"%s\" is not the number of spectra\n", sites_filename);
+        if (archive) {
+            spectra_archive_close(archive);
+        }
+        batch_recipe_free(recipe);
+        file_list_free(files);
+        free(sites);
+        return EXIT_FAILURE;
+    }
+
+    if (output_filename) {
+        out->f = fopen(output_filename, "w");
+        if (out->f == NULL) {
+            fprintf(stderr, "regress-batch: cannot open \"%s\" for writing\n", output_filename);
+            if (archive) {
+                spectra_archive_close(archive);
+            }
+            batch_recipe_free(recipe);
+            file_list_free(files);
+            free(sites);
+            return EXIT_FAILURE;
+        }
+    }
+
+    write_header(out, recipe->parameters);
+    if (archive && sites) {
+        failed = batch_fit_run_archive_map(recipe, archive, sites, threads_number,
+                                           write_result, out, NULL, NULL);
+    } else if (archive) {
+        failed = batch_fit_run_archive(recipe, archive, threads_number, write_result, out, NULL, NULL);
+    } else if (sites) {
+        failed = batch_fit_run_map(recipe, files->number, (const char * const *) files->names,
+                                   sites, threads_number, write_result, out, NULL, NULL);
+    } else {
+        failed = batch_fit_run(recipe, files->number, (const char * const *) files->names,
+                               threads_number, write_result, out, NULL, NULL);
+    }
+
+    if (output_filename) {
+        fclose(out->f);
+    }
+    if (archive) {
+        spectra_archive_close(archive);
+    }
+    batch_recipe_free(recipe);
+    file_list_free(files);
+    free(sites);
+    return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,158 @@
+/* regress-pack: convert a list of spectra files into a spectra archive
+   that regress-batch can fit without parsing each file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "error-messages.h"
+#include "spectra.h"
+#include "spectra-archive.h"
+#include "str.h"
+#include "file-list.h"
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "Usage: regress-pack [options] <archive-file> [<spectrum-file> ...]\n"
+            "Options:\n"
+            "  -l <file>     read the names of the spectra from <file>, one per line\n"
+            "  -p <pattern>  add the spectra given by <pattern>, like spectrum###.dat[1-49,2]\n"
+            "  -i            list the spectra of an existing archive\n"
+            "  -h            print this help\n");
+}
+
+static const char *
+system_name(enum system_kind system)
+{
+    switch (system) {
+    case SYSTEM_REFLECTOMETER:
+        return "reflectometry";
+    case SYSTEM_ELLISS_AB:
+        return "ellipsometry alpha-beta";
+    case SYSTEM_ELLISS_PSIDEL:
+        return "ellipsometry psi-delta";
+    default:
+        return "unknown";
+    }
+}
+
+static int
+list_archive(const char *filename)
+{
+    struct spectra_archive *archive;
+    str_ptr error_msg;
+    int k;
+
+    archive = spectra_archive_open(filename, &error_msg);
+    if (!archive) {
+        fprintf(stderr, "regress-pack: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        return EXIT_FAILURE;
+    }
+
+    for (k = 0; k < archive->number; k++) {
+        struct spectrum *s = spectra_archive_get(archive, k);
+        printf("%s\t%s\t%d\n", spectra_archive_name(archive, k),
+               system_name(s->config.system), spectra_points(s));
+        spectra_free(s);
+    }
+
+    spectra_archive_close(archive);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct file_list files[1] = {{NULL, 0, 0}};
+    struct spectra_archive_writer *w;
+    str_ptr error_msg;
+    int list_only = 0;
+    int opt, failed = 0, k;
+
+    while ((opt = getopt(argc, argv, "l:p:ih")) != -1) {
+        switch (opt) {
+        case 'l':
+            if (file_list_read(files, optarg)) {
+                fprintf(stderr, "regress-pack: cannot read file list \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            if (file_list_pattern(files, optarg)) {
+                fprintf(stderr, "regress-pack: invalid spectra pattern \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            list_only = 1;
+            break;
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (list_only) {
+        file_list_free(files);
+        return list_archive(argv[optind]);
+    }
+
+    for (k = optind + 1; k < argc; k++) {
+        file_list_add(files, argv[k]);
+    }
+
+    w = spectra_archive_writer_new(argv[optind], &error_msg);
+    if (!w) {
+        fprintf(stderr, "regress-pack: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        file_list_free(files);
+        return EXIT_FAILURE;
+    }
+
+    for (k = 0; k < files->number; k++) {
+        struct spectrum *s = load_gener_spectrum(files->names[k], &error_msg);
+        if (!s) {
+            fprintf(stderr, "regress-pack: %s\n", CSTR(error_msg));
+            free_error_message(error_msg);
+            failed++;
+            continue;
+        }
+        if (spectra_archive_writer_add(w, files->names[k], s, &error_msg)) {
+            spectra_free(s);
+            break;
+        }
+        spectra_free(s);
+    }
+
+    if (k < files->number) {
+        fprintf(stderr, "regress-pack: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        if (spectra_archive_writer_close(w, &error_msg)) {
+            free_error_message(error_msg);
+        }
+        remove(argv[optind]);
+        file_list_free(files);
+        return EXIT_FAILURE;
+    }
+
+    if (spectra_archive_writer_close(w, &error_msg)) {
+        fprintf(stderr, "regress-pack: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        file_list_free(files);
+        return EXIT_FAILURE;
+    }
+
+    file_list_free(files);
+    return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
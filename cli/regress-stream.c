@@ -0,0 +1,361 @@
+/* regress-stream: fit the spectra received on a pipe or a FIFO as they
+   arrive, like for the in-situ monitoring of a deposition. Each spectrum
+   is given as the text of a spectrum file followed by a line with a
+   single dot. When the fits fall behind the acquisition only the latest
+   spectrum received is fitted and the older ones are dropped. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "batch-recipe.h"
+#include "dispers-classes.h"
+#include "dispers-library.h"
+#include "spectra.h"
+#include "stream-fit.h"
+#include "str.h"
+
+struct frame {
+    /* Index of the spectrum in the stream. */
+    int number;
+    /* Time of reception, from stream_fit_clock. */
+    double received;
+    /* NULL if the spectrum cannot be read, "error_msg" giving the reason. */
+    struct spectrum *spectrum;
+    str_ptr error_msg;
+};
+
+/* The reader thread keeps only the latest frame not yet fitted. */
+struct frame_reader {
+    FILE *f;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct frame pending;
+    int has_pending;
+    int end_of_stream;
+    int received, dropped;
+};
+
+struct output_table {
+    FILE *f;
+    char sep;
+};
+
+struct stream_stats {
+    int fitted, grid_searches, interrupted;
+    double fit_time, fit_time_max;
+    double latency, latency_max;
+};
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "Usage: regress-stream [options] <recipe-file> [<input>]\n"
+            "Fit the spectra read from <input>, a pipe or a FIFO, or from the standard input.\n"
+            "Each spectrum is the text of a spectrum file followed by a line with a single dot.\n"
+            "Options:\n"
+            "  -o <file>     write the results to <file> instead of the standard output\n"
+            "  -t            write tab-separated values instead of comma-separated\n"
+            "  -d <ms>       stop the fit of each spectrum within <ms> milliseconds\n"
+            "  -i <n>        do at most <n> Levenberg-Marquardt iterations for each spectrum\n"
+            "  -h            print this help\n");
+}
+
+static void
+frame_free(struct frame *fr)
+{
+    if (fr->spectrum) {
+        spectra_free(fr->spectrum);
+    }
+    if (fr->error_msg) {
+        free_error_message(fr->error_msg);
+    }
+}
+
+static void
+reader_push(struct frame_reader *r, const char *text)
+{
+    struct frame fr[1];
+    str_t name;
+
+    fr->number = r->received;
+    fr->received = stream_fit_clock();
+    fr->error_msg = NULL;
+
+    str_init(name, 16);
+    str_printf(name, "#%d", fr->number);
+    fr->spectrum = read_gener_spectrum(CSTR(name), text, &fr->error_msg);
+    str_free(name);
+
+    pthread_mutex_lock(&r->lock);
+    if (r->has_pending) {
+        frame_free(&r->pending);
+        r->dropped ++;
+    }
+    r->pending = fr[0];
+    r->has_pending = 1;
+    r->received ++;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+reader_run(void *data)
+{
+    struct frame_reader *r = data;
+    str_t line, text;
+    int eof;
+
+    str_init(line, 127);
+    str_init(text, 8192);
+    do {
+        eof = (str_getline(line, r->f) < 0);
+        if (!eof && strcmp(CSTR(line), ".") != 0 && strcmp(CSTR(line), ".\r") != 0) {
+            str_append_c(text, CSTR(line), 0);
+            str_append_c(text, "\n", 0);
+            continue;
+        }
+        if (STR_LENGTH(text) > 0) {
+            reader_push(r, CSTR(text));
+            str_trunc(text, 0);
+        }
+    } while (!eof);
+    str_free(text);
+    str_free(line);
+
+    pthread_mutex_lock(&r->lock);
+    r->end_of_stream = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Wait for the next frame. Returns zero at the end of the stream. */
+static int
+reader_take(struct frame_reader *r, struct frame *fr)
+{
+    int taken = 0;
+    pthread_mutex_lock(&r->lock);
+    while (!r->has_pending && !r->end_of_stream) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if (r->has_pending) {
+        *fr = r->pending;
+        r->has_pending = 0;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return taken;
+}
+
+static void
+write_header(struct output_table *out, struct fit_parameters *fps)
+{
+    str_t pname;
+    size_t k;
+
+    str_init(pname, 16);
+    fprintf(out->f, "Spectrum");
+    for (k = 0; k < fps->number; k++) {
+        get_param_name(&fps->values[k], pname);
+        fprintf(out->f, "%c%s", out->sep, CSTR(pname));
+    }
+    fprintf(out->f, "%cChi Square%cIterations%cFit Time (ms)%cLatency (ms)\n",
+            out->sep, out->sep, out->sep, out->sep);
+    str_free(pname);
+}
+
+static void
+write_result(struct output_table *out, int number, const gsl_vector *x,
+             const struct stream_fit_result *result, double latency)
+{
+    size_t k;
+
+    fprintf(out->f, "%d", number);
+    for (k = 0; k < x->size; k++) {
+        fprintf(out->f, "%c%g", out->sep, gsl_vector_get(x, k));
+    }
+    fprintf(out->f, "%c%g%c%d%c%.2f%c%.2f\n", out->sep, result->chisq,
+            out->sep, result->iter, out->sep, 1.0E3 * result->time,
+            out->sep, 1.0E3 * latency);
+    /* The results are read while the stream goes on. */
+    fflush(out->f);
+}
+
+static void
+stats_add(struct stream_stats *st, const struct stream_fit_result *result, double latency)
+{
+    st->fitted ++;
+    st->grid_searches += result->grid_search;
+    st->interrupted += result->interrupted;
+    st->fit_time += result->time;
+    st->latency += latency;
+    if (result->time > st->fit_time_max) {
+        st->fit_time_max = result->time;
+    }
+    if (latency > st->latency_max) {
+        st->latency_max = latency;
+    }
+}
+
+static void
+stats_print(FILE *f, const struct stream_stats *st, const struct frame_reader *r)
+{
+    fprintf(f, "regress-stream: %d spectra received, %d fitted, %d dropped\n",
+            r->received, st->fitted, r->dropped);
+    if (st->fitted > 0) {
+        fprintf(f, "regress-stream: fit time %.2f ms mean, %.2f ms max\n",
+                1.0E3 * st->fit_time / st->fitted, 1.0E3 * st->fit_time_max);
+        fprintf(f, "regress-stream: latency %.2f ms mean, %.2f ms max\n",
+                1.0E3 * st->latency / st->fitted, 1.0E3 * st->latency_max);
+        fprintf(f, "regress-stream: %d grid searches, %d fits stopped by the deadline\n",
+                st->grid_searches, st->interrupted);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct output_table out[1] = {{stdout, ','}};
+    struct frame_reader reader[1];
+    struct stream_stats stats[1];
+    struct batch_recipe *recipe;
+    struct stream_fit *sf;
+    struct frame fr[1];
+    const char *output_filename = NULL;
+    double deadline = 0.0;
+    int max_iters = 0;
+    str_ptr error_msg;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "o:td:i:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            output_filename = optarg;
+            break;
+        case 't':
+            out->sep = '\t';
+            break;
+        case 'd':
+            deadline = atof(optarg) / 1.0E3;
+            if (deadline <= 0.0) {
+                fprintf(stderr, "regress-stream: invalid deadline \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            max_iters = atoi(optarg);
+            if (max_iters <= 0) {
+                fprintf(stderr, "regress-stream: invalid number of iterations \"%s\"\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || optind + 2 < argc) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    reader->f = stdin;
+    if (optind + 1 < argc && strcmp(argv[optind + 1], "-") != 0) {
+        reader->f = fopen(argv[optind + 1], "r");
+        if (reader->f == NULL) {
+            fprintf(stderr, "regress-stream: cannot open \"%s\"\n", argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    init_class_list();
+    dispers_library_init();
+
+    recipe = batch_recipe_load(argv[optind], &error_msg);
+    if (!recipe) {
+        fprintf(stderr, "regress-stream: %s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+        return EXIT_FAILURE;
+    }
+    if (max_iters > 0) {
+        recipe->config->nb_max_iters = max_iters;
+    }
+
+    if (output_filename) {
+        out->f = fopen(output_filename, "w");
+        if (out->f == NULL) {
+            fprintf(stderr, "regress-stream: cannot open \"%s\" for writing\n", output_filename);
+            batch_recipe_free(recipe);
+            return EXIT_FAILURE;
+        }
+    }
+
+    sf = stream_fit_new(recipe, deadline);
+    memset(stats, 0, sizeof(struct stream_stats));
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    reader->has_pending = 0;
+    reader->end_of_stream = 0;
+    reader->received = 0;
+    reader->dropped = 0;
+    if (pthread_create(&reader->thread, NULL, reader_run, reader) != 0) {
+        fprintf(stderr, "regress-stream: cannot start the reader thread\n");
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->lock);
+        stream_fit_free(sf);
+        if (reader->f != stdin) {
+            fclose(reader->f);
+        }
+        if (output_filename) {
+            fclose(out->f);
+        }
+        batch_recipe_free(recipe);
+        return EXIT_FAILURE;
+    }
+
+    write_header(out, recipe->parameters);
+
+    while (reader_take(reader, fr)) {
+        struct stream_fit_result result[1];
+
+        if (!fr->spectrum) {
+            fprintf(stderr, "regress-stream: %s\n", CSTR(fr->error_msg));
+            failed ++;
+        } else if (stream_fit_spectrum(sf, fr->spectrum, result)) {
+            fprintf(stderr, "regress-stream: spectrum #%d: %s\n", fr->number, CSTR(result->error_msg));
+            free_error_message(result->error_msg);
+            failed ++;
+        } else {
+            const double latency = stream_fit_clock() - fr->received;
+            write_result(out, fr->number, sf->x, result, latency);
+            stats_add(stats, result, latency);
+        }
+        frame_free(fr);
+    }
+
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->lock);
+
+    stats_print(stderr, stats, reader);
+
+    stream_fit_free(sf);
+    if (reader->f != stdin) {
+        fclose(reader->f);
+    }
+    if (output_filename) {
+        fclose(out->f);
+    }
+    batch_recipe_free(recipe);
+    return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
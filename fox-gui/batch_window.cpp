@@ -1,10 +1,17 @@
 #include "batch_window.h"
-#include "grid-search.h"
+#include "batch-fit.h"
 #include "regress_pro_window.h"
 #include "error-messages.h"
 
+struct batch_run_data {
+    ProgressInfo *progress;
+    filelist_table *table;
+    str_ptr error_msg;
+};
+
 extern "C" {
-    static int window_process_events(void *data, float p, const char *msg);
+    static int batch_process_events(void *data, float p, const char *msg);
+    static void batch_set_result(void *data, int index, const char *filename, const batch_result *result);
 };
 
 // Map
@@ -55,34 +62,33 @@ int batch_window::batch_run(fit_recipe *recipe, str_ptr *error_msg)
 
     table->removeRange(0, table->samples_number() - 1, 1, table->getNumColumns() - 1);
 
-    fit_engine *fit = fit_engine_new();
-    fit_engine_bind(fit, recipe->stack, recipe->config, recipe->parameters);
+    const int samples_number = table->samples_number();
+    FXString *names = new FXString[samples_number];
+    const char **filenames = new const char *[samples_number];
+    for (int i = 0; i < samples_number; i++) {
+        names[i] = table->getItemText(i, 0);
+        filenames[i] = names[i].text();
+    }
 
-    FXString result;
-    for (int i = 0; i < table->samples_number(); i++) {
-        FXString name = table->getItemText(i, 0);
-        spectrum *s = load_gener_spectrum(name.text(), error_msg);
-        if (!s) {
-            return 1;
-        }
-        double chisq;
-        fit_engine_prepare(fit, s);
-        lmfit_grid(fit, recipe->seeds_list, &chisq, NULL, NULL, LMFIT_PRESERVE_STACK,
-                   window_process_events, this);
-
-        unsigned j;
-        for (j = 0; j < recipe->parameters->number; j++) {
-            result.format("%g", gsl_vector_get(fit->run->results, j));
-            table->setItemText(i, j + 1, result);
-        }
-        result.format("%g", chisq);
-        table->setItemText(i, j + 1, result);
+    batch_recipe brecipe;
+    brecipe.stack = recipe->stack;
+    brecipe.config[0] = recipe->config[0];
+    brecipe.parameters = recipe->parameters;
+    brecipe.seeds_list = recipe->seeds_list;
 
-        fit_engine_disable(fit);
-        spectra_free(s);
-    }
+    ProgressInfo progress(getApp(), this);
+    batch_run_data data = {&progress, table, NULL};
+    batch_fit_run(&brecipe, samples_number, filenames, 0, batch_set_result, &data,
+                  batch_process_events, &data);
+    progress.hide();
+
+    delete [] filenames;
+    delete [] names;
 
-    fit_engine_free(fit);
+    if (data.error_msg) {
+        *error_msg = data.error_msg;
+        return 1;
+    }
     return 0;
 }
 
@@ -99,11 +105,35 @@ long batch_window::on_cmd_run_batch(FXObject *, FXSelector, void *)
     return 1;
 }
 
+// The batch stops at the first spectrum that cannot be fitted or when the
+// progress dialog is cancelled.
 int
-window_process_events(void *data, float p, const char *msg)
+batch_process_events(void *_data, float p, const char *msg)
 {
-    FXWindow *win = (FXWindow *) data;
-    FXApp *app = win->getApp();
-    app->runModalWhileEvents(win);
-    return 0;
+    batch_run_data *data = (batch_run_data *) _data;
+    if (data->error_msg) {
+        return 1;
+    }
+    return process_foxgui_events(data->progress, p, msg);
+}
+
+void
+batch_set_result(void *_data, int index, const char *filename, const batch_result *result)
+{
+    batch_run_data *data = (batch_run_data *) _data;
+    if (result->status != 0) {
+        if (!data->error_msg) {
+            data->error_msg = str_new();
+            str_copy(data->error_msg, result->error_msg);
+        }
+        return;
+    }
+    FXString text;
+    unsigned j;
+    for (j = 0; j < result->x->size; j++) {
+        text.format("%g", gsl_vector_get(result->x, j));
+        data->table->setItemText(index, j + 1, text);
+    }
+    text.format("%g", result->chisq);
+    data->table->setItemText(index, j + 1, text);
 }
@@ -23,6 +23,9 @@ FXDEFMAP(recipe_window) recipe_window_map[]= {
     FXMAPFUNC(SEL_CHANGED, recipe_window::ID_CHISQ_THRESHOLD, recipe_window::on_changed_threshold),
     FXMAPFUNC(SEL_CHANGED, recipe_window::ID_ITERATIONS, recipe_window::on_changed_iterations),
     FXMAPFUNC(SEL_CHANGED, recipe_window::ID_SUBSAMPLE, recipe_window::on_changed_subsampling),
+    FXMAPFUNC(SEL_CHANGED, recipe_window::ID_THREADS, recipe_window::on_changed_threads),
+    FXMAPFUNC(SEL_COMMAND, recipe_window::ID_GRID_SEARCH, recipe_window::on_cmd_grid_search),
+    FXMAPFUNC(SEL_COMMAND, recipe_window::ID_SOLVER, recipe_window::on_cmd_solver),
     FXMAPFUNC(SEL_COMMAND, recipe_window::ID_STACK_CHANGE, recipe_window::on_cmd_stack_change),
     FXMAPFUNC(SEL_COMMAND, recipe_window::ID_DELETE, recipe_window::onCmdHide),
     FXMAPFUNC(SEL_COMMAND, recipe_window::ID_MULTI_SAMPLE, recipe_window::on_cmd_multi_sample),
@@ -55,6 +58,22 @@ recipe_window::recipe_window(fit_recipe *rcp, FXComposite *p, FXuint opts, FXint
     new FXLabel(rmatrix, "Sub sampling");
     subsamp_textfield = new FXTextField(rmatrix, 5, this, ID_SUBSAMPLE, FRAME_SUNKEN|TEXTFIELD_INTEGER);
     subsamp_textfield->setTipText("Enable subsampling of spectra to speedup calculations");
+    new FXLabel(rmatrix, "Threads");
+    threads_textfield = new FXTextField(rmatrix, 5, this, ID_THREADS, FRAME_SUNKEN|TEXTFIELD_INTEGER);
+    threads_textfield->setTipText("Number of threads used to compute the spectra during the fit");
+    new FXLabel(rmatrix, "Grid Search");
+    grid_search_listbox = new FXListBox(rmatrix, this, ID_GRID_SEARCH, LISTBOX_NORMAL|FRAME_SUNKEN);
+    grid_search_listbox->setNumVisible(3);
+    grid_search_listbox->appendItem("Full");
+    grid_search_listbox->appendItem("Adaptive");
+    grid_search_listbox->appendItem("Prescreen");
+    grid_search_listbox->setTipText("Strategy used to explore the grid of range seeds");
+    new FXLabel(rmatrix, "Solver");
+    solver_listbox = new FXListBox(rmatrix, this, ID_SOLVER, LISTBOX_NORMAL|FRAME_SUNKEN);
+    solver_listbox->setNumVisible(2);
+    solver_listbox->appendItem("Standard");
+    solver_listbox->appendItem("Normal equations");
+    solver_listbox->setTipText("Levenberg-Marquardt solver, normal equations use less memory on long spectra");
     multi_sample_button = new FXCheckButton(sgb, "Enable multi-sample", this, ID_MULTI_SAMPLE);
 
     setup_config_parameters();
@@ -111,6 +130,14 @@ void recipe_window::setup_config_parameters()
     } else {
         subsamp_textfield->setText("");
     }
+    if (recipe->config->threads > 1) {
+        text.format("%d", recipe->config->threads);
+        threads_textfield->setText(text);
+    } else {
+        threads_textfield->setText("");
+    }
+    grid_search_listbox->setCurrentItem(recipe->config->grid_search);
+    solver_listbox->setCurrentItem(recipe->config->solver);
 }
 
 void recipe_window::setup_parameters_list()
@@ -383,6 +410,34 @@ recipe_window::on_changed_subsampling(FXObject *, FXSelector sel, void *ptr)
     return 1;
 }
 
+long
+recipe_window::on_changed_threads(FXObject *, FXSelector sel, void *ptr)
+{
+    FXchar *txt = (FXchar *) ptr;
+    char *tail;
+    long n = strtol(txt, &tail, 10);
+    if (tail != txt && n > 1) {
+        recipe->config->threads = n;
+    } else {
+        recipe->config->threads = 1;
+    }
+    return 1;
+}
+
+long
+recipe_window::on_cmd_grid_search(FXObject *, FXSelector, void *ptr)
+{
+    recipe->config->grid_search = (enum grid_search_mode) (FXival) ptr;
+    return 1;
+}
+
+long
+recipe_window::on_cmd_solver(FXObject *, FXSelector, void *ptr)
+{
+    recipe->config->solver = (enum fit_solver) (FXival) ptr;
+    return 1;
+}
+
 long
 recipe_window::on_cmd_stack_change(FXObject *, FXSelector, void *)
 {
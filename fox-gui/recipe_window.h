@@ -31,6 +31,9 @@ public:
     long on_changed_threshold(FXObject*, FXSelector, void*);
     long on_changed_iterations(FXObject*, FXSelector, void*);
     long on_changed_subsampling(FXObject*, FXSelector, void*);
+    long on_changed_threads(FXObject*, FXSelector, void*);
+    long on_cmd_grid_search(FXObject*, FXSelector, void*);
+    long on_cmd_solver(FXObject*, FXSelector, void*);
     long on_cmd_stack_change(FXObject*, FXSelector, void*);
     long on_select_parameter(FXObject*, FXSelector, void*);
     long on_cmd_multi_sample(FXObject *, FXSelector, void *ptr);
@@ -48,6 +51,9 @@ public:
         ID_CHISQ_THRESHOLD,
         ID_ITERATIONS,
         ID_SUBSAMPLE,
+        ID_THREADS,
+        ID_GRID_SEARCH,
+        ID_SOLVER,
         ID_STACK_CHANGE,
         ID_MULTI_SAMPLE,
         ID_PARAM_INDIV,
@@ -80,6 +86,9 @@ private:
     FXTextField *range_tf;
     FXList *fit_list;
     FXTextField *range_textfield, *chisq_textfield, *iter_textfield, *subsamp_textfield;
+    FXTextField *threads_textfield;
+    FXListBox *grid_search_listbox;
+    FXListBox *solver_listbox;
 
     fit_recipe *recipe;
     fit_parameters *param_list;
@@ -0,0 +1,683 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "batch-fit.h"
+#include "grid-search.h"
+#include "spectra.h"
+#include "fit-params.h"
+
+/* Each worker owns a queue of spectra indexes. The owner takes the spectra
+   from the head of its queue and, once its own queue is empty, steals from
+   the tail of the other workers' queues. */
+struct batch_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int *queue;
+    int head, tail;
+    struct fit_engine *fit;
+    /* Not zero if "fit" is prepared for the last spectrum fitted. */
+    int prepared;
+    /* Seeds taken from a neighbouring site, wafer map mode only. */
+    struct seeds *warm_seeds;
+    struct batch_job *job;
+};
+
+/* The spectra of a batch run are read from a list of files or, if
+   "archive" is not NULL, taken from a spectra archive. When "sites" is
+   not NULL the spectra are the sites of a wafer map. */
+struct batch_source {
+    int number;
+    const char * const *filenames;
+    const struct spectra_archive *archive;
+    const struct batch_site *sites;
+};
+
+/* Wafer map mode: the sites are fitted in the given order, from the
+   centre of the map outward, and each site is seeded with the results of
+   the nearest site that comes before it in the order. */
+struct batch_map {
+    int *order;
+    /* For each site the index of the neighbour used for the seeds, -1 for
+       the first site of the order. */
+    int *neighbour;
+    /* Next position in "order", protected by the job's "done_lock". */
+    int next;
+    /* Results of each site, valid only if "fitted" is not zero. */
+    double *x;
+    char *fitted;
+};
+
+struct site_distance {
+    double distance;
+    int index;
+};
+
+struct batch_job {
+    const struct batch_recipe *recipe;
+    const struct batch_source *source;
+    struct batch_result *results;
+    char *done;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    struct batch_worker *workers;
+    int workers_number;
+    /* NULL unless the spectra are the sites of a wafer map. */
+    struct batch_map *map;
+    /* Set when the caller's hook asks to stop, protected by "done_lock".
+       The workers do not take any more spectra and the fits in progress
+       are interrupted. */
+    int stop;
+};
+
+/* Hook of the serial batch: the caller's hook is given the progress over
+   the whole batch and a stop request is remembered. */
+struct batch_hook {
+    gui_hook_func_t hfun;
+    void *hdata;
+    int index, number;
+    int stop;
+};
+
+/* Time between two calls of the caller's hook while the results of the
+   worker threads are awaited, in microseconds. */
+#define BATCH_HOOK_INTERVAL 100000
+
+void
+batch_result_init(struct batch_result *r, size_t nb_params)
+{
+    r->status = 0;
+    r->fit_status = 0;
+    r->chisq = -1.0;
+    r->x = gsl_vector_alloc(nb_params);
+    r->error_msg = NULL;
+}
+
+void
+batch_result_free(struct batch_result *r)
+{
+    gsl_vector_free(r->x);
+    if (r->error_msg) {
+        free_error_message(r->error_msg);
+        r->error_msg = NULL;
+    }
+}
+
+static void
+batch_fit_seeds(struct fit_engine *fit, struct seeds *seeds, struct batch_result *result,
+                gui_hook_func_t hfun, void *hdata)
+{
+    result->fit_status = lmfit_grid(fit, seeds, &result->chisq, NULL, NULL,
+                                    LMFIT_PRESERVE_STACK, hfun, hdata);
+    gsl_vector_memcpy(result->x, fit->run->results);
+    result->status = 0;
+}
+
+/* Fit the spectrum "s" and free it. If "*prepared" is not zero the engine
+   is still prepared for the previous spectrum and it is rebound to "s": on
+   a wafer map all the spectra have usually the same wavelengths and the
+   caches of the engine can be reused.
+   If "warm_seeds" is not NULL they are tried first and the recipe's seeds
+   are used only if the chi-square obtained is above the threshold.
+   The hook is passed to the fit, it can interrupt it. */
+static int
+batch_fit_loaded_spectrum(struct fit_engine *fit, int *prepared, struct seeds *seeds,
+                          struct seeds *warm_seeds, struct spectrum *s, const char *name,
+                          struct batch_result *result, gui_hook_func_t hfun, void *hdata)
+{
+    int status;
+
+    if (*prepared) {
+        status = fit_engine_rebind_spectrum(fit, s);
+    } else {
+        status = fit_engine_prepare(fit, s);
+    }
+    *prepared = (status == 0);
+
+    if (status) {
+        result->error_msg = new_error_message(FIT_ERROR, "unsupported kind of spectrum \"%s\"", name);
+        result->status = 1;
+        spectra_free(s);
+        return 1;
+    }
+
+    if (warm_seeds) {
+        batch_fit_seeds(fit, warm_seeds, result, hfun, hdata);
+    }
+    if (!warm_seeds || result->chisq > fit->config->chisq_threshold) {
+        batch_fit_seeds(fit, seeds, result, hfun, hdata);
+    }
+
+    spectra_free(s);
+    return 0;
+}
+
+int
+batch_fit_spectrum(struct fit_engine *fit, struct seeds *seeds,
+                   const char *filename, struct batch_result *result)
+{
+    struct spectrum *s = load_gener_spectrum(filename, &result->error_msg);
+    int prepared = 0, status;
+    if (!s) {
+        result->status = 1;
+        return 1;
+    }
+    status = batch_fit_loaded_spectrum(fit, &prepared, seeds, NULL, s, filename, result, NULL, NULL);
+    if (prepared) {
+        fit_engine_disable(fit);
+    }
+    return status;
+}
+
+static const char *
+source_name(const struct batch_source *src, int index)
+{
+    if (src->archive) {
+        return spectra_archive_name(src->archive, index);
+    }
+    return src->filenames[index];
+}
+
+static int
+source_fit_spectrum(const struct batch_source *src, int index, struct fit_engine *fit,
+                    int *prepared, struct seeds *seeds, struct seeds *warm_seeds,
+                    struct batch_result *result, gui_hook_func_t hfun, void *hdata)
+{
+    struct spectrum *s;
+    if (src->archive) {
+        s = spectra_archive_get(src->archive, index);
+    } else {
+        s = load_gener_spectrum(src->filenames[index], &result->error_msg);
+        if (!s) {
+            result->status = 1;
+            return 1;
+        }
+    }
+    return batch_fit_loaded_spectrum(fit, prepared, seeds, warm_seeds, s, source_name(src, index),
+                                     result, hfun, hdata);
+}
+
+int
+batch_fit_default_threads(void)
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0 ? n : 1);
+#endif
+}
+
+static int
+job_stopped(struct batch_job *job)
+{
+    int stop;
+    pthread_mutex_lock(&job->done_lock);
+    stop = job->stop;
+    pthread_mutex_unlock(&job->done_lock);
+    return stop;
+}
+
+/* Hook given to the fits of the worker threads: the caller's hook is only
+   called from the calling thread. */
+static int
+worker_hook(void *data, float progress, const char *msg)
+{
+    return job_stopped(data);
+}
+
+static int
+worker_take(struct batch_worker *w, int steal)
+{
+    int index = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        index = (steal ? w->queue[-- w->tail] : w->queue[w->head ++]);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return index;
+}
+
+static int
+worker_next_index(struct batch_worker *w)
+{
+    struct batch_job *job = w->job;
+    int index;
+    if (job_stopped(job)) {
+        return -1;
+    }
+    index = worker_take(w, 0);
+    if (index < 0) {
+        const int self = w - job->workers;
+        int k;
+        for (k = 1; k < job->workers_number && index < 0; k++) {
+            index = worker_take(&job->workers[(self + k) % job->workers_number], 1);
+        }
+    }
+    return index;
+}
+
+static int
+compare_site_distance(const void *a, const void *b)
+{
+    const struct site_distance *sa = a, *sb = b;
+    if (sa->distance != sb->distance) {
+        return (sa->distance < sb->distance ? -1 : 1);
+    }
+    return sa->index - sb->index;
+}
+
+static double
+site_distance2(const struct batch_site *a, const struct batch_site *b)
+{
+    const double dx = a->x - b->x, dy = a->y - b->y;
+    return dx * dx + dy * dy;
+}
+
+static struct batch_map *
+batch_map_new(const struct batch_site sites[], int number, size_t nb_params)
+{
+    struct batch_map *map = emalloc(sizeof(struct batch_map));
+    struct site_distance *sd = emalloc(number * sizeof(struct site_distance));
+    struct batch_site centre = {0.0, 0.0};
+    int i, k;
+
+    for (i = 0; i < number; i++) {
+        centre.x += sites[i].x / number;
+        centre.y += sites[i].y / number;
+    }
+
+    for (i = 0; i < number; i++) {
+        sd[i].distance = site_distance2(&sites[i], &centre);
+        sd[i].index = i;
+    }
+    qsort(sd, number, sizeof(struct site_distance), compare_site_distance);
+
+    map->order = emalloc(number * sizeof(int));
+    map->neighbour = emalloc(number * sizeof(int));
+    for (k = 0; k < number; k++) {
+        const int site = sd[k].index;
+        double d_best = -1.0;
+        map->order[k] = site;
+        map->neighbour[site] = -1;
+        for (i = 0; i < k; i++) {
+            const double d = site_distance2(&sites[site], &sites[map->order[i]]);
+            if (d_best < 0 || d < d_best) {
+                map->neighbour[site] = map->order[i];
+                d_best = d;
+            }
+        }
+    }
+    free(sd);
+
+    map->next = 0;
+    map->x = emalloc(number * nb_params * sizeof(double));
+    map->fitted = emalloc(number * sizeof(char));
+    memset(map->fitted, 0, number * sizeof(char));
+    return map;
+}
+
+static void
+batch_map_free(struct batch_map *map)
+{
+    free(map->order);
+    free(map->neighbour);
+    free(map->x);
+    free(map->fitted);
+    free(map);
+}
+
+/* Take the next site of the map and wait until its neighbour is fitted.
+   The warm seeds are NULL if the neighbour is missing or its fit failed.
+   Returns -1 when no site is left or the batch is stopped. A site taken
+   is always marked as done, even if the batch is stopped meanwhile,
+   since another worker may be waiting for it. */
+static int
+map_next_site(struct batch_worker *w, struct seeds **warm_seeds)
+{
+    struct batch_job *job = w->job;
+    struct batch_map *map = job->map;
+    const size_t nb_params = job->recipe->parameters->number;
+    int index, nb;
+    size_t k;
+
+    pthread_mutex_lock(&job->done_lock);
+    if (job->stop || map->next >= job->source->number) {
+        pthread_mutex_unlock(&job->done_lock);
+        return -1;
+    }
+    index = map->order[map->next ++];
+    nb = map->neighbour[index];
+    if (nb >= 0) {
+        while (!job->done[nb]) {
+            pthread_cond_wait(&job->done_cond, &job->done_lock);
+        }
+    }
+    pthread_mutex_unlock(&job->done_lock);
+
+    *warm_seeds = NULL;
+    if (nb >= 0 && map->fitted[nb]) {
+        for (k = 0; k < nb_params; k++) {
+            w->warm_seeds->values[k].seed = map->x[nb * nb_params + k];
+        }
+        *warm_seeds = w->warm_seeds;
+    }
+    return index;
+}
+
+static void *
+batch_worker_run(void *data)
+{
+    struct batch_worker *w = data;
+    struct batch_job *job = w->job;
+    struct batch_map *map = job->map;
+    struct seeds *warm_seeds = NULL;
+    int index;
+
+    while ((index = (map ? map_next_site(w, &warm_seeds) : worker_next_index(w))) >= 0) {
+        struct batch_result *result = &job->results[index];
+        source_fit_spectrum(job->source, index, w->fit, &w->prepared,
+                            job->recipe->seeds_list, warm_seeds, result,
+                            worker_hook, job);
+
+        if (map && result->status == 0) {
+            const size_t nb_params = result->x->size;
+            memcpy(map->x + index * nb_params, result->x->data, nb_params * sizeof(double));
+            map->fitted[index] = 1;
+        }
+
+        pthread_mutex_lock(&job->done_lock);
+        job->done[index] = 1;
+        pthread_cond_broadcast(&job->done_cond);
+        pthread_mutex_unlock(&job->done_lock);
+    }
+    return NULL;
+}
+
+static int
+serial_hook(void *data, float progress, const char *msg)
+{
+    struct batch_hook *hook = data;
+    if (hook->hfun && !hook->stop) {
+        const float p = (hook->index + progress) / hook->number;
+        hook->stop = (*hook->hfun)(hook->hdata, p, msg);
+    }
+    return hook->stop;
+}
+
+static int
+batch_fit_run_serial(const struct batch_recipe *recipe, const struct batch_source *src,
+                     batch_result_func_t rfun, void *rdata,
+                     gui_hook_func_t hfun, void *hdata)
+{
+    const size_t nb_params = recipe->parameters->number;
+    struct batch_hook hook[1] = {{hfun, hdata, 0, src->number, 0}};
+    struct batch_result result[1];
+    int i, status, failed = 0, prepared = 0;
+
+    struct fit_engine *fit = fit_engine_new();
+    fit_engine_bind(fit, recipe->stack, recipe->config, recipe->parameters);
+
+    for (i = 0; i < src->number; i++) {
+        hook->index = i;
+        batch_result_init(result, nb_params);
+        status = source_fit_spectrum(src, i, fit, &prepared, recipe->seeds_list, NULL,
+                                     result, serial_hook, hook);
+        /* The result of an interrupted fit is not given. */
+        if (hook->stop) {
+            batch_result_free(result);
+            break;
+        }
+        failed += status;
+        if (rfun) {
+            (*rfun)(rdata, i, source_name(src, i), result);
+        }
+        batch_result_free(result);
+        if (serial_hook(hook, 1.0, NULL)) {
+            i++;
+            break;
+        }
+    }
+    /* The spectra not fitted because of a stop request. */
+    failed += src->number - i;
+
+    if (prepared) {
+        fit_engine_disable(fit);
+    }
+    fit_engine_free(fit);
+    return failed;
+}
+
+/* Wait for the result of the spectrum "index". While waiting the
+   caller's hook, if any, is called at regular intervals. Returns non-zero
+   if the batch is stopped. */
+static int
+job_wait_result(struct batch_job *job, int index, gui_hook_func_t hfun, void *hdata)
+{
+    const float progress = (float) index / job->source->number;
+    int stop;
+
+    pthread_mutex_lock(&job->done_lock);
+    while (!job->done[index] && !job->stop) {
+        struct timeval now[1];
+        struct timespec limit[1];
+        long usec;
+
+        if (hfun == NULL) {
+            pthread_cond_wait(&job->done_cond, &job->done_lock);
+            continue;
+        }
+
+        gettimeofday(now, NULL);
+        usec = now->tv_usec + BATCH_HOOK_INTERVAL;
+        limit->tv_sec = now->tv_sec + usec / 1000000;
+        limit->tv_nsec = (usec % 1000000) * 1000;
+        if (pthread_cond_timedwait(&job->done_cond, &job->done_lock, limit) != 0) {
+            pthread_mutex_unlock(&job->done_lock);
+            stop = (*hfun)(hdata, progress, NULL);
+            pthread_mutex_lock(&job->done_lock);
+            if (stop) {
+                job->stop = 1;
+            }
+        }
+    }
+    stop = job->stop;
+    pthread_mutex_unlock(&job->done_lock);
+    return stop;
+}
+
+static void
+job_request_stop(struct batch_job *job)
+{
+    pthread_mutex_lock(&job->done_lock);
+    job->stop = 1;
+    pthread_mutex_unlock(&job->done_lock);
+}
+
+static int
+batch_run(const struct batch_recipe *recipe, const struct batch_source *src,
+          int threads_number, batch_result_func_t rfun, void *rdata,
+          gui_hook_func_t hfun, void *hdata)
+{
+    const int files_number = src->number;
+    const size_t nb_params = recipe->parameters->number;
+    struct fit_config config[1];
+    struct batch_job job[1];
+    int i, k, started, failed = 0;
+
+    if (threads_number <= 0) {
+        threads_number = batch_fit_default_threads();
+    }
+    if (threads_number > files_number) {
+        threads_number = files_number;
+    }
+    /* The sites of a wafer map are not fitted in the order of the list
+       so they always go through the worker threads. */
+    if (threads_number <= 1 && (src->sites == NULL || files_number == 0)) {
+        return batch_fit_run_serial(recipe, src, rfun, rdata, hfun, hdata);
+    }
+
+    job->recipe = recipe;
+    job->source = src;
+    job->results = emalloc(files_number * sizeof(struct batch_result));
+    job->done = emalloc(files_number * sizeof(char));
+    memset(job->done, 0, files_number * sizeof(char));
+    pthread_mutex_init(&job->done_lock, NULL);
+    pthread_cond_init(&job->done_cond, NULL);
+    job->workers = emalloc(threads_number * sizeof(struct batch_worker));
+    job->workers_number = threads_number;
+    job->stop = 0;
+
+    for (i = 0; i < files_number; i++) {
+        batch_result_init(&job->results[i], nb_params);
+    }
+
+    job->map = (src->sites ? batch_map_new(src->sites, files_number, nb_params) : NULL);
+
+    /* The spectra are already fitted in parallel so each fit engine
+       uses a single thread. */
+    config[0] = recipe->config[0];
+    if (threads_number > 1) {
+        config->threads = 1;
+    }
+
+    /* The spectra are dealt in round-robin so that the results at the
+       beginning of the list are ready first. The sites of a wafer map are
+       taken instead in the order of the map. */
+    for (k = 0; k < threads_number; k++) {
+        struct batch_worker *w = &job->workers[k];
+        w->queue = emalloc((files_number / threads_number + 1) * sizeof(int));
+        w->head = 0;
+        w->tail = 0;
+        for (i = k; i < files_number && !job->map; i += threads_number) {
+            w->queue[w->tail ++] = i;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        w->fit = fit_engine_new();
+        fit_engine_bind(w->fit, recipe->stack, config, recipe->parameters);
+        w->prepared = 0;
+        w->warm_seeds = NULL;
+        if (job->map) {
+            w->warm_seeds = seed_list_new();
+            for (i = 0; i < nb_params; i++) {
+                seed_list_add_simple(w->warm_seeds, 0.0);
+            }
+        }
+        w->job = job;
+    }
+
+    for (started = 0; started < threads_number; started++) {
+        struct batch_worker *w = &job->workers[started];
+        if (pthread_create(&w->thread, NULL, batch_worker_run, w) != 0) {
+            break;
+        }
+    }
+    /* The workers started take also the spectra of the other ones. If no
+       thread could be started the spectra are all fitted here. */
+    if (started == 0) {
+        batch_worker_run(&job->workers[0]);
+    }
+
+    for (i = 0; i < files_number; i++) {
+        if (job_wait_result(job, i, hfun, hdata)) {
+            break;
+        }
+        failed += job->results[i].status;
+        if (rfun) {
+            (*rfun)(rdata, i, source_name(src, i), &job->results[i]);
+        }
+        batch_result_free(&job->results[i]);
+        if (hfun && (*hfun)(hdata, (float) (i + 1) / files_number, NULL)) {
+            job_request_stop(job);
+            i++;
+            break;
+        }
+    }
+
+    for (k = 0; k < started; k++) {
+        pthread_join(job->workers[k].thread, NULL);
+    }
+
+    /* The spectra not given to "rfun" because of a stop request. */
+    failed += files_number - i;
+    for (; i < files_number; i++) {
+        batch_result_free(&job->results[i]);
+    }
+
+    for (k = 0; k < threads_number; k++) {
+        struct batch_worker *w = &job->workers[k];
+        if (w->prepared) {
+            fit_engine_disable(w->fit);
+        }
+        if (w->warm_seeds) {
+            seed_list_free(w->warm_seeds);
+        }
+        fit_engine_free(w->fit);
+        pthread_mutex_destroy(&w->lock);
+        free(w->queue);
+    }
+
+    if (job->map) {
+        batch_map_free(job->map);
+    }
+    pthread_cond_destroy(&job->done_cond);
+    pthread_mutex_destroy(&job->done_lock);
+    free(job->workers);
+    free(job->done);
+    free(job->results);
+    return failed;
+}
+
+int
+batch_fit_run(const struct batch_recipe *recipe,
+              int files_number, const char * const filenames[],
+              int threads_number,
+              batch_result_func_t rfun, void *rdata,
+              gui_hook_func_t hfun, void *hdata)
+{
+    const struct batch_source src[1] = {{files_number, filenames, NULL, NULL}};
+    return batch_run(recipe, src, threads_number, rfun, rdata, hfun, hdata);
+}
+
+int
+batch_fit_run_archive(const struct batch_recipe *recipe,
+                      const struct spectra_archive *archive,
+                      int threads_number,
+                      batch_result_func_t rfun, void *rdata,
+                      gui_hook_func_t hfun, void *hdata)
+{
+    const struct batch_source src[1] = {{archive->number, NULL, archive, NULL}};
+    return batch_run(recipe, src, threads_number, rfun, rdata, hfun, hdata);
+}
+
+int
+batch_fit_run_map(const struct batch_recipe *recipe,
+                  int files_number, const char * const filenames[],
+                  const struct batch_site sites[],
+                  int threads_number,
+                  batch_result_func_t rfun, void *rdata,
+                  gui_hook_func_t hfun, void *hdata)
+{
+    const struct batch_source src[1] = {{files_number, filenames, NULL, sites}};
+    return batch_run(recipe, src, threads_number, rfun, rdata, hfun, hdata);
+}
+
+int
+batch_fit_run_archive_map(const struct batch_recipe *recipe,
+                          const struct spectra_archive *archive,
+                          const struct batch_site sites[],
+                          int threads_number,
+                          batch_result_func_t rfun, void *rdata,
+                          gui_hook_func_t hfun, void *hdata)
+{
+    const struct batch_source src[1] = {{archive->number, NULL, archive, sites}};
+    return batch_run(recipe, src, threads_number, rfun, rdata, hfun, hdata);
+}
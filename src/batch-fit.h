@@ -0,0 +1,91 @@
+#ifndef BATCH_FIT_H
+#define BATCH_FIT_H
+
+#include <gsl/gsl_vector.h>
+
+#include "defs.h"
+#include "batch-recipe.h"
+#include "error-messages.h"
+#include "fit-engine.h"
+#include "lmfit.h"
+#include "spectra-archive.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+struct batch_result {
+    /* Zero if the spectrum was loaded and fitted. When not zero the
+       "error_msg" field gives the reason. */
+    int status;
+    /* GSL status returned by the Levenberg-Marquardt search. */
+    int fit_status;
+    double chisq;
+    /* Values of the recipe's fit parameters. */
+    gsl_vector *x;
+    str_ptr error_msg;
+};
+
+/* Position of a site on the wafer. */
+struct batch_site {
+    double x, y;
+};
+
+/* Called once for each spectrum, in the same order of the file list. */
+typedef void (*batch_result_func_t)(void *data, int index, const char *filename,
+                                    const struct batch_result *result);
+
+extern void batch_result_init(struct batch_result *r, size_t nb_params);
+extern void batch_result_free(struct batch_result *r);
+
+extern int  batch_fit_spectrum(struct fit_engine *fit, struct seeds *seeds,
+                               const char *filename, struct batch_result *result);
+
+/* Fit each spectrum of the list using the given recipe. The spectra are
+   shared between "threads_number" worker threads, each with its own
+   fit_engine. If "threads_number" is zero the number of online processors
+   is used. The results are always given to "rfun" in the order of the list
+   and from the calling thread.
+   The hook "hfun", if not NULL, is called from the calling thread with the
+   progress of the batch, also while the fits are running. If it returns
+   non-zero the batch is stopped: the fits in progress are interrupted and
+   the remaining spectra are not given to "rfun".
+   Returns the number of spectra that could not be fitted, including those
+   not fitted because of a stop. */
+extern int  batch_fit_run(const struct batch_recipe *recipe,
+                          int files_number, const char * const filenames[],
+                          int threads_number,
+                          batch_result_func_t rfun, void *rdata,
+                          gui_hook_func_t hfun, void *hdata);
+
+/* Same as batch_fit_run for the spectra of an archive. The names stored in
+   the archive are given to "rfun" as the filenames. */
+extern int  batch_fit_run_archive(const struct batch_recipe *recipe,
+                                  const struct spectra_archive *archive,
+                                  int threads_number,
+                                  batch_result_func_t rfun, void *rdata,
+                                  gui_hook_func_t hfun, void *hdata);
+
+/* Same as batch_fit_run for the sites of a wafer map, "sites" giving the
+   position of each spectrum. The sites are fitted from the centre of the
+   map outward. Each fit starts from the results of the nearest site
+   already fitted, without any grid search, and the recipe's seeds are
+   used only if the chi-square obtained is above the recipe's threshold. */
+extern int  batch_fit_run_map(const struct batch_recipe *recipe,
+                              int files_number, const char * const filenames[],
+                              const struct batch_site sites[],
+                              int threads_number,
+                              batch_result_func_t rfun, void *rdata,
+                              gui_hook_func_t hfun, void *hdata);
+
+extern int  batch_fit_run_archive_map(const struct batch_recipe *recipe,
+                                      const struct spectra_archive *archive,
+                                      const struct batch_site sites[],
+                                      int threads_number,
+                                      batch_result_func_t rfun, void *rdata,
+                                      gui_hook_func_t hfun, void *hdata);
+
+extern int  batch_fit_default_threads(void);
+
+__END_DECLS
+
+#endif
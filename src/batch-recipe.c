@@ -0,0 +1,82 @@
+#include "batch-recipe.h"
+#include "error-messages.h"
+#include "str-util.h"
+
+struct batch_recipe *
+batch_recipe_read(lexer_t *l)
+{
+    struct batch_recipe *r;
+    struct fit_config config[1];
+    struct fit_parameters *parameters;
+    struct seeds *seeds_list;
+    stack_t *stack = stack_read(l);
+    if (!stack) return NULL;
+    if (fit_config_read(l, config)) goto stack_fail;
+    parameters = fit_parameters_read(l);
+    if (!parameters) goto stack_fail;
+    seeds_list = seed_list_read(l);
+    if (!seeds_list) goto params_fail;
+    r = emalloc(sizeof(struct batch_recipe));
+    r->stack = stack;
+    r->config[0] = *config;
+    r->parameters = parameters;
+    r->seeds_list = seeds_list;
+    return r;
+params_fail:
+    fit_parameters_free(parameters);
+stack_fail:
+    stack_free(stack);
+    return NULL;
+}
+
+struct batch_recipe *
+batch_recipe_load(const char *filename, str_ptr *error_msg)
+{
+    struct batch_recipe *r;
+    str_t content;
+
+    str_init(content, 1024);
+    if (str_loadfile(filename, content) != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot read file \"%s\".", filename);
+        str_free(content);
+        return NULL;
+    }
+
+    lexer_t *l = lexer_new(CSTR(content));
+    r = batch_recipe_read(l);
+    lexer_free(l);
+    str_free(content);
+
+    if (!r) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Invalid recipe file \"%s\".", filename);
+        return NULL;
+    }
+
+    if (r->parameters->number == 0) {
+        *error_msg = new_error_message(RECIPE_CHECK, "no fit parameters defined");
+        goto recipe_fail;
+    }
+
+    if (r->seeds_list->number != r->parameters->number) {
+        *error_msg = new_error_message(RECIPE_CHECK, "the number of seeds does not match the number of fit parameters");
+        goto recipe_fail;
+    }
+
+    if (check_fit_parameters(r->stack, r->parameters, error_msg)) {
+        goto recipe_fail;
+    }
+
+    return r;
+recipe_fail:
+    batch_recipe_free(r);
+    return NULL;
+}
+
+void
+batch_recipe_free(struct batch_recipe *r)
+{
+    seed_list_free(r->seeds_list);
+    fit_parameters_free(r->parameters);
+    stack_free(r->stack);
+    free(r);
+}
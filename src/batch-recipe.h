@@ -0,0 +1,29 @@
+#ifndef BATCH_RECIPE_H
+#define BATCH_RECIPE_H
+
+#include "defs.h"
+#include "stack.h"
+#include "fit-engine.h"
+#include "fit-params.h"
+#include "lexer.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+/* C counterpart of the fit_recipe used by the GUI application. It holds
+   only what is needed to fit a single spectrum: the optional multi-sample
+   and dataset sections of a recipe file are not read. */
+struct batch_recipe {
+    stack_t *stack;
+    struct fit_config config[1];
+    struct fit_parameters *parameters;
+    struct seeds *seeds_list;
+};
+
+extern struct batch_recipe *batch_recipe_read(lexer_t *l);
+extern struct batch_recipe *batch_recipe_load(const char *filename, str_ptr *error_msg);
+extern void                 batch_recipe_free(struct batch_recipe *r);
+
+__END_DECLS
+
+#endif
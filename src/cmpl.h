@@ -28,6 +28,41 @@ inline double cimag(cmpl z)
 #include <complex.h>
 
 typedef double complex cmpl;
+
+/* Phase factor exp(z) of the layer propagation in the kernels. The
+   modulus exp(Re z) and the phase Im z are computed separately with the
+   real exp, sin and cos functions, skipping the special cases of cexp for
+   infinite and NaN arguments. The relative error is within 3 ulp for any
+   z with exp(Re z) in the range of normal doubles. For absorbing media
+   Re z <= 0 and |exp(z)| <= 1. */
+static inline cmpl
+cmpl_phase_factor(cmpl z)
+{
+    const double a = exp(creal(z));
+    return a * cos(cimag(z)) + I * (a * sin(cimag(z)));
+}
+
+/* Phase factors exp(z[i]) for "n" values given by their real parts "z_re"
+   and imaginary parts "z_im", stored in "p_re" and "p_im". Same method
+   and error bound as cmpl_phase_factor but each function is computed in
+   its own loop so that the loops can be vectorized. Otherwise the compiler
+   merges the sine and the cosine in a sincos call. Both functions are
+   compared with cexp by "make bench" in cli/. */
+static inline void
+cmpl_phase_factor_planes(int n, const double z_re[], const double z_im[],
+                         double p_re[], double p_im[])
+{
+    int i;
+    for(i = 0; i < n; i++) {
+        p_re[i] = exp(z_re[i]);
+    }
+    for(i = 0; i < n; i++) {
+        p_im[i] = p_re[i] * sin(z_im[i]);
+    }
+    for(i = 0; i < n; i++) {
+        p_re[i] *= cos(z_im[i]);
+    }
+}
 #endif /* C++ */
 
 #include "common.h"
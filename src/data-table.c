@@ -3,47 +3,87 @@
 #include <string.h>
 
 #include "data-table.h"
+#include "number-parse.h"
 
 struct data_table empty_data_table[1] = {{0, 0, -1, {0.0}}};
 
-struct data_table *
-data_table_read_lines(FILE *f, const char *fmt, int row_start, int columns) {
-    struct generic_array *data = ARRAY_NEW(float);
-    struct data_table *r = NULL;
-    int rows, nread, j;
-
-    for(j = 0, rows = 0; /* */; rows++, j += columns) {
-        float *val;
-
-        ARRAY_CHECK_ALLOC(data, float, j + columns - 1);
-
-        data->number += columns;
+static const char *
+skip_blanks(const char *s)
+{
+    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') {
+        s ++;
+    }
+    return s;
+}
 
-        val = ((float *) data->heap) + j;
+enum { ROW_OK, ROW_END_OF_TEXT, ROW_NO_MATCH };
 
-        if(columns == 2) {
-            nread = fscanf(f, fmt, & val[0], & val[1]);
-        } else if(columns == 3) {
-            nread = fscanf(f, fmt, & val[0], & val[1], & val[2]);
+/* Read the fields of a row at "*ps", storing the values in "val". When a
+   field does not match tell if it is because the text is ended. */
+static int
+read_text_row(const char **ps, const char *fields, float *val)
+{
+    const char *s = *ps, *fc;
+    for (fc = fields; *fc; fc++) {
+        s = skip_blanks(s);
+        if (*s == 0) {
+            return ROW_END_OF_TEXT;
+        }
+        if (*fc == 'f' || *fc == 'x') {
+            double x;
+            int n;
+            if (parse_double(s, 0, &x, &n)) return ROW_NO_MATCH;
+            if (*fc == 'f') {
+                *(val++) = x;
+            }
+            s += n;
+        } else if (*fc == 's') {
+            while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r') {
+                s ++;
+            }
         } else {
-            assert(0);
+            if (*s != *fc) return ROW_NO_MATCH;
+            s ++;
         }
+    }
+    *ps = s;
+    return ROW_OK;
+}
 
-        if(nread < columns) {
-            if(feof(f) && rows >= 2) {
-                r = data_table_new(rows + row_start, columns);
-                memcpy(r->heap + columns * row_start,
-                       data->heap,
-                       rows * columns * sizeof(float));
-            }
+struct data_table *
+data_table_read_text(const char *text, const char *fields, int columns)
+{
+    struct data_table *r;
+    const char *s, *p;
+    int rows, status, alloc_rows = 1;
 
+    /* One row per line is expected: the table is allocated for the number
+       of lines and shrunk at the end. */
+    for (p = text; (p = strchr(p, '\n')) != NULL; p++) {
+        alloc_rows ++;
+    }
+
+    r = data_table_new(alloc_rows, columns);
+
+    for (s = text, rows = 0; /* */; rows++) {
+        if (rows >= alloc_rows) {
+            alloc_rows *= 2;
+            r = erealloc(r, sizeof(struct data_table) + (alloc_rows * columns - 1) * sizeof(float));
+        }
+        status = read_text_row(&s, fields, r->heap + rows * columns);
+        if (status != ROW_OK) {
             break;
         }
     }
 
-    ARRAY_FREE(data);
+    /* As with scanf a row truncated by the end of the text is ignored. */
+    if (status == ROW_NO_MATCH || rows < 2) {
+        free(r);
+        return NULL;
+    }
 
-    return r;
+    r->rows = rows;
+    return erealloc(r, sizeof(struct data_table) + (rows * columns - 1) * sizeof(float));
 }
 
 struct data_table *
@@ -70,11 +110,13 @@ data_table_unref(struct data_table *table)
         return;
     }
 
-    table->ref_count --;
+    /* the count is updated atomically as data tables may be shared between
+       the threads of a batch run */
+    int count = __sync_sub_and_fetch(&table->ref_count, 1);
 
-    assert(table->ref_count >= 0);
+    assert(count >= 0);
 
-    if(table->ref_count == 0) {
+    if(count == 0) {
         free(table);
     }
 }
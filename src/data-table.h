@@ -10,7 +10,7 @@ __BEGIN_DECLS
 
 #define data_table_get(d,r,c)  ((d)->heap[(d)->columns * (r) + (c)])
 #define data_table_set(d,r,c,v) (d)->heap[(d)->columns * (r) + (c)] = v
-#define data_table_ref(d) if ((d)->ref_count >= 0) { (d)->ref_count++; }
+#define data_table_ref(d) if ((d)->ref_count >= 0) { __sync_fetch_and_add(&(d)->ref_count, 1); }
 
 struct data_table {
     int rows;
@@ -23,8 +23,13 @@ struct data_table * data_table_new(int row, int columns);
 
 void                data_table_unref(struct data_table *dt);
 
-struct data_table * data_table_read_lines(FILE *f, const char *fmt,
-        int row_start, int columns);
+/* Read a table from a text with a row for each line. "fields" gives with a
+   character each whitespace separated field of a row: 'f' for a number
+   stored in the table, 'x' for a number that is skipped, 's' for any word
+   that is skipped. Any other character should appear literally. The rows
+   should extend to the end of the text and be at least two. */
+struct data_table * data_table_read_text(const char *text, const char *fields,
+        int columns);
 
 extern int data_table_write(writer_t *w, const struct data_table *dt);
 extern struct data_table *data_table_read(lexer_t *l);
@@ -6,6 +6,10 @@
 static cmpl cauchy_n_value(const disp_t *disp, double lam);
 static cmpl cauchy_n_value_deriv(const disp_t *disp, double lam,
                                  cmpl_vector *der);
+static void cauchy_n_value_array(const disp_t *disp, const double *lam,
+                                 cmpl *n, int nb);
+static void cauchy_n_value_deriv_array(const disp_t *disp, const double *lam,
+                                       cmpl *n, cmpl *der, int nb);
 static int  cauchy_fp_number(const disp_t *disp);
 static double * cauchy_map_param(disp_t *d, int index);
 static int  cauchy_apply_param(struct disp_struct *d,
@@ -38,6 +42,9 @@ struct disp_class cauchy_disp_class = {
     .encode_param        = cauchy_encode_param,
     .write               = cauchy_write,
     .read                = cauchy_read,
+
+    .n_value_array       = cauchy_n_value_array,
+    .n_value_deriv_array = cauchy_n_value_deriv_array,
 };
 
 cmpl
@@ -73,6 +80,42 @@ cauchy_n_value_deriv(const disp_t *d, double lam, cmpl_vector *pd)
     return n;
 }
 
+void
+cauchy_n_value_array(const disp_t *disp, const double *lam, cmpl *n, int nb)
+{
+    const struct disp_cauchy *c = & disp->disp.cauchy;
+    const double n0 = c->n[0], n1 = c->n[1], n2 = c->n[2];
+    const double k0 = c->k[0], k1 = c->k[1], k2 = c->k[2];
+    int j;
+
+    for(j = 0; j < nb; j++) {
+        const double lamsq = lam[j] * lam[j];
+        n[j] = (n0 + n1 / lamsq + n2 / (lamsq*lamsq))
+               - I * (k0 + k1 / lamsq + k2 / (lamsq*lamsq));
+    }
+}
+
+void
+cauchy_n_value_deriv_array(const disp_t *disp, const double *lam,
+                           cmpl *n, cmpl *der, int nb)
+{
+    int j;
+
+    if(n) {
+        cauchy_n_value_array(disp, lam, n, nb);
+    }
+
+    for(j = 0; j < nb; j++, der += CAUCHY_NB_PARAMS) {
+        const double lamsq = lam[j] * lam[j];
+        der[0] = 1.0 + I * 0.0;
+        der[1] = 1 / lamsq + I * 0.0;
+        der[2] = 1 / (lamsq*lamsq) + I * 0.0;
+        der[3] = - I;
+        der[4] = - I / lamsq;
+        der[5] = - I / (lamsq*lamsq);
+    }
+}
+
 int
 cauchy_fp_number(const disp_t *disp)
 {
@@ -9,6 +9,8 @@ extern disp_t * fb_copy(const disp_t *d);
 extern cmpl fb_n_value(const disp_t *disp, double lam);
 extern cmpl fb_n_value_deriv(const disp_t *disp, double lam,
                              cmpl_vector *der);
+extern void fb_n_value_array(const disp_t *disp, const double *lam,
+                             cmpl *n, int nb);
 extern int  fb_fp_number(const disp_t *disp);
 extern double * fb_map_param(disp_t *disp, int index);
 extern int  fb_apply_param(struct disp_struct *d,
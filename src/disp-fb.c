@@ -42,6 +42,8 @@ struct disp_class fb_disp_class = {
     .encode_param        = fb_encode_param,
     .write               = fb_write,
     .read                = fb_read,
+
+    .n_value_array       = fb_n_value_array,
 };
 
 static const char *fb_param_names[] = {"A", "B", "C"};
@@ -216,6 +218,53 @@ fb_n_value_deriv(const disp_t *d, double lambda, cmpl_vector *pd)
     return nsum - I * ksum;
 }
 
+/* Same as fb_n_value for each wavelength. The coefficients of each
+   oscillator, that do not depend on the energy, are computed only once. */
+void
+fb_n_value_array(const disp_t *d, const double *lam, cmpl *n, int nb_points)
+{
+    const struct disp_fb *fb = &d->disp.fb;
+    const double Eg = fb->eg;
+    double *nsum = emalloc(2 * nb_points * sizeof(double));
+    double *ksum = nsum + nb_points;
+    int j, k;
+
+    for(j = 0; j < nb_points; j++) {
+        nsum[j] = fb->n_inf;
+        ksum[j] = 0.0;
+    }
+
+    for(k = 0; k < fb->n; k++) {
+        const struct fb_osc *osc = fb->osc + k;
+        double A, B, C;
+        if (fb->form == FOROUHI_BLOOMER_STANDARD) {
+            A = osc->a;
+            B = osc->b;
+            C = osc->c;
+        } else {
+            A = osc->a * SQR(osc->c);
+            B = 2 * osc->b;
+            C = SQR(osc->c) + SQR(osc->b);
+        }
+        const double Q = 0.5 * sqrt(4*C - SQR(B));
+        const double B0 = (A / Q) * (-SQR(B)/2 + Eg * (B - Eg) + C);
+        const double C0 = (A / Q) * ((SQR(Eg) + C)*B/2 - 2 * Eg * C);
+
+        for(j = 0; j < nb_points; j++) {
+            const double E = FB_EV_NM / lam[j];
+            const double den = E * (E - B) + C;
+            ksum[j] += (E > Eg ? A * SQR(E - Eg) / den : 0.0);
+            nsum[j] += (B0*E + C0) / den;
+        }
+    }
+
+    for(j = 0; j < nb_points; j++) {
+        n[j] = nsum[j] - I * ksum[j];
+    }
+
+    free(nsum);
+}
+
 int
 fb_fp_number(const disp_t *disp)
 {
@@ -43,7 +43,9 @@ disp_fit_engine_new() {
     struct disp_fit_engine *fit = emalloc(sizeof(struct disp_fit_engine));
     fit->ref_disp   = NULL;
     fit->model_disp = NULL;
+    fit->model_n    = NULL;
     fit->model_der  = NULL;
+    fit->ref_n      = NULL;
     fit->wl         = NULL;
     fit->parameters = NULL;
     return fit;
@@ -75,19 +77,26 @@ disp_fit_fdf(const gsl_vector *x, void *_fit, gsl_vector *f,
              gsl_matrix * jacob)
 {
     struct disp_fit_engine *fit = (struct disp_fit_engine *) _fit;
-    gsl_vector *wl = fit->wl;
-    size_t nsmp = wl->size, j;
+    const double *wl = fit->wl->data;
+    const int nb_params = disp_get_number_of_params(fit->model_disp);
+    size_t nsmp = fit->wl->size, j;
 
     commit_fit_parameters(fit, x);
 
+    if(jacob) {
+        n_value_deriv_array(fit->model_disp, wl, f ? fit->model_n : NULL,
+                            fit->model_der, nsmp);
+    } else {
+        n_value_array(fit->model_disp, wl, fit->model_n, nsmp);
+    }
+
     for(j = 0; j < nsmp; j++) {
-        double lambda = gsl_vector_get(wl, j);
         fit_param_t *params = fit->parameters->values;
         int kp;
 
         if(f) {
-            cmpl n_mod = n_value(fit->model_disp, lambda);
-            cmpl n_ref = n_value(fit->ref_disp, lambda);
+            cmpl n_mod = fit->model_n[j];
+            cmpl n_ref = fit->ref_n[j];
 
             double nrdiff = creal(n_mod) - creal(n_ref);
             double nidiff = cimag(n_mod) - cimag(n_ref);
@@ -97,10 +106,10 @@ disp_fit_fdf(const gsl_vector *x, void *_fit, gsl_vector *f,
         }
 
         if(jacob) {
-            n_value_deriv(fit->model_disp, fit->model_der, lambda);
+            const cmpl *der = fit->model_der + j * nb_params;
 
             for(kp = 0; kp < fit->parameters->number; kp++) {
-                cmpl dndp = cmpl_vector_get(fit->model_der, params[kp].param_nb);
+                cmpl dndp = der[params[kp].param_nb];
 
                 gsl_matrix_set(jacob, j,      kp, creal(dndp));
                 gsl_matrix_set(jacob, j+nsmp, kp, cimag(dndp));
@@ -145,8 +154,14 @@ lmfit_disp(struct disp_fit_engine *fit, struct disp_fit_config *cfg,
 
     disp_nb_params = disp_get_number_of_params(fit->model_disp);
 
+    assert(fit->wl->stride == 1);
+
     assert(fit->model_der == NULL);
-    fit->model_der = cmpl_vector_alloc(disp_nb_params);
+    fit->model_n = emalloc(nsp * sizeof(cmpl));
+    fit->model_der = emalloc(nsp * disp_nb_params * sizeof(cmpl));
+    fit->ref_n = emalloc(nsp * sizeof(cmpl));
+
+    n_value_array(fit->ref_disp, fit->wl->data, fit->ref_n, nsp);
 
     f.f      = & disp_fit_f;
     f.df     = & disp_fit_df;
@@ -191,8 +206,12 @@ lmfit_disp(struct disp_fit_engine *fit, struct disp_fit_config *cfg,
 
     commit_fit_parameters(fit, x);
 
-    cmpl_vector_free(fit->model_der);
+    free(fit->model_n);
+    free(fit->model_der);
+    free(fit->ref_n);
+    fit->model_n = NULL;
     fit->model_der = NULL;
+    fit->ref_n = NULL;
 
     gsl_multifit_fdfsolver_free(s);
 
@@ -16,7 +16,13 @@ struct disp_fit_engine {
     disp_t *ref_disp;
     disp_t *model_disp;
 
-    cmpl_vector *model_der;
+    /* workspace for the refractive index of the model and its
+       derivatives over the sampling points */
+    cmpl *model_n;
+    cmpl *model_der;
+
+    /* refractive index of the reference over the sampling points */
+    cmpl *ref_n;
 
     /* wavelength's sampling points */
     gsl_vector *wl;
@@ -29,6 +29,8 @@ static disp_t * ho_copy(const disp_t *d);
 static cmpl ho_n_value(const disp_t *disp, double lam);
 static cmpl ho_n_value_deriv(const disp_t *disp, double lam,
                              cmpl_vector *der);
+static void ho_n_value_array(const disp_t *disp, const double *lam,
+                             cmpl *n, int nb);
 static int  ho_fp_number(const disp_t *disp);
 static double * ho_map_param(disp_t *d, int index);
 static int  ho_apply_param(struct disp_struct *d,
@@ -59,6 +61,8 @@ struct disp_class ho_disp_class = {
     .encode_param        = ho_encode_param,
     .write               = ho_write,
     .read                = ho_read,
+
+    .n_value_array       = ho_n_value_array,
 };
 
 static const char *ho_param_names[] = {"Nosc", "En", "Eg", "Nu", "Phi"};
@@ -241,6 +245,41 @@ ho_n_value_deriv(const disp_t *d, double lambda, cmpl_vector *pd)
     return n;
 }
 
+/* Same as ho_n_value for each wavelength. The oscillators' terms are
+   accumulated over the whole array, one oscillator at a time. */
+void
+ho_n_value_array(const disp_t *d, const double *lam, cmpl *n, int nb_points)
+{
+    const struct disp_ho *m = & d->disp.ho;
+    cmpl *hnusum = emalloc(nb_points * sizeof(cmpl));
+    int j, k;
+
+    for(j = 0; j < nb_points; j++) {
+        n[j] = 0.0;
+        hnusum[j] = 0.0;
+    }
+
+    for(k = 0; k < m->nb_hos; k++) {
+        const struct ho_params *p = m->params + k;
+        const cmpl amp = HO_MULT_FACT * p->nosc * cexp(- I * p->phi);
+        const double ensq = SQR(p->en), eg = p->eg, nu = p->nu;
+
+        for(j = 0; j < nb_points; j++) {
+            const double e = HO_EV_NM / lam[j];
+            const cmpl hh = amp / (ensq - SQR(e) + I * eg * e);
+            n[j] += hh;
+            hnusum[j] += nu * hh;
+        }
+    }
+
+    for(j = 0; j < nb_points; j++) {
+        cmpl nj = csqrt(1 + n[j]/(1 - hnusum[j]));
+        n[j] = (cimag(nj) > 0.0 ? creal(nj) + I * 0.0 : nj);
+    }
+
+    free(hnusum);
+}
+
 int
 ho_fp_number(const disp_t *disp)
 {
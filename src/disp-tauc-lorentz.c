@@ -21,7 +21,6 @@
 #include <assert.h>
 #include <string.h>
 #include <gsl/gsl_math.h>
-#include <gsl/gsl_deriv.h>
 
 #include "cmpl.h"
 #include "dispers.h"
@@ -183,77 +182,253 @@ void tauc_lorentz_change_form(struct disp_fb *fb, int new_coeff_form)
     }
 }
 
-struct eval_param {
-    disp_t *d;
-    double lambda;
-    double *param_ptr;
+/* To compute the derivatives each quantity that appears in the expression
+   of the dielectric function is carried along with its partial
+   derivatives with respect to the oscillator's parameters, in the order
+   of the fb_osc fields, and to Eg. */
+#define TL_DER_NB 4
+#define TL_DER_EG 3
+
+struct tl_der {
+    double v;
+    double d[TL_DER_NB];
 };
 
-double n_eval_real(double x, void *params)
+static inline struct tl_der
+der_const(double v)
 {
-    struct eval_param *p = (struct eval_param *) params;
-    *p->param_ptr = x;
-    cmpl n = n_value(p->d, p->lambda);
-    return creal(n);
+    struct tl_der r = {v, {0.0, 0.0, 0.0, 0.0}};
+    return r;
 }
 
-double n_eval_imag(double x, void *params)
+static inline struct tl_der
+der_var(double v, int index)
 {
-    struct eval_param *p = (struct eval_param *) params;
-    *p->param_ptr = x;
-    cmpl n = n_value(p->d, p->lambda);
-    return cimag(n);
+    struct tl_der r = der_const(v);
+    r.d[index] = 1.0;
+    return r;
 }
 
-static void
-tauc_lorentz_num_deriv(const disp_t *d, double lambda, cmpl_vector *pd)
+static inline struct tl_der
+der_add(struct tl_der a, struct tl_der b)
 {
-    struct eval_param p[1];
-
-    /* Explicitly discard the const qualifier. The dispersion object will
-       change but before the end of the function it will be restored to its
-       original state. */
-    p->d = (disp_t *) d;
-    p->lambda = lambda;
-
-    fit_param_t fit_param[1];
-    fit_param->id = PID_LAYER_N;
-    fit_param->layer_nb = 0;
-    fit_param->model_id = DISP_TAUC_LORENTZ;
-
-    gsl_function F;
-    F.params = (void *) p;
-    int no_params = disp_get_number_of_params(p->d);
     int i;
-    for (i = 0; i < no_params; i++) {
-        fit_param->param_nb = i;
-        p->param_ptr = disp_map_param(p->d, i);
+    a.v += b.v;
+    for (i = 0; i < TL_DER_NB; i++) {
+        a.d[i] += b.d[i];
+    }
+    return a;
+}
 
-        double rderiv, ideriv;
+static inline struct tl_der
+der_sub(struct tl_der a, struct tl_der b)
+{
+    int i;
+    a.v -= b.v;
+    for (i = 0; i < TL_DER_NB; i++) {
+        a.d[i] -= b.d[i];
+    }
+    return a;
+}
 
-        F.function = &n_eval_real;
-        double abserr;
-        double p0 = *p->param_ptr;
-        double h = p0 * 1e-4;
-        h = (h < 1e-6 ? 1e-6 : h);
-        gsl_deriv_central(&F, p0, h, &rderiv, &abserr);
-        *p->param_ptr = p0;
+static inline struct tl_der
+der_scale(struct tl_der a, double s)
+{
+    int i;
+    a.v *= s;
+    for (i = 0; i < TL_DER_NB; i++) {
+        a.d[i] *= s;
+    }
+    return a;
+}
 
-        F.function = &n_eval_imag;
-        gsl_deriv_central(&F, p0, h, &ideriv, &abserr);
-        *p->param_ptr = p0;
+static inline struct tl_der
+der_mul(struct tl_der a, struct tl_der b)
+{
+    struct tl_der r;
+    int i;
+    r.v = a.v * b.v;
+    for (i = 0; i < TL_DER_NB; i++) {
+        r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+    }
+    return r;
+}
 
-        cmpl_vector_set(pd, i, rderiv + I * ideriv);
+static inline struct tl_der
+der_div(struct tl_der a, struct tl_der b)
+{
+    struct tl_der r;
+    int i;
+    r.v = a.v / b.v;
+    for (i = 0; i < TL_DER_NB; i++) {
+        r.d[i] = (a.d[i] - r.v * b.d[i]) / b.v;
+    }
+    return r;
+}
+
+static inline struct tl_der
+der_sq(struct tl_der a)
+{
+    return der_mul(a, a);
+}
+
+/* Apply the function "f" given its value "fv" and its derivative "df". */
+static inline struct tl_der
+der_chain(struct tl_der a, double fv, double df)
+{
+    struct tl_der r;
+    int i;
+    r.v = fv;
+    for (i = 0; i < TL_DER_NB; i++) {
+        r.d[i] = df * a.d[i];
+    }
+    return r;
+}
+
+static inline struct tl_der
+der_sqrt(struct tl_der a)
+{
+    const double v = sqrt(a.v);
+    return der_chain(a, v, 0.5 / v);
+}
+
+static inline struct tl_der
+der_pow(struct tl_der a, double p)
+{
+    const double v = pow(a.v, p);
+    return der_chain(a, v, p * v / a.v);
+}
+
+static inline struct tl_der
+der_log(struct tl_der a)
+{
+    return der_chain(a, log(a.v), 1 / a.v);
+}
+
+static inline struct tl_der
+der_atan(struct tl_der a)
+{
+    return der_chain(a, atan(a.v), 1 / (1 + a.v * a.v));
+}
+
+static inline struct tl_der
+der_fabs(struct tl_der a)
+{
+    return (a.v < 0 ? der_scale(a, -1.0) : a);
+}
+
+/* Compute the contribution of the oscillator "osc" to the real and
+   imaginary part of the dielectric function, and their derivatives, at
+   the energy E. The expressions are the same used in tauc_lorentz_n_value. */
+static void
+tauc_lorentz_osc_deriv(const struct disp_fb *fb, const struct fb_osc *osc,
+                       double E, struct tl_der *er, struct tl_der *ei)
+{
+    const struct tl_der Eg = der_var(fb->eg, TL_DER_EG);
+    struct tl_der A, E0, C;
+
+    if (fb->form == TAUC_LORENTZ_STANDARD) {
+        A = der_var(osc->a, 0);
+        E0 = der_var(osc->b, 1);
+        C = der_var(osc->c, 2);
+    } else {
+        const struct tl_der a = der_var(osc->a, 0), b = der_var(osc->b, 1), c = der_var(osc->c, 2);
+        const struct tl_der cqq = der_sq(der_sq(c));
+        E0 = der_pow(der_add(der_sq(der_sq(b)), der_scale(cqq, 0.25)), 0.25);
+        C = der_sqrt(der_scale(der_sub(der_sq(E0), der_sq(b)), 2.0));
+        A = der_div(der_mul(a, cqq), der_scale(der_mul(E0, C), 4.0));
+    }
+
+    const double Eq = SQR(E);
+    const struct tl_der Cq = der_sq(C), E0q = der_sq(E0), Egq = der_sq(Eg);
+    const struct tl_der Eq_E0q = der_sub(der_const(Eq), E0q);
+    const struct tl_der den = der_add(der_sq(Eq_E0q), der_scale(Cq, Eq));
+    const struct tl_der E0q_Egq = der_add(E0q, Egq);
+    const struct tl_der ACE0 = der_mul(der_mul(A, C), E0);
+
+    int alpha_real = (C.v < (2 - 1e-10) * E0.v);
+
+    const struct tl_der a_ln = der_sub(der_add(der_scale(der_sub(Egq, E0q), Eq), der_mul(Egq, Cq)), der_mul(E0q, der_add(E0q, der_scale(Egq, 3.0))));
+    const struct tl_der a_tan = der_add(der_mul(Eq_E0q, E0q_Egq), der_mul(Egq, Cq));
+    const struct tl_der alpha_sq = (alpha_real ? der_sub(der_scale(E0q, 4.0), Cq) : der_const(0.0));
+    const struct tl_der gamma_sq = der_sub(E0q, der_scale(Cq, 0.5));
+    const struct tl_der Eq_gamma_sq = der_sub(der_const(Eq), gamma_sq);
+    const struct tl_der zeta4 = der_add(der_sq(Eq_gamma_sq), der_scale(der_mul(alpha_sq, Cq), 0.25));
+    const struct tl_der pi_zeta4 = der_scale(zeta4, M_PI);
+
+    if (E > Eg.v) {
+        *ei = der_div(der_mul(ACE0, der_sq(der_sub(der_const(E), Eg))), der_scale(den, E));
+    } else {
+        *ei = der_const(0.0);
+    }
+
+    /* Common factors of the er_term2 and er_term3 of tauc_lorentz_n_value. */
+    const struct tl_der f2 = der_div(der_mul(A, a_tan), der_mul(pi_zeta4, E0));
+    const struct tl_der f3 = der_div(der_scale(der_mul(der_mul(der_mul(A, E0), Eg), Eq_gamma_sq), 2.0), pi_zeta4);
+
+    if (!alpha_real) {
+        const struct tl_der t1 = der_div(der_scale(der_mul(der_mul(der_mul(Eg, A), C), a_ln), 2.0), der_scale(der_mul(der_mul(pi_zeta4, E0), E0q_Egq), 2.0));
+        const struct tl_der t2 = der_scale(der_mul(f2, der_atan(der_div(C, der_scale(Eg, 2.0)))), -2.0);
+        const struct tl_der t3 = der_mul(f3, der_div(C, E0q_Egq));
+        *er = der_add(der_add(t1, t2), t3);
+    } else {
+        const struct tl_der alpha = der_sqrt(alpha_sq);
+        const struct tl_der alpha_Eg = der_mul(alpha, Eg);
+        const struct tl_der atanp = der_atan(der_div(der_add(alpha, der_scale(Eg, 2.0)), C));
+        const struct tl_der atanm = der_atan(der_div(der_sub(alpha, der_scale(Eg, 2.0)), C));
+        const struct tl_der lnarg = der_div(der_add(E0q_Egq, alpha_Eg), der_sub(E0q_Egq, alpha_Eg));
+        const struct tl_der t1 = der_mul(der_div(der_mul(der_mul(A, C), a_ln), der_scale(der_mul(der_mul(pi_zeta4, alpha), E0), 2.0)), der_log(lnarg));
+        const struct tl_der t2 = der_scale(der_mul(f2, der_add(der_const(M_PI), der_sub(atanm, atanp))), -1.0);
+        const struct tl_der atang = der_atan(der_div(der_scale(der_sub(gamma_sq, Egq), 2.0), der_mul(alpha, C)));
+        const struct tl_der t3 = der_mul(der_div(f3, alpha), der_add(der_const(M_PI), der_scale(atang, 2.0)));
+        *er = der_add(der_add(t1, t2), t3);
+    }
+
+    const struct tl_der log_den = der_sqrt(der_add(der_sq(der_sub(E0q, Egq)), der_mul(Egq, Cq)));
+    const struct tl_der f45 = der_div(ACE0, pi_zeta4);
+    if (fabs(E - Eg.v) < 1e-10 * E) {
+        *er = der_add(*er, der_mul(der_scale(f45, 2 * E), der_log(der_div(der_const(4 * Eq), log_den))));
+    } else {
+        const struct tl_der abs_diff = der_fabs(der_sub(der_const(E), Eg));
+        const struct tl_der E_Eg = der_add(der_const(E), Eg);
+        const struct tl_der t4 = der_scale(der_mul(der_mul(f45, der_add(der_const(Eq), Egq)), der_log(der_div(abs_diff, E_Eg))), -1 / E);
+        const struct tl_der t5 = der_mul(der_scale(der_mul(f45, Eg), 2.0), der_log(der_div(der_mul(abs_diff, E_Eg), log_den)));
+        *er = der_add(*er, der_add(t4, t5));
     }
 }
 
 cmpl
 tauc_lorentz_n_value_deriv(const disp_t *d, double lambda, cmpl_vector *pd)
 {
+    const struct disp_fb *fb = &d->disp.fb;
+    const double E = TL_EV_NM / lambda;
     cmpl n = tauc_lorentz_n_value(d, lambda);
-    if (pd) {
-        tauc_lorentz_num_deriv(d, lambda, pd);
+    cmpl deps_deg = 0.0;
+    int k;
+
+    if (pd == NULL) {
+        return n;
     }
+
+    /* Since n = sqrt(eps) we have dn/dp = (deps/dp) / (2 n). */
+    const cmpl dn_deps = 1 / (2.0 * n);
+
+    for (k = 0; k < fb->n; k++) {
+        const int koffs = TL_NB_GLOBAL_PARAMS + k * TL_NB_PARAMS;
+        struct tl_der er, ei;
+        int i;
+
+        tauc_lorentz_osc_deriv(fb, fb->osc + k, E, &er, &ei);
+
+        for (i = 0; i < TL_NB_PARAMS; i++) {
+            cmpl_vector_set(pd, koffs + i, dn_deps * (er.d[i] - I * ei.d[i]));
+        }
+        deps_deg += er.d[TL_DER_EG] - I * ei.d[TL_DER_EG];
+    }
+
+    cmpl_vector_set(pd, TL_NINF_OFFS, dn_deps);
+    cmpl_vector_set(pd, TL_EG_OFFS, dn_deps * deps_deg);
+
     return n;
 }
 
@@ -94,6 +94,51 @@ n_value_deriv(const disp_t *disp, cmpl_vector *der, double lambda)
     disp->dclass->n_value_deriv(disp, lambda, der);
 }
 
+void
+n_value_array(const disp_t *disp, const double *lam, cmpl *n, int nb)
+{
+    int j;
+
+    assert(disp->dclass != NULL);
+
+    if(disp->dclass->n_value_array) {
+        disp->dclass->n_value_array(disp, lam, n, nb);
+        return;
+    }
+
+    for(j = 0; j < nb; j++) {
+        n[j] = disp->dclass->n_value(disp, lam[j]);
+    }
+}
+
+/* "n" can be NULL if only the derivatives are needed. */
+void
+n_value_deriv_array(const disp_t *disp, const double *lam,
+                    cmpl *n, cmpl *der, int nb)
+{
+    const int nb_params = disp_get_number_of_params(disp);
+    cmpl_vector der_row[1];
+    int j;
+
+    assert(disp->dclass != NULL);
+
+    if(disp->dclass->n_value_deriv_array) {
+        disp->dclass->n_value_deriv_array(disp, lam, n, der, nb);
+        return;
+    }
+
+    der_row->size = nb_params;
+    der_row->owner = 0;
+    for(j = 0; j < nb; j++) {
+        cmpl nj;
+        der_row->data = der + j * nb_params;
+        nj = disp->dclass->n_value_deriv(disp, lam[j], der_row);
+        if(n) {
+            n[j] = nj;
+        }
+    }
+}
+
 void
 get_model_param_deriv(const disp_t *disp, struct deriv_info *deriv_info,
                       const fit_param_t *fp, double lambda,
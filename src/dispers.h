@@ -41,6 +41,15 @@ struct disp_class {
                              const fit_param_t *fp);
     int (*write)(writer_t *w, const struct disp_struct *_d);
 
+    /* optional methods to compute n, and its derivatives, for an array
+       of wavelengths. The derivatives are stored in "der" by rows, one row
+       of fp_number() elements for each wavelength. */
+    void (*n_value_array)(const struct disp_struct *d, const double *lam,
+                          cmpl *n, int nb);
+    void (*n_value_deriv_array)(const struct disp_struct *d,
+                                const double *lam, cmpl *n, cmpl *der,
+                                int nb);
+
     /* class methods */
     void (*encode_param)(str_t param, const fit_param_t *fp);
     int (*read)(lexer_t *l, struct disp_struct *d);
@@ -75,6 +84,10 @@ extern void     n_value_cpp(const disp_t *mat, double lam,
                             double *nr, double *ni);
 extern void     n_value_deriv(const disp_t *disp, cmpl_vector *der,
                               double lambda);
+extern void     n_value_array(const disp_t *disp, const double *lam,
+                              cmpl *n, int nb);
+extern void     n_value_deriv_array(const disp_t *disp, const double *lam,
+                                    cmpl *n, cmpl *der, int nb);
 extern double * disp_map_param(disp_t *d, int index);
 extern int      dispers_apply_param(disp_t *d, const fit_param_t *fp,
                                     double val);
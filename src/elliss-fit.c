@@ -73,13 +73,16 @@ get_parameter_jacobian(fit_param_t const *fp, stack_t const *stack,
     }
 }
 
-int
-elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
-               gsl_matrix * jacob)
+static void
+elliss_fit_points(struct fit_engine *fit, struct fit_scratch *scratch,
+                  size_t j_start, size_t j_end,
+                  gsl_vector *f, gsl_matrix * jacob)
 {
-    struct fit_engine *fit = params;
     struct spectrum *s = fit->run->spectr;
-    size_t nb_med = fit->stack->nb;
+    stack_t *stack = scratch->stack;
+    struct normal_eqs *normal = scratch->normal;
+    const int need_jacob = (jacob != NULL || normal != NULL);
+    size_t nb_med = stack->nb;
     struct {
         double const * ths;
         cmpl * ns;
@@ -90,22 +93,21 @@ elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
     } wjacob;
     size_t npt = spectra_points(s);
     const enum se_type se_type = GET_SE_TYPE(fit->run->system_kind);
+    /* with a thickness-only fit the Fresnel coefficients and the phase
+       constants are taken from the cache */
+    const cmpl *se_terms = fit->run->cache.se_terms;
+    const size_t nterms = SE_FIXED_TERMS_SIZE(nb_med);
     size_t j;
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
-
-    fit_engine_commit_parameters(fit, x);
-
     /* STEP 2 : From the stack we retrive the thicknesses and RIs
                 informations. */
 
-    actual.ths = stack_get_ths_list(fit->stack);
+    actual.ths = stack_get_ths_list(stack);
 
-    wjacob.th = (jacob ? fit->run->jac_th : NULL);
-    wjacob.n  = (jacob && !fit->run->cache.th_only ? fit->run->jac_n.ell : NULL);
+    wjacob.th = (need_jacob ? scratch->jac_th : NULL);
+    wjacob.n  = (need_jacob && !fit->run->cache.th_only ? scratch->jac_n.ell : NULL);
 
-    for(j = 0; j < npt; j++) {
+    for(j = j_start; j < j_end; j++) {
         float const * spectr_data = spectra_get_values(s, j);
         const double lambda     = spectr_data[0];
         const double meas_alpha = spectr_data[1];
@@ -114,27 +116,27 @@ elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
         const double anlz = s->config.analyzer;
         struct elliss_ab theory[1];
 
-        if(fit->run->cache.th_only) {
-            actual.ns = fit->run->cache.ns_full_spectr + j * nb_med;
-        } else {
-            actual.ns = fit->run->cache.ns;
-            stack_get_ns_list(fit->stack, actual.ns, lambda);
-        }
-
         /* STEP 3 : We call the ellipsometer kernel function */
 
-
-        mult_layer_se_jacob(se_type,
-                            nb_med, actual.ns, phi0, actual.ths, lambda,
-                            anlz, theory, wjacob.th, wjacob.n);
+        if(se_terms) {
+            mult_layer_se_jacob_th(se_type, nb_med, se_terms + j * nterms,
+                                   actual.ths, anlz, theory, wjacob.th,
+                                   scratch->cache->jac_ws);
+        } else {
+            actual.ns = fit_engine_get_ns(fit, scratch, j, lambda);
+            mult_layer_se_jacob(se_type,
+                                nb_med, actual.ns, phi0, actual.ths, lambda,
+                                anlz, theory, wjacob.th, wjacob.n,
+                                scratch->cache->jac_ws);
+        }
 
         if(f != NULL) {
             gsl_vector_set(f, j,       theory->alpha - meas_alpha);
             gsl_vector_set(f, npt + j, theory->beta  - meas_beta);
         }
 
-        if(jacob) {
-            struct deriv_info * ideriv = fit->run->cache.deriv_info;
+        if(need_jacob) {
+            struct deriv_info * ideriv = scratch->cache->deriv_info;
             struct elliss_ab jac[1];
             size_t kp, ic;
 
@@ -147,15 +149,45 @@ elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
             for(kp = 0; kp < fit->parameters->number; kp++) {
                 fit_param_t *fp = fit->parameters->values + kp;
 
-                get_parameter_jacobian(fp, fit->stack, ideriv, lambda,
+                get_parameter_jacobian(fp, stack, ideriv, lambda,
                                        wjacob.th, wjacob.n, jac);
 
-                gsl_matrix_set(jacob, j,       kp, jac->alpha);
-                gsl_matrix_set(jacob, npt + j, kp, jac->beta);
+                if(normal) {
+                    gsl_matrix_set(normal->rows, 0, kp, jac->alpha);
+                    gsl_matrix_set(normal->rows, 1, kp, jac->beta);
+                } else {
+                    gsl_matrix_set(jacob, j,       kp, jac->alpha);
+                    gsl_matrix_set(jacob, npt + j, kp, jac->beta);
+                }
+            }
+
+            if(normal) {
+                const double r[2] = {theory->alpha - meas_alpha, theory->beta - meas_beta};
+                normal_eqs_add_rows(normal, r);
             }
         }
     }
+}
+
+int
+elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+               gsl_matrix * jacob)
+{
+    struct fit_engine *fit = params;
+
+    /* STEP 1 : We apply the actual values of the fit parameters
+                to the stack and compute each spectral point. */
 
+    fit_engine_eval_points(fit, x, elliss_fit_points, f, jacob);
+
+    return GSL_SUCCESS;
+}
+
+int
+elliss_fit_normal_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+                      gsl_matrix *jtj, gsl_vector *jtf)
+{
+    fit_engine_eval_normal(params, x, elliss_fit_points, f, jtj, jtf);
     return GSL_SUCCESS;
 }
 
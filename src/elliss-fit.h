@@ -12,6 +12,9 @@ extern int      elliss_fit_f(const gsl_vector *x, void *params,
                              gsl_vector * f);
 extern int      elliss_fit_df(const gsl_vector *x,
                               void *params, gsl_matrix *jacob);
+extern int      elliss_fit_normal_fdf(const gsl_vector *x, void *params,
+                                      gsl_vector *f, gsl_matrix *jtj,
+                                      gsl_vector *jtf);
 
 #ifdef DEBUG_REGRESS
 
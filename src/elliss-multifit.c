@@ -5,12 +5,13 @@
 /* helper function */
 #include "elliss-get-jacob.h"
 
-int
-elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
-                    gsl_matrix * jacob)
+static void
+elliss_multifit_sample(struct multi_fit_engine *fit, struct fit_scratch *scratch,
+                       int sample, gsl_vector *f, gsl_matrix *jacob, int compact)
 {
-    struct multi_fit_engine *fit = params;
-    size_t nb_med = fit->stack_list[0]->nb;
+    size_t nb_med = scratch->stack->nb;
+    struct spectrum *spectrum = fit->spectra_list[sample];
+    size_t npt = spectra_points(spectrum);
     struct {
         double const * ths;
         cmpl * ns;
@@ -21,104 +22,116 @@ elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
     } stack_jacob;
     size_t samples_number = fit->samples_number;
     const enum se_type se_type = GET_SE_TYPE(fit->system_kind);
-    size_t j, j_sample, sample;
-
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
-
-    multi_fit_engine_commit_parameters(fit, x);
+    /* if no RI is fitted for this sample the Fresnel coefficients and the
+       phase constants are taken from the cache */
+    const cmpl *se_terms = (fit->samples_cache ? fit->samples_cache[sample].se_terms : NULL);
+    const size_t nterms = SE_FIXED_TERMS_SIZE(nb_med);
+    size_t j, j_sample;
+
+    /* From the stack we retrive the thicknesses and RIs informations. */
+
+    actual.ths = stack_get_ths_list(scratch->stack);
+
+    stack_jacob.th = (jacob ? scratch->jac_th    : NULL);
+    stack_jacob.n  = (jacob ? scratch->jac_n.ell : NULL);
+
+    j_sample = fit->row_offset[sample];
+    for(j = 0; j < npt; j++, j_sample++) {
+        float const * spectr_data = spectra_get_values(spectrum, j);
+        const double lambda     = spectr_data[0];
+        const double meas_alpha = spectr_data[1];
+        const double meas_beta  = spectr_data[2];
+        const double phi0 = spectrum->config.aoi;
+        const double anlz = spectrum->config.analyzer;
+        struct elliss_ab theory[1];
+
+        /* We call the ellipsometer kernel function */
+
+        if(se_terms) {
+            mult_layer_se_jacob_th(se_type, nb_med, se_terms + j * nterms,
+                                   actual.ths, anlz, theory, stack_jacob.th,
+                                   scratch->cache->jac_ws);
+        } else {
+            actual.ns = multi_fit_engine_get_ns(fit, scratch, sample, j, lambda);
+            mult_layer_se_jacob(se_type,
+                                nb_med, actual.ns, phi0, actual.ths, lambda,
+                                anlz, theory, stack_jacob.th, stack_jacob.n,
+                                scratch->cache->jac_ws);
+        }
 
-    j_sample = 0;
-    for(sample = 0; sample < samples_number; sample++) {
-        struct spectrum *spectrum = fit->spectra_list[sample];
-        size_t npt = spectra_points(spectrum);
+        if(f != NULL) {
+            gsl_vector_set(f, j_sample,       theory->alpha - meas_alpha);
+            gsl_vector_set(f, j_sample + npt, theory->beta  - meas_beta);
+        }
 
-        /* STEP 2 : From the stack we retrive the thicknesses and RIs
-        informations. */
+        if(jacob) {
+            struct deriv_info * ideriv = scratch->cache->deriv_info;
+            const size_t nb_comm_params = fit->common_parameters->number;
+            const size_t nb_priv_params = fit->private_parameters->number;
+            size_t nb_params =					\
+                                                nb_comm_params + nb_priv_params * samples_number;
+            struct elliss_ab jac[1];
+            size_t kp, ikp, ic;
+
+            for(ic = 0; ic < nb_med; ic++) {
+                ideriv[ic].is_valid = 0;
+            }
 
-        actual.ths = stack_get_ths_list(fit->stack_list[sample]);
+            for(kp = 0; kp < nb_comm_params; kp++) {
+                fit_param_t const *fp = fit->common_parameters->values + kp;
 
-        stack_jacob.th = (jacob ? fit->jac_th    : NULL);
-        stack_jacob.n  = (jacob ? fit->jac_n.ell : NULL);
+                get_parameter_jacobian(fp, scratch->stack,
+                                       ideriv, lambda,
+                                       stack_jacob.th, stack_jacob.n,
+                                       jac);
 
-        for(j = 0; j < npt; j++, j_sample++) {
-            float const * spectr_data = spectra_get_values(spectrum, j);
-            const double lambda     = spectr_data[0];
-            const double meas_alpha = spectr_data[1];
-            const double meas_beta  = spectr_data[2];
-            const double phi0 = spectrum->config.aoi;
-            const double anlz = spectrum->config.analyzer;
-            struct elliss_ab theory[1];
+                gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
+                gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
+            }
 
-            actual.ns = fit->cache.ns;
-            stack_get_ns_list(fit->stack_list[sample], actual.ns, lambda);
+            for(ikp = 0; !compact && ikp < nb_priv_params * sample; ikp++, kp++) {
+                gsl_matrix_set(jacob, j_sample,       kp, 0.0);
+                gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
+            }
 
-            /* STEP 3 : We call the ellipsometer kernel function */
+            for(ikp = 0; ikp < nb_priv_params; kp++, ikp++) {
+                fit_param_t *fp = fit->private_parameters->values + ikp;
 
-            mult_layer_se_jacob(se_type,
-                                nb_med, actual.ns, phi0, actual.ths, lambda,
-                                anlz, theory, stack_jacob.th, stack_jacob.n);
+                get_parameter_jacobian(fp, scratch->stack,
+                                       ideriv, lambda,
+                                       stack_jacob.th, stack_jacob.n,
+                                       jac);
 
-            if(f != NULL) {
-                gsl_vector_set(f, j_sample,       theory->alpha - meas_alpha);
-                gsl_vector_set(f, j_sample + npt, theory->beta  - meas_beta);
+                gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
+                gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
             }
 
-            if(jacob) {
-                struct deriv_info * ideriv = fit->cache.deriv_info;
-                const size_t nb_comm_params = fit->common_parameters->number;
-                const size_t nb_priv_params = fit->private_parameters->number;
-                size_t nb_params =					\
-                                                    nb_comm_params + nb_priv_params * samples_number;
-                struct elliss_ab jac[1];
-                size_t kp, ikp, ic;
-
-                for(ic = 0; ic < nb_med; ic++) {
-                    ideriv[ic].is_valid = 0;
-                }
-
-                for(kp = 0; kp < nb_comm_params; kp++) {
-                    fit_param_t const *fp = fit->common_parameters->values + kp;
-
-                    get_parameter_jacobian(fp, fit->stack_list[sample],
-                                           ideriv, lambda,
-                                           stack_jacob.th, stack_jacob.n,
-                                           jac);
-
-                    gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
-                }
-
-                for(ikp = 0; ikp < nb_priv_params * sample; ikp++, kp++) {
-                    gsl_matrix_set(jacob, j_sample,       kp, 0.0);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
-                }
-
-                for(ikp = 0; ikp < nb_priv_params; kp++, ikp++) {
-                    fit_param_t *fp = fit->private_parameters->values + ikp;
-
-                    get_parameter_jacobian(fp, fit->stack_list[sample],
-                                           ideriv, lambda,
-                                           stack_jacob.th, stack_jacob.n,
-                                           jac);
-
-                    gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
-                }
-
-                for(/* */; kp < nb_params; kp++) {
-                    gsl_matrix_set(jacob, j_sample,       kp, 0.0);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
-                }
+            for(/* */; !compact && kp < nb_params; kp++) {
+                gsl_matrix_set(jacob, j_sample,       kp, 0.0);
+                gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
             }
         }
-
-        j_sample += npt;
     }
+}
 
+int
+elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+                    gsl_matrix * jacob)
+{
+    multi_fit_engine_eval_samples(params, x, elliss_multifit_sample, f, jacob, 0);
     return GSL_SUCCESS;
 }
 
+/* Each row of the Jacobian has only the columns of the common parameters
+   followed by the columns of the private parameters of the sample the row
+   belongs to. */
+int
+elliss_multifit_compact_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+                            gsl_matrix * jacob)
+{
+    multi_fit_engine_eval_samples(params, x, elliss_multifit_sample, f, jacob, 1);
+    return GSL_SUCCESS;
+}
 int
 elliss_multifit_f(const gsl_vector *x, void *params, gsl_vector * f)
 {
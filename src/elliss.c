@@ -105,7 +105,7 @@ mult_layer_refl(int nb, const cmpl ns[], cmpl nsin0,
         cost = snell_cos(nsin0, nptr[0]);
 
         beta = - 2.0 * I * omega * nptr[1] * cosc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
 
         for(p = 0; p <= 1; p++) {
             r[p] = refl_coeff(nptr[0], cost, nptr[1], cosc, p);
@@ -115,15 +115,21 @@ mult_layer_refl(int nb, const cmpl ns[], cmpl nsin0,
     }
 }
 
+/* The derivatives are computed like in refl-kernel.c: a first sweep from
+   the substrate stores the local derivatives of each interface and the
+   derivative "dfdR" respect to the reflection coefficient below, a second
+   sweep from the ambient multiplies them by the product of the "dfdR" of
+   the layers above. */
 static void
 mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
                          const double ds[], double lambda, cmpl R[],
-                         cmpl *jacth)
+                         cmpl *jacth, cmpl *dfdR)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
     cmpl cosc, cost;
     const cmpl *nptr;
+    polar_t p;
     int j;
 
     /* In this procedure we assume (nb > 2). This condition should be
@@ -140,8 +146,6 @@ mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
     for(j = nb - 3; j >= 0; j--) {
         cmpl r[2], rho, beta, drhodth;
         double th = ds[j];
-        polar_t p;
-        int k;
 
         nptr --;
 
@@ -149,23 +153,20 @@ mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
         cost = snell_cos(nsin0, nptr[0]);
 
         beta = - 2.0 * I * omega * nptr[1] * cosc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
 
         for(p = 0; p <= 1; p++) {
-            cmpl dfdR, dfdrho;
+            cmpl dfdrho;
             cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+            cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
             cmpl den, isqden;
 
             r[p] = refl_coeff(nptr[0], cost, nptr[1], cosc, p);
 
             den = 1 + r[p] * R[p] * rho;
             isqden = 1 / csqr(den);
-            dfdR = rho * (1 - r[p]*r[p]) * isqden;
-
-            for(k = nblyr; k > j+1; k--) {
-                pjacth[k-1] *= dfdR;
-            }
+            pdfdR[j] = rho * (1 - r[p]*r[p]) * isqden;
 
             dfdrho = R[p] * (1 - r[p]*r[p]) * isqden;
 
@@ -174,18 +175,30 @@ mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
             R[p] = (r[p] + R[p] * rho) / den;
         }
     }
+
+    for(p = 0; p <= 1; p++) {
+        cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+        cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
+        cmpl a = 1.0;
+
+        for(j = 0; j < nblyr; j++) {
+            pjacth[j] *= a;
+            a *= pdfdR[j];
+        }
+    }
 }
 
 static void
 mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
                       const double ds[], double lambda, cmpl R[],
-                      cmpl *jacth, cmpl *jacn)
+                      cmpl *jacth, cmpl *jacn, cmpl *dfdR)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
     cmpl cosc, cost;
     const cmpl *nptr;
     cmpl drdnt[2], drdnb[2];
+    polar_t p;
     int j;
 
     /* In this procedure we assume (nb > 2). This condition should be
@@ -210,8 +223,6 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
     for(j = nb - 3; j >= 0; j--) {
         cmpl r[2], rho, beta, drhodn, drhodth;
         double th = ds[j];
-        polar_t p;
-        int k;
 
         nptr --;
 
@@ -219,14 +230,15 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
         cost = snell_cos(nsin0, nptr[0]);
 
         beta = - 2.0 * I * omega * nptr[1] * cosc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
         drhodn = - 2.0 * I * rho * omega * THICKNESS_TO_NM(th) / cosc;
 
         for(p = 0; p <= 1; p++) {
-            cmpl dfdR, dfdr, dfdrho;
+            cmpl dfdr, dfdrho;
             cmpl *pjacn  = jacn  + (p == 0 ? 0 : nb);
             cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+            cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
             cmpl den, isqden;
 
             r[p] = refl_coeff_ext(nptr[0], cost, nptr[1], cosc,
@@ -234,20 +246,12 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
 
             den = 1 + r[p] * R[p] * rho;
             isqden = 1 / csqr(den);
-            dfdR = rho * (1 - r[p]*r[p]) * isqden;
-
-            for(k = nb - 1; k > j+1; k--) {
-                pjacn[k] *= dfdR;
-            }
-
-            for(k = nblyr; k > j+1; k--) {
-                pjacth[k-1] *= dfdR;
-            }
+            pdfdR[j] = rho * (1 - r[p]*r[p]) * isqden;
 
             dfdr = (1 - csqr(R[p]*rho)) * isqden;
             dfdrho = R[p] * (1 - r[p]*r[p]) * isqden;
 
-            pjacn[j+1] = dfdR * pjacn[j+1] + dfdr * drdnb[p] + dfdrho * drhodn;
+            pjacn[j+1] = pdfdR[j] * pjacn[j+1] + dfdr * drdnb[p] + dfdrho * drhodn;
             pjacn[j] = (j == 0 ? 0.0 : dfdr * drdnt[p]);
 
             pjacth[j] = dfdrho * drhodth;
@@ -255,6 +259,121 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
             R[p] = (r[p] + R[p] * rho) / den;
         }
     }
+
+    for(p = 0; p <= 1; p++) {
+        cmpl *pjacn  = jacn  + (p == 0 ? 0 : nb);
+        cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+        cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
+        cmpl a = 1.0;
+
+        for(j = 0; j < nblyr; j++) {
+            pjacth[j] *= a;
+            pjacn[j+1] *= a;
+            a *= pdfdR[j];
+        }
+        pjacn[nb-1] *= a;
+    }
+}
+
+/* The terms of the kernel that do not depend on the thicknesses are
+   stored for each wavelength in "terms": the Fresnel coefficients of
+   interface "k" for the polarizations S and P at terms[k] and
+   terms[nb-1+k] and the phase constant "beta" of the layer of thickness
+   ds[j] at terms[2*(nb-1)+j]. */
+void
+mult_layer_se_fixed_terms(size_t _nb, const cmpl ns[], double phi0,
+                          double lambda, cmpl terms[])
+{
+    const int nb = _nb;
+    const double omega = 2 * M_PI / lambda;
+    cmpl *beta = terms + 2*(nb-1);
+    cmpl nsin0 = ns[0] * csin((cmpl) phi0);
+    cmpl cosc, cost;
+    polar_t p;
+    int j;
+
+    cosc = snell_cos(nsin0, ns[nb-1]);
+
+    for(j = nb - 2; j >= 0; j--) {
+        cost = snell_cos(nsin0, ns[j]);
+
+        for(p = 0; p <= 1; p++) {
+            terms[p*(nb-1) + j] = refl_coeff(ns[j], cost, ns[j+1], cosc, p);
+        }
+
+        if(j < nb - 2) {
+            beta[j] = - 2.0 * I * omega * ns[j+1] * cosc;
+        }
+
+        cosc = cost;
+    }
+}
+
+/* Same as mult_layer_refl using the terms computed by
+   mult_layer_se_fixed_terms. */
+static void
+mult_layer_refl_terms(int nb, const cmpl terms[], const double ds[],
+                      cmpl R[])
+{
+    const cmpl *beta = terms + 2*(nb-1);
+    polar_t p;
+    int j;
+
+    R[0] = terms[nb-2];
+    R[1] = terms[2*nb-3];
+
+    for(j = nb - 3; j >= 0; j--) {
+        cmpl rho = cmpl_phase_factor(beta[j] * THICKNESS_TO_NM(ds[j]));
+
+        for(p = 0; p <= 1; p++) {
+            cmpl r = terms[p*(nb-1) + j];
+            R[p] = (r + R[p] * rho) / (1 + r * R[p] * rho);
+        }
+    }
+}
+
+/* Same as mult_layer_refl_jacob_th using the terms computed by
+   mult_layer_se_fixed_terms. */
+static void
+mult_layer_refl_terms_jacob_th(int nb, const cmpl terms[], const double ds[],
+                               cmpl R[], cmpl *jacth, cmpl *dfdR)
+{
+    const int nblyr = nb - 2;
+    const cmpl *beta = terms + 2*(nb-1);
+    polar_t p;
+    int j;
+
+    R[0] = terms[nb-2];
+    R[1] = terms[2*nb-3];
+
+    for(j = nb - 3; j >= 0; j--) {
+        cmpl rho = cmpl_phase_factor(beta[j] * THICKNESS_TO_NM(ds[j]));
+        cmpl drhodth = rho * beta[j] * THICKNESS_TO_NM(1.0);
+
+        for(p = 0; p <= 1; p++) {
+            cmpl r = terms[p*(nb-1) + j];
+            cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+            cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
+            cmpl den = 1 + r * R[p] * rho;
+            cmpl isqden = 1 / csqr(den);
+
+            pdfdR[j] = rho * (1 - r*r) * isqden;
+            pjacth[j] = R[p] * (1 - r*r) * isqden * drhodth;
+
+            R[p] = (r + R[p] * rho) / den;
+        }
+    }
+
+    for(p = 0; p <= 1; p++) {
+        cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
+        cmpl *pdfdR  = dfdR  + (p == 0 ? 0 : nblyr);
+        cmpl a = 1.0;
+
+        for(j = 0; j < nblyr; j++) {
+            pjacth[j] *= a;
+            a *= pdfdR[j];
+        }
+    }
 }
 
 #if 0
@@ -353,40 +472,58 @@ se_ab_der(cmpl R[], cmpl dR[], double tanlz, cmpl *dalpha, cmpl *dbeta)
     *dbeta = 2 * tanlz * z * isqden;
 }
 
+/* Set in "jacob_th" the derivatives of the ellipsometric parameters
+   respect to the thicknesses from the ones of the reflection coefficients
+   "jacth". */
+static void
+se_set_jacob_th(enum se_type type, int nblyr, cmpl R[], const cmpl *jacth,
+                double tanlz, gsl_vector *jacob_th)
+{
+    int j;
+
+    for(j = 0; j < nblyr; j++) {
+        struct {
+            cmpl alpha, beta;
+        } d;
+        cmpl dR[2] = {jacth[j], jacth[nblyr+j]};
+
+        if(type == SE_ALPHA_BETA) {
+            se_ab_der(R, dR, tanlz, &d.alpha, &d.beta);
+        } else {
+            se_psidel_der(R, dR, &d.alpha, &d.beta);
+        }
+
+        gsl_vector_set(jacob_th, j, creal(d.alpha));
+        gsl_vector_set(jacob_th, nblyr+j, creal(d.beta));
+    }
+}
+
 void
 mult_layer_se_jacob(enum se_type type,
                     size_t _nb, const cmpl ns[], double phi0,
                     const double ds[], double lambda,
                     double anlz, ell_ab_t e,
-                    gsl_vector *jacob_th, cmpl_vector *jacob_n)
+                    gsl_vector *jacob_th, cmpl_vector *jacob_n,
+                    cmpl *jac_ws)
 {
-#define NB_JAC_STATIC 10
-    static struct {
-        cmpl th[2*NB_JAC_STATIC], n[2*NB_JAC_STATIC];
-    } jacs;
     struct {
-        cmpl *th, *n;
+        cmpl *th, *n, *dfdR;
     } jac;
     const int nb = _nb, nblyr = nb - 2;
-    int use_static = (nb <= NB_JAC_STATIC);
     double tanlz = tan(anlz);
     cmpl R[2], nsin0;
     size_t j;
 
-    if(use_static) {
-        jac.th = jacs.th;
-        jac.n  = jacs.n;
-    } else {
-        jac.th = emalloc(2*nb*sizeof(cmpl));
-        jac.n  = emalloc(2*nb*sizeof(cmpl));
-    }
+    jac.th = jac_ws;
+    jac.n  = (jac_ws ? jac_ws + 2*nb : NULL);
+    jac.dfdR = (jac_ws ? jac_ws + 4*nb : NULL);
 
     nsin0 = ns[0] * csin((cmpl) phi0);
 
     if(jacob_th && jacob_n) {
-        mult_layer_refl_jacob(nb, ns, nsin0, ds, lambda, R, jac.th, jac.n);
+        mult_layer_refl_jacob(nb, ns, nsin0, ds, lambda, R, jac.th, jac.n, jac.dfdR);
     } else if(jacob_th) {
-        mult_layer_refl_jacob_th(nb, ns, nsin0, ds, lambda, R, jac.th);
+        mult_layer_refl_jacob_th(nb, ns, nsin0, ds, lambda, R, jac.th, jac.dfdR);
     } else {
         mult_layer_refl(nb, ns, nsin0, ds, lambda, R);
     }
@@ -419,25 +556,33 @@ mult_layer_se_jacob(enum se_type type,
     }
 
     if(jacob_th) {
-        for(j = 0; j < (size_t) nblyr; j++) {
-            struct {
-                cmpl alpha, beta;
-            } d;
-            cmpl dR[2] = {jac.th[j], jac.th[nblyr+j]};
+        se_set_jacob_th(type, nblyr, R, jac.th, tanlz, jacob_th);
+    }
+}
 
-            if(type == SE_ALPHA_BETA) {
-                se_ab_der(R, dR, tanlz, &d.alpha, &d.beta);
-            } else {
-                se_psidel_der(R, dR, &d.alpha, &d.beta);
-            }
+void
+mult_layer_se_jacob_th(enum se_type type, size_t _nb, const cmpl terms[],
+                       const double ds[], double anlz, ell_ab_t e,
+                       gsl_vector *jacob_th, cmpl *jac_ws)
+{
+    const int nb = _nb;
+    double tanlz = tan(anlz);
+    cmpl R[2];
 
-            gsl_vector_set(jacob_th, j, creal(d.alpha));
-            gsl_vector_set(jacob_th, nblyr+j, creal(d.beta));
-        }
+    if(jacob_th) {
+        mult_layer_refl_terms_jacob_th(nb, terms, ds, R,
+                                       jac_ws, jac_ws + 4*nb);
+    } else {
+        mult_layer_refl_terms(nb, terms, ds, R);
+    }
+
+    if(type == SE_ALPHA_BETA) {
+        se_ab(R, tanlz, e);
+    } else {
+        se_psidel(R, e);
     }
 
-    if(! use_static) {
-        free(jac.th);
-        free(jac.n);
+    if(jacob_th) {
+        se_set_jacob_th(type, nb - 2, R, jac_ws, tanlz, jacob_th);
     }
 }
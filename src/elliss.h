@@ -40,11 +40,37 @@ struct elliss_ab {
 typedef struct elliss_ab  ell_ab_t[1];
 typedef struct elliss_ab *ell_ab_ptr;
 
+/* Number of complex values needed by mult_layer_se_jacob as a workspace
+   for "nb" media. */
+#define SE_JACOB_WORKSPACE_SIZE(nb) (6 * (nb))
+
+/* The workspace "jac_ws" is required only if "jacob_th" or "jacob_n" are
+   given, otherwise it can be NULL. */
 extern void
 mult_layer_se_jacob(enum se_type type,
                     size_t nb, const cmpl ns[], double phi0,
                     const double ds[], double lambda,
                     double anlz, ell_ab_t e,
-                    gsl_vector *jacob_th, cmpl_vector *jacob_n);
+                    gsl_vector *jacob_th, cmpl_vector *jacob_n,
+                    cmpl *jac_ws);
+
+/* Number of complex values computed by mult_layer_se_fixed_terms for
+   "nb" media. */
+#define SE_FIXED_TERMS_SIZE(nb) (3 * (nb) - 4)
+
+/* Compute for a wavelength the terms of the ellipsometry kernel that do
+   not depend on the thicknesses: the Fresnel coefficients of each
+   interface and the phase constant of each layer. */
+extern void
+mult_layer_se_fixed_terms(size_t nb, const cmpl ns[], double phi0,
+                          double lambda, cmpl terms[]);
+
+/* Same as mult_layer_se_jacob, with the derivatives respect to the
+   thicknesses only, using the terms computed by
+   mult_layer_se_fixed_terms. */
+extern void
+mult_layer_se_jacob_th(enum se_type type, size_t nb, const cmpl terms[],
+                       const double ds[], double anlz, ell_ab_t e,
+                       gsl_vector *jacob_th, cmpl *jac_ws);
 
 #endif
@@ -13,7 +13,33 @@ struct stack_cache {
     int th_only;
     cmpl *ns;
     struct deriv_info * deriv_info;
+    /* refractive indexes for each spectral point of the layers whose RI is
+       not fitted. The values for the other layers are not set. */
     cmpl *ns_full_spectr;
+    /* non-zero for the layers whose RI is not fitted */
+    int *ri_fixed;
+    /* for thickness-only ellipsometry fits the terms of the kernel that
+       do not depend on the thicknesses, SE_FIXED_TERMS_SIZE(nb_med)
+       values for each spectral point. NULL otherwise. */
+    cmpl *se_terms;
+    /* workspace for the ellipsometry kernel's derivatives */
+    cmpl *jac_ws;
+    /* real and imaginary planes of the RIs of REFL_BATCH_LANES spectral
+       points for the batched reflectivity kernel */
+    double *ns_planes;
+};
+
+enum grid_search_mode {
+    GRID_SEARCH_FULL = 0,
+    GRID_SEARCH_ADAPTIVE,
+    GRID_SEARCH_PRESCREEN,
+};
+
+/* Levenberg-Marquardt solver used by the single-sample fits. The normal
+   equations solver does not store the Jacobian. */
+enum fit_solver {
+    FIT_SOLVER_LMSDER = 0,
+    FIT_SOLVER_NORMAL,
 };
 
 struct fit_config {
@@ -23,6 +49,10 @@ struct fit_config {
     int subsampling;
     struct spectral_range spectr_range;
     double epsabs, epsrel;
+    /* number of threads used to compute the spectrum during a fit */
+    int threads;
+    enum grid_search_mode grid_search;
+    enum fit_solver solver;
 };
 
 __END_DECLS
@@ -21,28 +21,72 @@
 #include <assert.h>
 #include <string.h>
 #include "fit-engine.h"
+#include "lmfit-normal.h"
 #include "refl-fit.h"
 #include "refl-kernel.h"
 #include "elliss-fit.h"
 #include "elliss.h"
 #include "error-messages.h"
 #include "minsampling.h"
-
+#include "thread-pool.h"
+#include "test-deriv.h"
+
+/* Minimum number of spectral points given to each thread. Below this limit
+   the cost of the synchronization is not worth it. */
+#define FIT_MIN_POINTS_PER_THREAD 32
+
+struct fit_worker {
+    stack_t *stack;
+    struct stack_cache cache;
+    struct fit_scratch scratch;
+};
+
+/* The spectral points are shared between the first "number" threads of
+   the engine's pool. */
+struct fit_workers {
+    int number;
+    /* The first worker, executed by the calling thread, uses the
+       engine's own stack and cache so its entry is not used. */
+    struct fit_worker *list;
+};
+
+struct fit_eval_job {
+    struct fit_engine *fit;
+    const gsl_vector *x;
+    fit_range_func_t func;
+    gsl_vector *f;
+    gsl_matrix *jacob;
+    /* normal equations of each thread, NULL if not requested */
+    struct normal_eqs *normal;
+};
 
 static void build_fit_engine_cache(struct fit_engine *f);
 
 static void dispose_fit_engine_cache(struct fit_run *run);
 
+static void build_fit_workers(struct fit_engine *f, int threads_number);
+
+static int prepare_fit_run(struct fit_engine *fit);
+
+static void dispose_fit_workers(struct fit_run *run);
 
+
+/* When "fps" is not NULL the refractive indexes of the layers not
+   referenced by any PID_LAYER_N parameter are computed once for all the
+   spectral points. If no RI is fitted the cache is marked as "th_only". */
 void
 build_stack_cache(struct stack_cache *cache, stack_t *stack,
-                  struct spectrum *spectr, int th_only_optimize)
+                  struct spectrum *spectr, struct fit_parameters *fps)
 {
     size_t nb_med = stack->nb;
     size_t j;
+    int nb_fixed = 0;
 
     cache->nb_med = nb_med;
     cache->ns  = emalloc(nb_med * sizeof(cmpl));
+    /* Large enough for both the SE and the reflectivity kernels. */
+    cache->jac_ws = emalloc(SE_JACOB_WORKSPACE_SIZE(nb_med) * sizeof(cmpl));
+    cache->ns_planes = emalloc(2 * nb_med * REFL_BATCH_LANES * sizeof(double));
 
     cache->deriv_info = emalloc(nb_med * sizeof(struct deriv_info));
 
@@ -54,22 +98,66 @@ build_stack_cache(struct stack_cache *cache, stack_t *stack,
         di->val = (tpnb == 0 ? NULL : cmpl_vector_alloc(tpnb));
     }
 
-    cache->th_only = th_only_optimize;
+    cache->ri_fixed = emalloc(nb_med * sizeof(int));
+    for(j = 0; j < nb_med; j++) {
+        cache->ri_fixed[j] = (fps != NULL);
+    }
 
-    if(th_only_optimize) {
+    if(fps) {
+        for(j = 0; j < fps->number; j++) {
+            const fit_param_t *fp = fps->values + j;
+            if(fp->id == PID_LAYER_N) {
+                cache->ri_fixed[fp->layer_nb] = 0;
+            }
+        }
+        for(j = 0; j < nb_med; j++) {
+            nb_fixed += cache->ri_fixed[j];
+        }
+    }
+
+    cache->th_only = (nb_fixed == nb_med);
+
+    if(nb_fixed > 0) {
         int k, npt = spectra_points(spectr);
-        cmpl *ns;
+        double *lambda = emalloc(npt * sizeof(double));
+        cmpl *n_layer = emalloc(npt * sizeof(cmpl));
 
         cache->ns_full_spectr = emalloc(nb_med * npt * sizeof(cmpl));
 
-        for(k = 0, ns = cache->ns_full_spectr; k < npt; ns += nb_med, k++) {
-            double lambda = get_lambda_by_index(spectr, k);
-            stack_get_ns_list(stack, ns, lambda);
+        for(k = 0; k < npt; k++) {
+            lambda[k] = get_lambda_by_index(spectr, k);
+        }
+
+        for(j = 0; j < nb_med; j++) {
+            if(! cache->ri_fixed[j]) continue;
+            n_value_array(stack->disp[j], lambda, n_layer, npt);
+            for(k = 0; k < npt; k++) {
+                cache->ns_full_spectr[k * nb_med + j] = n_layer[k];
+            }
         }
+
+        free(n_layer);
+        free(lambda);
     } else {
         cache->ns_full_spectr = NULL;
     }
 
+    cache->se_terms = NULL;
+    if(cache->th_only && (spectr->config.system == SYSTEM_ELLISS_AB ||
+                          spectr->config.system == SYSTEM_ELLISS_PSIDEL)) {
+        const size_t nterms = SE_FIXED_TERMS_SIZE(nb_med);
+        int k, npt = spectra_points(spectr);
+
+        cache->se_terms = emalloc(nterms * npt * sizeof(cmpl));
+
+        for(k = 0; k < npt; k++) {
+            mult_layer_se_fixed_terms(nb_med, cache->ns_full_spectr + k * nb_med,
+                                      spectr->config.aoi,
+                                      get_lambda_by_index(spectr, k),
+                                      cache->se_terms + k * nterms);
+        }
+    }
+
     cache->is_valid = 1;
 }
 
@@ -83,6 +171,9 @@ dispose_stack_cache(struct stack_cache *cache)
     }
 
     free(cache->ns);
+    free(cache->jac_ws);
+    free(cache->ns_planes);
+    free(cache->ri_fixed);
 
     for(j = 0; j < nb_med; j++) {
         struct deriv_info *di = & cache->deriv_info[j];
@@ -96,28 +187,28 @@ dispose_stack_cache(struct stack_cache *cache)
         free(cache->ns_full_spectr);
     }
 
+    if(cache->se_terms) {
+        free(cache->se_terms);
+    }
+
     cache->is_valid = 0;
 }
 
 void
-build_fit_engine_cache(struct fit_engine *f)
+alloc_scratch_jacob(struct fit_scratch *scratch, enum system_kind syskind, size_t nb)
 {
-    size_t dmultipl = (f->run->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
-    int RI_fixed = fit_parameters_are_RI_fixed(f->parameters);
-    size_t nb = f->stack->nb;
+    size_t dmultipl = (syskind == SYSTEM_REFLECTOMETER ? 1 : 2);
     int nblyr = nb - 2;
 
-    build_stack_cache(&f->run->cache, f->stack, f->run->spectr, RI_fixed);
-
-    f->run->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+    scratch->jac_th = gsl_vector_alloc(dmultipl * nblyr);
 
-    switch(f->run->system_kind) {
+    switch(syskind) {
     case SYSTEM_REFLECTOMETER:
-        f->run->jac_n.refl = gsl_vector_alloc(2 * nb);
+        scratch->jac_n.refl = gsl_vector_alloc(2 * nb);
         break;
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
-        f->run->jac_n.ell = cmpl_vector_alloc(2 * nb);
+        scratch->jac_n.ell = cmpl_vector_alloc(2 * nb);
     default:
         /* */
         ;
@@ -125,25 +216,301 @@ build_fit_engine_cache(struct fit_engine *f)
 }
 
 void
-dispose_fit_engine_cache(struct fit_run *run)
+free_scratch_jacob(struct fit_scratch *scratch, enum system_kind syskind)
 {
-    gsl_vector_free(run->jac_th);
+    gsl_vector_free(scratch->jac_th);
 
-    switch(run->system_kind) {
+    switch(syskind) {
     case SYSTEM_REFLECTOMETER:
-        gsl_vector_free(run->jac_n.refl);
+        gsl_vector_free(scratch->jac_n.refl);
         break;
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
-        cmpl_vector_free(run->jac_n.ell);
+        cmpl_vector_free(scratch->jac_n.ell);
     default:
         /* */
         ;
     }
+}
+
+void
+build_fit_engine_cache(struct fit_engine *f)
+{
+    struct fit_scratch scratch[1];
+
+    build_stack_cache(&f->run->cache, f->stack, f->run->spectr, f->parameters);
+
+    alloc_scratch_jacob(scratch, f->run->system_kind, f->stack->nb);
+    f->run->jac_th = scratch->jac_th;
+    f->run->jac_n = scratch->jac_n;
+
+    f->run->refl_cache.rc = NULL;
+    if(f->run->system_kind == SYSTEM_REFLECTOMETER) {
+        size_t npt = spectra_points(f->run->spectr);
+        f->run->refl_cache.rc = refl_ni_cache_new(f->stack->nb, npt);
+        f->run->refl_cache.x = gsl_vector_alloc(f->parameters->number);
+        f->run->refl_cache.valid = 0;
+    }
+}
+
+void
+dispose_fit_engine_cache(struct fit_run *run)
+{
+    struct fit_scratch scratch[1];
+
+    scratch->jac_th = run->jac_th;
+    scratch->jac_n = run->jac_n;
+    free_scratch_jacob(scratch, run->system_kind);
+
+    if(run->refl_cache.rc) {
+        refl_ni_cache_free(run->refl_cache.rc);
+        gsl_vector_free(run->refl_cache.x);
+    }
 
     dispose_stack_cache(&run->cache);
 }
 
+/* Each worker thread has its own copy of the stack and its own stack cache.
+   The cache is built without the table of refractive indexes: the table
+   of the engine's cache is used by all the threads. */
+void
+build_fit_workers(struct fit_engine *f, int threads_number)
+{
+    struct fit_workers *workers = emalloc(sizeof(struct fit_workers));
+    int k;
+
+    workers->list = emalloc(threads_number * sizeof(struct fit_worker));
+    for (k = 1; k < threads_number; k++) {
+        struct fit_worker *w = &workers->list[k];
+        w->stack = stack_copy(f->stack);
+        build_stack_cache(&w->cache, w->stack, f->run->spectr, NULL);
+        w->scratch.stack = w->stack;
+        w->scratch.cache = &w->cache;
+        alloc_scratch_jacob(&w->scratch, f->run->system_kind, w->stack->nb);
+    }
+    workers->number = threads_number;
+    f->run->workers = workers;
+}
+
+void
+dispose_fit_workers(struct fit_run *run)
+{
+    struct fit_workers *workers = run->workers;
+    int k;
+
+    if (!workers) return;
+
+    for (k = 1; k < workers->number; k++) {
+        struct fit_worker *w = &workers->list[k];
+        free_scratch_jacob(&w->scratch, run->system_kind);
+        dispose_stack_cache(&w->cache);
+        stack_free(w->stack);
+    }
+    free(workers->list);
+    free(workers);
+    run->workers = NULL;
+}
+
+static void
+engine_scratch(struct fit_engine *fit, struct fit_scratch *scratch)
+{
+    scratch->stack = fit->stack;
+    scratch->cache = &fit->run->cache;
+    scratch->jac_th = fit->run->jac_th;
+    scratch->jac_n = fit->run->jac_n;
+    scratch->normal = NULL;
+}
+
+static void
+fit_eval_worker(void *data, int index)
+{
+    struct fit_eval_job *job = data;
+    struct fit_engine *fit = job->fit;
+    struct fit_workers *workers = fit->run->workers;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const int threads_number = workers->number;
+    const size_t j_start = (npt * index) / threads_number;
+    const size_t j_end = (npt * (index + 1)) / threads_number;
+    struct fit_scratch scratch[1];
+
+    if (index >= threads_number) {
+        return;
+    }
+
+    if (index == 0) {
+        engine_scratch(fit, scratch);
+    } else {
+        const struct fit_parameters *fps = fit->parameters;
+        size_t j;
+        *scratch = workers->list[index].scratch;
+        for (j = 0; j < fps->number; j++) {
+            const fit_param_t *fp = fps->values + j;
+            if (fp->id != PID_FIRSTMUL) {
+                stack_apply_param(scratch->stack, fp, gsl_vector_get(job->x, j));
+            }
+        }
+    }
+
+    scratch->normal = (job->normal ? &job->normal[index] : NULL);
+    job->func(fit, scratch, j_start, j_end, job->f, job->jacob);
+}
+
+/* Return the refractive indexes of the layers for the spectral point "j".
+   The values for the layers whose RI is not fitted are taken from the
+   engine's cache, the others are computed with the scratch's stack. */
+cmpl *
+fit_engine_get_ns(struct fit_engine *fit, struct fit_scratch *scratch,
+                  size_t j, double lambda)
+{
+    const struct stack_cache *cache = &fit->run->cache;
+    const int nb_med = cache->nb_med;
+    stack_t *stack = scratch->stack;
+    cmpl *ns = scratch->cache->ns;
+    int k;
+
+    if(cache->th_only) {
+        return cache->ns_full_spectr + j * nb_med;
+    }
+
+    if(cache->ns_full_spectr) {
+        const cmpl *ns_fixed = cache->ns_full_spectr + j * nb_med;
+        for(k = 0; k < nb_med; k++) {
+            ns[k] = (cache->ri_fixed[k] ? ns_fixed[k] : n_value(stack->disp[k], lambda));
+        }
+    } else {
+        stack_get_ns_list(stack, ns, lambda);
+    }
+
+    return ns;
+}
+
+/* Apply the fit parameters "x" and compute all the spectral points using
+   "func". The points are shared between the engine's threads, if any. */
+void
+fit_engine_eval_points(struct fit_engine *fit, const gsl_vector *x,
+                       fit_range_func_t func,
+                       gsl_vector *f, gsl_matrix *jacob)
+{
+    fit_engine_commit_parameters(fit, x);
+
+    if (fit->run->workers) {
+        struct fit_eval_job job[1] = {{fit, x, func, f, jacob, NULL}};
+        thread_pool_run(fit->run->pool, fit_eval_worker, job);
+    } else {
+        struct fit_scratch scratch[1];
+        engine_scratch(fit, scratch);
+        func(fit, scratch, 0, spectra_points(fit->run->spectr), f, jacob);
+    }
+}
+
+/* Add to the normal equations the Jacobian rows normal->rows of a spectral
+   point with residuals "r". */
+void
+normal_eqs_add_rows(struct normal_eqs *normal, const double r[])
+{
+    const size_t p = normal->jtj->size1;
+    size_t i, k, m;
+
+    for(m = 0; m < normal->rows->size1; m++) {
+        const double *row = gsl_matrix_const_ptr(normal->rows, m, 0);
+        for(i = 0; i < p; i++) {
+            double *jtj_row = gsl_matrix_ptr(normal->jtj, i, 0);
+            for(k = 0; k <= i; k++) {
+                jtj_row[k] += row[i] * row[k];
+            }
+            *gsl_vector_ptr(normal->jtf, i) += row[i] * r[m];
+        }
+    }
+}
+
+/* Return the normal equations of each thread, allocated by the first
+   call. The first thread accumulates directly in the caller's "jtj" and
+   "jtf" so its entries are set by fit_engine_eval_normal. */
+static struct normal_eqs *
+get_normal_eqs(struct fit_run *run, size_t p)
+{
+    const int threads_number = (run->workers ? run->workers->number : 1);
+    const size_t nrows = (run->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
+    int t;
+
+    if(! run->normal) {
+        run->normal = emalloc(threads_number * sizeof(struct normal_eqs));
+        for(t = 0; t < threads_number; t++) {
+            run->normal[t].jtj = (t == 0 ? NULL : gsl_matrix_alloc(p, p));
+            run->normal[t].jtf = (t == 0 ? NULL : gsl_vector_alloc(p));
+            run->normal[t].rows = gsl_matrix_alloc(nrows, p);
+        }
+    }
+
+    return run->normal;
+}
+
+static void
+dispose_normal_eqs(struct fit_run *run)
+{
+    const int threads_number = (run->workers ? run->workers->number : 1);
+    int t;
+
+    if(! run->normal) return;
+
+    for(t = 0; t < threads_number; t++) {
+        if(t > 0) {
+            gsl_matrix_free(run->normal[t].jtj);
+            gsl_vector_free(run->normal[t].jtf);
+        }
+        gsl_matrix_free(run->normal[t].rows);
+    }
+    free(run->normal);
+    run->normal = NULL;
+}
+
+/* Same as fit_engine_eval_points but the Jacobian is not stored: its rows
+   are accumulated in the normal equations "jtj" and "jtf". Each thread
+   accumulates its own points and the sums are added at the end in the
+   order of the threads. */
+void
+fit_engine_eval_normal(struct fit_engine *fit, const gsl_vector *x,
+                       fit_range_func_t func, gsl_vector *f,
+                       gsl_matrix *jtj, gsl_vector *jtf)
+{
+    struct fit_workers *workers = fit->run->workers;
+    const int threads_number = (workers ? workers->number : 1);
+    const size_t p = fit->parameters->number;
+    struct normal_eqs *normal = get_normal_eqs(fit->run, p);
+    size_t i, k;
+    int t;
+
+    normal[0].jtj = jtj;
+    normal[0].jtf = jtf;
+    for(t = 0; t < threads_number; t++) {
+        gsl_matrix_set_zero(normal[t].jtj);
+        gsl_vector_set_zero(normal[t].jtf);
+    }
+
+    fit_engine_commit_parameters(fit, x);
+
+    if (workers) {
+        struct fit_eval_job job[1] = {{fit, x, func, f, NULL, normal}};
+        thread_pool_run(fit->run->pool, fit_eval_worker, job);
+    } else {
+        struct fit_scratch scratch[1];
+        engine_scratch(fit, scratch);
+        scratch->normal = normal;
+        func(fit, scratch, 0, spectra_points(fit->run->spectr), f, NULL);
+    }
+
+    for(t = 1; t < threads_number; t++) {
+        gsl_matrix_add(jtj, normal[t].jtj);
+        gsl_vector_add(jtf, normal[t].jtf);
+    }
+
+    for(i = 0; i < p; i++) {
+        for(k = 0; k < i; k++) {
+            gsl_matrix_set(jtj, k, i, gsl_matrix_get(jtj, i, k));
+        }
+    }
+}
+
 int
 fit_engine_apply_param(struct fit_engine *fit, const fit_param_t *fp,
                        double val)
@@ -186,32 +553,100 @@ fit_engine_commit_parameters(struct fit_engine *fit, const gsl_vector *x)
     fit_engine_apply_parameters(fit, fps, x);
 }
 
+/* Copy of "s" restricted to the points to fit according to the config. */
+static struct spectrum *
+new_fit_spectrum(struct fit_engine *fit, struct spectrum *s)
+{
+    struct fit_config *cfg = fit->config;
+    enum system_kind syskind = s->config.system;
+    struct spectrum *spectr = spectra_copy(s);
+
+    if(cfg->spectr_range.active)
+        spectr_cut_range(spectr, cfg->spectr_range.min, cfg->spectr_range.max);
+
+    if(cfg->subsampling) {
+        if(syskind == SYSTEM_ELLISS_AB || syskind == SYSTEM_ELLISS_PSIDEL) {
+            elliss_sample_minimize(spectr, 0.05);
+        }
+    }
+
+    return spectr;
+}
+
 int
 fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
 {
-    struct fit_config *cfg = fit->config;
     enum system_kind syskind = s->config.system;
 
+    if(syskind != SYSTEM_REFLECTOMETER && syskind != SYSTEM_ELLISS_AB &&
+       syskind != SYSTEM_ELLISS_PSIDEL) {
+        return 1;
+    }
+
     fit->run->system_kind = syskind;
-    fit->run->spectr = spectra_copy(s);
+    fit->run->spectr = new_fit_spectrum(fit, s);
 
-    if(fit->config->spectr_range.active)
-        spectr_cut_range(fit->run->spectr,
-                         cfg->spectr_range.min, cfg->spectr_range.max);
+    if (prepare_fit_run(fit)) {
+        return 1;
+    }
 
-    if(cfg->subsampling) {
-        if(syskind == SYSTEM_ELLISS_AB || syskind == SYSTEM_ELLISS_PSIDEL) {
-            elliss_sample_minimize(fit->run->spectr, 0.05);
+#ifdef DEBUG_REGRESS
+    if(syskind != SYSTEM_REFLECTOMETER) {
+        elliss_fit_test_deriv(fit);
+    }
+    {
+        /* Check at the first, middle and last wavelengths. */
+        const int npt = spectra_points(fit->run->spectr);
+        int j, k, failed = 0;
+        for(j = 0; j < fit->stack->nb; j++) {
+            if(fit->run->cache.ri_fixed[j]) continue;
+            for(k = 0; k < 3; k++) {
+                const double lambda = get_lambda_by_index(fit->run->spectr, k * (npt - 1) / 2);
+                failed += test_disp_deriv(fit->stack->disp[j], lambda);
+            }
+        }
+        if(failed > 0) {
+            printf("WARNING: %d dispersion derivatives above tolerance\n", failed);
         }
     }
+#endif
+
+    return 0;
+}
+
+/* Prepare the engine to fit the spectrum already stored in fit->run. */
+static int
+prepare_fit_run(struct fit_engine *fit)
+{
+    struct fit_config *cfg = fit->config;
+    enum system_kind syskind = fit->run->system_kind;
 
     build_fit_engine_cache(fit);
 
+    fit->run->pool = NULL;
+    fit->run->workers = NULL;
+    fit->run->clones = NULL;
+    fit->run->normal = NULL;
+    fit->run->solver = NULL;
+    fit->run->normal_solver = NULL;
+    if (cfg->threads > 1) {
+        int threads_number = spectra_points(fit->run->spectr) / FIT_MIN_POINTS_PER_THREAD;
+        fit->run->pool = thread_pool_new(cfg->threads);
+        if (threads_number > cfg->threads) {
+            threads_number = cfg->threads;
+        }
+        if (threads_number > 1) {
+            build_fit_workers(fit, threads_number);
+        }
+    }
+
     switch(syskind) {
     case SYSTEM_REFLECTOMETER:
         fit->run->mffun.f      = & refl_fit_f;
         fit->run->mffun.df     = & refl_fit_df;
         fit->run->mffun.fdf    = & refl_fit_fdf;
+        fit->run->normal_fdf   = & refl_fit_normal_fdf;
+        fit->run->refl_kernel  = mult_layer_refl_ni_kernel(fit->stack->nb);
         fit->run->mffun.n      = spectra_points(fit->run->spectr);
         fit->run->mffun.p      = fit->parameters->number;
         fit->run->mffun.params = fit;
@@ -221,6 +656,7 @@ fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
         fit->run->mffun.f      = & elliss_fit_f;
         fit->run->mffun.df     = & elliss_fit_df;
         fit->run->mffun.fdf    = & elliss_fit_fdf;
+        fit->run->normal_fdf   = & elliss_fit_normal_fdf;
         fit->run->mffun.n      = 2 * spectra_points(fit->run->spectr);
         fit->run->mffun.p      = fit->parameters->number;
         fit->run->mffun.params = fit;
@@ -235,23 +671,155 @@ fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
 
     fit->run->results = gsl_vector_alloc(fit->parameters->number);
 
-#ifdef DEBUG_REGRESS
-    if(syskind != SYSTEM_REFLECTOMETER) {
-        elliss_fit_test_deriv(fit);
+    return 0;
+}
+
+/* Create a copy of a prepared fit engine that can be used from another
+   thread. The copy computes the spectrum using a single thread. */
+struct fit_engine *
+fit_engine_clone(const struct fit_engine *fit)
+{
+    struct fit_engine *clone = fit_engine_new();
+    clone->extra[0] = fit->extra[0];
+    clone->config[0] = fit->config[0];
+    clone->config->threads = 1;
+    clone->parameters = fit->parameters;
+    clone->stack = stack_copy(fit->stack);
+    clone->run->system_kind = fit->run->system_kind;
+    clone->run->spectr = spectra_copy(fit->run->spectr);
+    prepare_fit_run(clone);
+    return clone;
+}
+
+struct fit_engine **
+fit_engine_get_clones(struct fit_engine *fit)
+{
+    struct fit_run *run = fit->run;
+    int k, n;
+
+    if(! run->pool) {
+        return NULL;
     }
-#endif
 
-    return 0;
+    if(! run->clones) {
+        n = thread_pool_size(run->pool);
+        run->clones = emalloc(n * sizeof(struct fit_engine *));
+        for(k = 0; k < n; k++) {
+            run->clones[k] = fit_engine_clone(fit);
+        }
+    }
+
+    return run->clones;
+}
+
+static void
+dispose_fit_clones(struct fit_run *run)
+{
+    int k;
+
+    if(! run->clones) return;
+
+    for(k = 0; k < thread_pool_size(run->pool); k++) {
+        fit_engine_disable(run->clones[k]);
+        fit_engine_free(run->clones[k]);
+    }
+    free(run->clones);
+    run->clones = NULL;
 }
 
 void
 fit_engine_disable(struct fit_engine *fit)
 {
+    if(fit->run->normal_solver) {
+        lmfit_normal_free(fit->run->normal_solver);
+    }
+    if(fit->run->solver) {
+        gsl_multifit_fdfsolver_free(fit->run->solver);
+    }
+    dispose_fit_clones(fit->run);
+    dispose_normal_eqs(fit->run);
+    dispose_fit_workers(fit->run);
+    if(fit->run->pool) {
+        thread_pool_free(fit->run->pool);
+    }
     dispose_fit_engine_cache(fit->run);
     spectra_free(fit->run->spectr);
     gsl_vector_free(fit->run->results);
 }
 
+/* The caches built by prepare_fit_run depend on the spectrum only through
+   the system configuration and the wavelengths of the points. */
+static int
+same_spectral_points(struct spectrum *a, struct spectrum *b)
+{
+    int j, npt = spectra_points(a);
+
+    if(a->config.system != b->config.system || a->config.aoi != b->config.aoi ||
+       a->config.analyzer != b->config.analyzer || a->config.numap != b->config.numap) {
+        return 0;
+    }
+
+    if(spectra_points(b) != npt) {
+        return 0;
+    }
+
+    for(j = 0; j < npt; j++) {
+        if(get_lambda_by_index(a, j) != get_lambda_by_index(b, j)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int
+fit_engine_rebind_spectrum(struct fit_engine *fit, struct spectrum *s)
+{
+    struct spectrum *spectr = new_fit_spectrum(fit, s);
+
+    if(! same_spectral_points(spectr, fit->run->spectr)) {
+        spectra_free(spectr);
+        fit_engine_disable(fit);
+        return fit_engine_prepare(fit, s);
+    }
+
+    spectra_free(fit->run->spectr);
+    fit->run->spectr = spectr;
+    fit->run->refl_cache.valid = 0;
+
+    if(fit->run->clones) {
+        int k;
+        for(k = 0; k < thread_pool_size(fit->run->pool); k++) {
+            struct fit_run *crun = fit->run->clones[k]->run;
+            spectra_free(crun->spectr);
+            crun->spectr = spectra_copy(spectr);
+            crun->refl_cache.valid = 0;
+        }
+    }
+
+    return 0;
+}
+
+void
+fit_engine_get_solver(struct fit_engine *fit, gsl_multifit_fdfsolver **s,
+                      struct lmfit_normal **ns)
+{
+    struct fit_run *run = fit->run;
+
+    if(fit->config->solver == FIT_SOLVER_NORMAL) {
+        if(! run->normal_solver) {
+            run->normal_solver = lmfit_normal_new(fit);
+        }
+    } else if(! run->solver) {
+        /* We choose Levenberg-Marquardt algorithm, scaled version*/
+        run->solver = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmsder,
+                                                   run->mffun.n, run->mffun.p);
+    }
+
+    *s = run->solver;
+    *ns = run->normal_solver;
+}
+
 int
 check_fit_parameters(struct stack *stack, struct fit_parameters *fps, str_ptr *error_msg)
 {
@@ -391,6 +959,142 @@ fit_engine_estimate_param_grid_step(struct fit_engine *fit, const gsl_vector *x,
     return delta;
 }
 
+static struct refl_spectrum_cache *
+new_spectrum_cache(size_t nb, size_t npt)
+{
+    struct refl_spectrum_cache *cache = emalloc(sizeof(struct refl_spectrum_cache));
+    cache->nb = nb;
+    cache->npt = npt;
+    cache->lambda = emalloc((1 + 2*nb) * npt * sizeof(double));
+    cache->ns_re = cache->lambda + npt;
+    cache->ns_im = cache->ns_re + nb * npt;
+    cache->ds = emalloc(nb * sizeof(double));
+    cache->lambda_new = emalloc(npt * sizeof(double));
+    cache->r_raw = emalloc(npt * sizeof(double));
+    cache->n_layer = emalloc(npt * sizeof(cmpl));
+    cache->valid = 0;
+    cache->rc = refl_ni_cache_new(nb, npt);
+    return cache;
+}
+
+static void
+dispose_spectrum_cache(struct refl_spectrum_cache *cache)
+{
+    refl_ni_cache_free(cache->rc);
+    free(cache->n_layer);
+    free(cache->r_raw);
+    free(cache->lambda_new);
+    free(cache->ds);
+    free(cache->lambda);
+    free(cache);
+}
+
+/* Store the RI of the medium "k" in the cache's planes and return
+   whether it has changed. */
+static int
+spectrum_cache_update_ri(struct refl_spectrum_cache *cache,
+                         const disp_t *disp, int k)
+{
+    const size_t npt = cache->npt;
+    double *ns_re = cache->ns_re + k * npt;
+    double *ns_im = cache->ns_im + k * npt;
+    int changed = 0;
+    size_t j;
+
+    n_value_array(disp, cache->lambda, cache->n_layer, npt);
+
+    for(j = 0; j < npt; j++) {
+        const double re = creal(cache->n_layer[j]);
+        const double im = cimag(cache->n_layer[j]);
+        if(re != ns_re[j] || im != ns_im[j]) {
+            ns_re[j] = re;
+            ns_im[j] = im;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+/* Store the new inputs in the cache's planes and return the deepest
+   interface whose reflection coefficient changes because of them. The
+   RI of medium "k" enters the interfaces k - 1 and k, its thickness only
+   the interface k - 1. */
+static int
+spectrum_cache_update(struct refl_spectrum_cache *cache, const stack_t *stack)
+{
+    const int nb = cache->nb;
+    const double *ds = stack_get_ths_list(stack);
+    int start = -1;
+    int k;
+
+    if(! cache->valid ||
+       memcmp(cache->lambda, cache->lambda_new, cache->npt * sizeof(double)) != 0) {
+        memcpy(cache->lambda, cache->lambda_new, cache->npt * sizeof(double));
+        cache->valid = 0;
+        start = nb - 2;
+    }
+
+    for(k = nb - 1; k >= 0; k--) {
+        if(spectrum_cache_update_ri(cache, stack->disp[k], k)) {
+            const int k_start = (k < nb - 2 ? k : nb - 2);
+            if(k_start > start) {
+                start = k_start;
+            }
+        }
+    }
+
+    for(k = 1; k < nb - 1; k++) {
+        if(! cache->valid || cache->ds[k-1] != ds[k-1]) {
+            cache->ds[k-1] = ds[k-1];
+            if(k - 1 > start) {
+                start = k - 1;
+            }
+        }
+    }
+
+    cache->valid = 1;
+    return start;
+}
+
+/* The inputs and the reflection coefficients of each interface are kept
+   between the calls so that, when a parameter of a single layer is
+   changed, only the interfaces above it are recomputed. */
+static void
+generate_refl_spectrum(struct fit_engine *fit, struct spectrum *ref,
+                       struct data_table *table)
+{
+    struct refl_spectrum_cache *cache = fit->spectrum_cache;
+    size_t nb_med = fit->stack->nb;
+    size_t j, npt = spectra_points(ref);
+    int start;
+
+    if(cache && (cache->nb != nb_med || cache->npt != npt)) {
+        dispose_spectrum_cache(cache);
+        cache = NULL;
+    }
+
+    if(cache == NULL) {
+        cache = new_spectrum_cache(nb_med, npt);
+        fit->spectrum_cache = cache;
+    }
+
+    for(j = 0; j < npt; j++) {
+        cache->lambda_new[j] = get_lambda_by_index(ref, j);
+    }
+
+    start = spectrum_cache_update(cache, fit->stack);
+
+    mult_layer_refl_ni_batch_cached(cache->rc, 0, npt, cache->ns_re,
+                                    cache->ns_im, cache->ds, cache->lambda,
+                                    start, cache->r_raw);
+
+    for(j = 0; j < npt; j++) {
+        data_table_set(table, j, 0, cache->lambda[j]);
+        data_table_set(table, j, 1, fit->extra->rmult * cache->r_raw[j]);
+    }
+}
+
 void
 fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
                              struct spectrum *synth)
@@ -399,13 +1103,19 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
     size_t nb_med = fit->stack->nb;
     struct data_table *table = synth->table[0].table;
     int j, npt = spectra_points(ref);
-    cmpl *ns = emalloc(sizeof(cmpl) * nb_med);
+    cmpl *ns;
     double const * ths;
 
     assert(spectra_points(ref) == spectra_points(synth));
 
     synth->config = ref->config;
 
+    if(syskind == SYSTEM_REFLECTOMETER) {
+        generate_refl_spectrum(fit, ref, table);
+        return;
+    }
+
+    ns = emalloc(sizeof(cmpl) * nb_med);
     ths = stack_get_ths_list(fit->stack);
 
     for(j = 0; j < npt; j++) {
@@ -416,12 +1126,6 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
         stack_get_ns_list(fit->stack, ns, lambda);
 
         switch(syskind) {
-        case SYSTEM_REFLECTOMETER: {
-            double r_raw = mult_layer_refl_ni(nb_med, ns, ths, lambda,
-                                              NULL, NULL);
-            data_table_set(table, j, 1, fit->extra->rmult * r_raw);
-            break;
-        }
         case SYSTEM_ELLISS_AB:
         case SYSTEM_ELLISS_PSIDEL: {
             const enum se_type se_type = GET_SE_TYPE(syskind);
@@ -430,7 +1134,7 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
             ell_ab_t ell;
 
             mult_layer_se_jacob(se_type, nb_med, ns, phi0,
-                                ths, lambda, anlz, ell, NULL, NULL);
+                                ths, lambda, anlz, ell, NULL, NULL, NULL);
 
             data_table_set(table, j, 1, ell->alpha);
             data_table_set(table, j, 2, ell->beta);
@@ -452,6 +1156,7 @@ fit_engine_new()
     set_default_extra_param(fit->extra);
     fit->parameters = NULL;
     fit->stack = NULL;
+    fit->spectrum_cache = NULL;
     return fit;
 }
 
@@ -487,6 +1192,9 @@ fit_engine_free(struct fit_engine *fit)
     if (fit->stack) {
         stack_free(fit->stack);
     }
+    if (fit->spectrum_cache) {
+        dispose_spectrum_cache(fit->spectrum_cache);
+    }
     free(fit);
 }
 
@@ -531,6 +1239,9 @@ fit_config_set_default(struct fit_config *cfg)
     cfg->spectr_range.active = 0;
     cfg->epsabs = 1.0E-7;
     cfg->epsrel = 1.0E-7;
+    cfg->threads = 1;
+    cfg->grid_search = GRID_SEARCH_FULL;
+    cfg->solver = FIT_SOLVER_LMSDER;
 }
 
 int
@@ -553,6 +1264,24 @@ fit_config_write(writer_t *w, const struct fit_config *config)
         writer_newline(w);
     }
 
+    if (config->threads > 1) {
+        writer_printf(w, "threads %d", config->threads);
+        writer_newline(w);
+    }
+
+    if (config->grid_search == GRID_SEARCH_ADAPTIVE) {
+        writer_printf(w, "grid-search adaptive");
+        writer_newline(w);
+    } else if (config->grid_search == GRID_SEARCH_PRESCREEN) {
+        writer_printf(w, "grid-search prescreen");
+        writer_newline(w);
+    }
+
+    if (config->solver == FIT_SOLVER_NORMAL) {
+        writer_printf(w, "solver normal-equations");
+        writer_newline(w);
+    }
+
     writer_printf(w, "epsilon %g %g", config->epsabs, config->epsrel);
     writer_newline_exit(w);
     return 1;
@@ -586,6 +1315,40 @@ fit_config_read(lexer_t *l, struct fit_config *config)
     } else {
         config->spectr_range.active = 0;
     }
+    if (strcmp(CSTR(l->store), "threads") == 0) {
+        if (lexer_integer(l, &config->threads)) goto config_exit;
+        if (lexer_ident(l)) goto config_exit;
+    } else {
+        config->threads = 1;
+    }
+    if (strcmp(CSTR(l->store), "grid-search") == 0) {
+        if (lexer_ident(l)) goto config_exit;
+        if (strcmp(CSTR(l->store), "adaptive") == 0) {
+            config->grid_search = GRID_SEARCH_ADAPTIVE;
+        } else if (strcmp(CSTR(l->store), "prescreen") == 0) {
+            config->grid_search = GRID_SEARCH_PRESCREEN;
+        } else if (strcmp(CSTR(l->store), "full") == 0) {
+            config->grid_search = GRID_SEARCH_FULL;
+        } else {
+            goto config_exit;
+        }
+        if (lexer_ident(l)) goto config_exit;
+    } else {
+        config->grid_search = GRID_SEARCH_FULL;
+    }
+    if (strcmp(CSTR(l->store), "solver") == 0) {
+        if (lexer_ident(l)) goto config_exit;
+        if (strcmp(CSTR(l->store), "normal-equations") == 0) {
+            config->solver = FIT_SOLVER_NORMAL;
+        } else if (strcmp(CSTR(l->store), "lmsder") == 0) {
+            config->solver = FIT_SOLVER_LMSDER;
+        } else {
+            goto config_exit;
+        }
+        if (lexer_ident(l)) goto config_exit;
+    } else {
+        config->solver = FIT_SOLVER_LMSDER;
+    }
     if (strcmp(CSTR(l->store), "epsilon")) goto config_exit;
     if (lexer_number(l, &config->epsabs)) goto config_exit;
     if (lexer_number(l, &config->epsrel)) goto config_exit;
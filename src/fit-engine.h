@@ -23,6 +23,7 @@
 
 #include "defs.h"
 #include "elliss.h"
+#include "refl-kernel.h"
 #include "spectra.h"
 #include "stack.h"
 #include "fit-params.h"
@@ -39,6 +40,34 @@ struct extra_params {
     double rmult;
 };
 
+/* Derivatives of the spectrum respect to the refractive indexes. */
+union jac_n_vector {
+    gsl_vector *refl;
+    cmpl_vector *ell;
+};
+
+/* Normal equations J^T J and J^T f accumulated one spectral point at a
+   time. Only the lower triangle of "jtj" is updated. */
+struct normal_eqs {
+    gsl_matrix *jtj;
+    gsl_vector *jtf;
+    /* Jacobian rows of the spectral point being computed */
+    gsl_matrix *rows;
+};
+
+/* Reflection coefficients of each interface computed for the parameters
+   "x". When only the parameters of the upper layers change the
+   reflection coefficients below them are reused. */
+struct refl_fit_cache {
+    struct refl_ni_cache *rc;
+    gsl_vector *x;
+    int valid;
+    /* Deepest interface to recompute in the current evaluation. */
+    int start;
+};
+
+struct lmfit_normal;
+
 struct fit_run {
     enum system_kind system_kind;
 
@@ -46,15 +75,81 @@ struct fit_run {
 
     gsl_multifit_function_fdf mffun;
 
+    /* Same as mffun.fdf but the Jacobian is not stored: the normal
+       equations J^T J and J^T f are computed instead. */
+    int (*normal_fdf)(const gsl_vector *x, void *params, gsl_vector *f,
+                      gsl_matrix *jtj, gsl_vector *jtf);
+
     gsl_vector *results;
 
+    /* Reflectivity kernel selected for the number of media of the stack. */
+    mult_layer_refl_ni_func_t *refl_kernel;
+
+    /* Reflection coefficients of each interface from the last
+       residuals-only evaluation, reflectometers only. */
+    struct refl_fit_cache refl_cache;
+
     struct stack_cache cache;
 
     gsl_vector *jac_th;
-    union {
-        gsl_vector *refl;
-        cmpl_vector *ell;
-    } jac_n;
+    union jac_n_vector jac_n;
+
+    /* Threads of the engine, NULL if the config asks for a single
+       thread. The pool is shared by the spectral points workers and by
+       the parallel grid search. */
+    struct thread_pool *pool;
+
+    /* Per-thread data used when the spectral points are computed in
+       parallel, NULL otherwise. */
+    struct fit_workers *workers;
+
+    /* Copies of the engine used by the parallel grid search, see
+       fit_engine_get_clones. */
+    struct fit_engine **clones;
+
+    /* Normal equations of each thread used by fit_engine_eval_normal,
+       allocated by the first evaluation. */
+    struct normal_eqs *normal;
+
+    /* Solver workspace allocated by the first fit and kept as long as the
+       engine is prepared, see fit_engine_get_solver. */
+    gsl_multifit_fdfsolver *solver;
+    struct lmfit_normal *normal_solver;
+};
+
+/* Data used to compute a range of spectral points. The stack and the
+   scratch space are private to the thread. */
+struct fit_scratch {
+    stack_t *stack;
+    struct stack_cache *cache;
+    gsl_vector *jac_th;
+    union jac_n_vector jac_n;
+    /* When not NULL the Jacobian rows are accumulated here instead of
+       being stored in the Jacobian matrix. */
+    struct normal_eqs *normal;
+};
+
+struct fit_engine;
+
+/* Compute the rows of "f" and "jacob" for the spectral points from
+   "j_start" to "j_end" excluded. Either "f" or "jacob" can be NULL. If
+   scratch->normal is not NULL the Jacobian is accumulated there and
+   "jacob" is NULL. */
+typedef void (*fit_range_func_t)(struct fit_engine *fit, struct fit_scratch *scratch,
+                                 size_t j_start, size_t j_end,
+                                 gsl_vector *f, gsl_matrix *jacob);
+
+/* Inputs and reflection coefficients of each interface of the last
+   spectrum computed by fit_engine_generate_spectrum. They are not used
+   before "valid" is set. */
+struct refl_spectrum_cache {
+    size_t nb, npt;
+    double *lambda, *ns_re, *ns_im, *ds;
+    int valid;
+    /* Workspace for a single call. */
+    double *lambda_new, *r_raw;
+    cmpl *n_layer;
+    struct refl_ni_cache *rc;
 };
 
 struct fit_engine {
@@ -65,6 +160,9 @@ struct fit_engine {
     struct fit_parameters *parameters;
 
     struct fit_run run[1];
+
+    /* Used by fit_engine_generate_spectrum for reflectometers. */
+    struct refl_spectrum_cache *spectrum_cache;
 };
 
 #define GET_SE_TYPE(sk) (sk == SYSTEM_ELLISS_AB ? SE_ALPHA_BETA : SE_PSI_DEL)
@@ -90,6 +188,31 @@ extern int  fit_engine_prepare(struct fit_engine *f,
 
 extern void fit_engine_disable(struct fit_engine *f);
 
+/* Replace the spectrum of a prepared fit_engine with "s". If the system
+   configuration and the wavelengths of the points to fit are the same as
+   for the current spectrum the tables of refractive indexes, the worker
+   threads and the solver workspace are kept and only the measured values
+   change. Otherwise the engine is prepared again for "s". Returns non-zero
+   if "s" cannot be fitted, in which case the engine is left disabled. */
+extern int  fit_engine_rebind_spectrum(struct fit_engine *f,
+                                       struct spectrum *s);
+
+/* Give in "s" or in "ns", depending on the solver selected in the config,
+   the solver workspace of the prepared engine. The other one is set to
+   NULL. The workspace belongs to the engine and is freed by
+   fit_engine_disable. */
+extern void fit_engine_get_solver(struct fit_engine *f,
+                                  gsl_multifit_fdfsolver **s,
+                                  struct lmfit_normal **ns);
+
+extern struct fit_engine *fit_engine_clone(const struct fit_engine *fit);
+
+/* Return one copy of the prepared engine for each thread of its pool, or
+   NULL if the engine uses a single thread. The copies are made on first
+   use and kept, like the pool, until the engine is disabled.
+   fit_engine_rebind_spectrum rebinds them too. */
+extern struct fit_engine **fit_engine_get_clones(struct fit_engine *fit);
+
 /* Return the stack owned by the fit_engine and gives it ownership to the
    caller function. */
 extern stack_t *fit_engine_yield_stack(struct fit_engine *f);
@@ -102,6 +225,16 @@ extern void fit_engine_commit_parameters(struct fit_engine *fit,
 extern int fit_engine_apply_param(struct fit_engine *fit,
                                   const fit_param_t *fp, double val);
 
+extern void fit_engine_eval_points(struct fit_engine *fit, const gsl_vector *x,
+                                   fit_range_func_t func,
+                                   gsl_vector *f, gsl_matrix *jacob);
+
+extern void fit_engine_eval_normal(struct fit_engine *fit, const gsl_vector *x,
+                                   fit_range_func_t func, gsl_vector *f,
+                                   gsl_matrix *jtj, gsl_vector *jtf);
+
+extern void normal_eqs_add_rows(struct normal_eqs *normal, const double r[]);
+
 extern void fit_engine_apply_parameters(struct fit_engine *fit,
                                         const struct fit_parameters *fps,
                                         const gsl_vector *x);
@@ -109,10 +242,20 @@ extern void fit_engine_apply_parameters(struct fit_engine *fit,
 extern void build_stack_cache(struct stack_cache *cache,
                               stack_t *stack,
                               struct spectrum *spectr,
-                              int th_only_optimize);
+                              struct fit_parameters *fps);
+
+extern cmpl * fit_engine_get_ns(struct fit_engine *fit,
+                                struct fit_scratch *scratch,
+                                size_t j, double lambda);
 
 extern void dispose_stack_cache(struct stack_cache *cache);
 
+extern void alloc_scratch_jacob(struct fit_scratch *scratch,
+                                enum system_kind syskind, size_t nb);
+
+extern void free_scratch_jacob(struct fit_scratch *scratch,
+                               enum system_kind syskind);
+
 extern void set_default_extra_param(struct extra_params *extra);
 
 extern void fit_engine_generate_spectrum(struct fit_engine *fit,
@@ -1,20 +1,598 @@
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <gsl/gsl_errno.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multifit_nlin.h>
 #include <gsl/gsl_blas.h>
 
 #include "lmfit.h"
+#include "lmfit-normal.h"
 #include "grid-search.h"
 #include "stack.h"
 #include "fit_result.h"
+#include "thread-pool.h"
+
+#define GRID_SEARCH_MAX_ITERS 3
+
+struct grid_thread {
+    struct fit_engine *fit;
+    gsl_multifit_fdfsolver *s;
+    struct lmfit_normal *ns;
+    gsl_vector *x;
+};
+
+/* Do the first Levenberg-Marquardt iterations starting from the grid node
+   "x". The chi-square obtained is stored in "chisq" and the status of the
+   last iteration is returned. */
+static int
+grid_node_iterate(struct fit_engine *fit, gsl_multifit_fdfsolver *s, struct lmfit_normal *ns,
+                  const gsl_vector *x, double *chisq)
+{
+    gsl_multifit_function_fdf *f = &fit->run->mffun;
+    int j, status = GSL_SUCCESS;
+    double chi;
+
+    if(ns) {
+        lmfit_normal_set(ns, x);
+    } else {
+        gsl_multifit_fdfsolver_set(s, f, x);
+    }
+
+    for(j = 0; j < GRID_SEARCH_MAX_ITERS; j++) {
+        status = (ns ? lmfit_normal_iterate(ns) : gsl_multifit_fdfsolver_iterate(s));
+        if(status != 0) {
+            break;
+        }
+    }
+
+    chi = gsl_blas_dnrm2(ns ? ns->f : s->f);
+    *chisq = 1.0E6 * pow(chi, 2.0) / f->n;
+
+    return status;
+}
+
+/* The grid nodes are numbered in the same order used by the serial search
+   and are given to the threads in increasing order. The node selected is
+   the same that the serial search would find: the first node below the
+   chi-square threshold or, otherwise, the first node with the lowest
+   chi-square. */
+struct grid_job {
+    const seed_t *vseed;
+    const gsl_vector *x0;
+    int nb_params;
+    /* Values that each parameter takes on the grid. */
+    int *positions;
+    double **values;
+    int nb_grid_pts;
+    double chisq_threshold;
+
+    struct grid_thread *threads;
+
+    pthread_mutex_t lock;
+    int next_node;
+    int completed;
+    int found_node;
+    double found_chisq;
+    int best_node;
+    double best_chisq;
+    int stop_request;
+
+    gui_hook_func_t hfun;
+    void *hdata;
+};
+
+static void
+grid_node_x(const struct grid_job *job, int node, gsl_vector *x)
+{
+    int j;
+    gsl_vector_memcpy(x, job->x0);
+    for(j = job->nb_params - 1; j >= 0; j--) {
+        if(job->vseed[j].type == SEED_RANGE) {
+            int k = node % job->positions[j];
+            gsl_vector_set(x, j, job->values[j][k]);
+            node /= job->positions[j];
+        }
+    }
+}
+
+static void
+grid_search_worker(void *data, int index)
+{
+    struct grid_job *job = data;
+    struct grid_thread *t = &job->threads[index];
+
+    for(;;) {
+        double chisq;
+        int node, completed;
+
+        pthread_mutex_lock(&job->lock);
+        node = job->next_node;
+        if(job->stop_request || node >= job->nb_grid_pts ||
+           (job->found_node >= 0 && node > job->found_node)) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        job->next_node ++;
+        pthread_mutex_unlock(&job->lock);
+
+        grid_node_x(job, node, t->x);
+        grid_node_iterate(t->fit, t->s, t->ns, t->x, &chisq);
+
+        pthread_mutex_lock(&job->lock);
+        if(chisq < job->chisq_threshold && (job->found_node < 0 || node < job->found_node)) {
+            job->found_node = node;
+            job->found_chisq = chisq;
+        }
+        if(job->best_node < 0 || chisq < job->best_chisq ||
+           (chisq == job->best_chisq && node < job->best_node)) {
+            job->best_node = node;
+            job->best_chisq = chisq;
+        }
+        completed = ++ job->completed;
+        pthread_mutex_unlock(&job->lock);
+
+        /* The progress is given by the calling thread only. */
+        if(index == 0 && job->hfun) {
+            float xf = completed / (float) job->nb_grid_pts;
+            if((*job->hfun)(job->hdata, xf, NULL)) {
+                pthread_mutex_lock(&job->lock);
+                job->stop_request = 1;
+                pthread_mutex_unlock(&job->lock);
+            }
+        }
+    }
+}
+
+/* Run the grid search using the engine's threads. Each thread uses its own
+   copy of the fit engine, kept by the engine from a search to the next. On
+   return "x" and "chisq" are set to the selected node. */
+static int
+grid_search_parallel(struct fit_engine *fit, const seed_t *vseed,
+                     const gsl_vector *pstep, gsl_vector *x, double *chisq,
+                     gui_hook_func_t hfun, void *hdata)
+{
+    const int nb = fit->parameters->number;
+    struct fit_engine **clones = fit_engine_get_clones(fit);
+    struct thread_pool *pool = fit->run->pool;
+    const int threads_number = thread_pool_size(pool);
+    struct grid_job job[1];
+    int j, k;
+
+    job->vseed = vseed;
+    job->x0 = x;
+    job->nb_params = nb;
+    job->positions = emalloc(nb * sizeof(int));
+    job->values = emalloc(nb * sizeof(double *));
+    job->nb_grid_pts = 1;
+    job->chisq_threshold = fit->config->chisq_threshold;
+
+    /* The values are accumulated as in the serial search to obtain
+       exactly the same grid nodes. */
+    for(j = 0; j < nb; j++) {
+        job->positions[j] = 1;
+        job->values[j] = NULL;
+        if(vseed[j].type == SEED_RANGE) {
+            const double step = gsl_vector_get(pstep, j);
+            const double vmax = vseed[j].seed + vseed[j].delta;
+            double v;
+            int n = 0;
+            for(v = vseed[j].seed - vseed[j].delta; v <= vmax; v += step) {
+                n++;
+            }
+            job->positions[j] = n;
+            job->values[j] = emalloc(n * sizeof(double));
+            for(k = 0, v = vseed[j].seed - vseed[j].delta; k < n; k++, v += step) {
+                job->values[j][k] = v;
+            }
+            job->nb_grid_pts *= n;
+        }
+    }
+
+    job->threads = emalloc(threads_number * sizeof(struct grid_thread));
+    for(k = 0; k < threads_number; k++) {
+        struct grid_thread *t = &job->threads[k];
+        t->fit = clones[k];
+        fit_engine_get_solver(t->fit, &t->s, &t->ns);
+        t->x = gsl_vector_alloc(nb);
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    job->next_node = 0;
+    job->completed = 0;
+    job->found_node = -1;
+    job->best_node = -1;
+    job->stop_request = 0;
+    job->hfun = hfun;
+    job->hdata = hdata;
+
+    thread_pool_run(pool, grid_search_worker, job);
+
+    if(job->found_node >= 0 && !job->stop_request) {
+        grid_node_x(job, job->found_node, x);
+        *chisq = job->found_chisq;
+    } else {
+        grid_node_x(job, job->best_node, x);
+        *chisq = job->best_chisq;
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    for(k = 0; k < threads_number; k++) {
+        struct grid_thread *t = &job->threads[k];
+        gsl_vector_free(t->x);
+    }
+    free(job->threads);
+    for(j = 0; j < nb; j++) {
+        free(job->values[j]);
+    }
+    free(job->values);
+    free(job->positions);
+
+    return job->stop_request;
+}
+
+/* Number of points along each range parameter in the coarse grid of the
+   adaptive grid search. */
+#define GRID_ADAPTIVE_COARSE_POINTS 5
+
+/* Number of best nodes refined at each level of the adaptive grid search
+   and number of nodes retained for LM iterations by the prescreening. */
+#define GRID_BEST_NODES 4
+
+struct grid_nodes {
+    int nb_params;
+    int number, size;
+    double *x;
+};
+
+static void
+grid_nodes_init(struct grid_nodes *nodes, int nb_params)
+{
+    nodes->nb_params = nb_params;
+    nodes->number = 0;
+    nodes->size = 64;
+    nodes->x = emalloc(nodes->size * nb_params * sizeof(double));
+}
+
+static void
+grid_nodes_add(struct grid_nodes *nodes, const double *x)
+{
+    if(nodes->number >= nodes->size) {
+        nodes->size *= 2;
+        nodes->x = erealloc(nodes->x, nodes->size * nodes->nb_params * sizeof(double));
+    }
+    memcpy(nodes->x + nodes->number * nodes->nb_params, x, nodes->nb_params * sizeof(double));
+    nodes->number ++;
+}
+
+/* Nodes closer than a fraction of the current step are considered the
+   same node. */
+static int
+grid_nodes_find(const struct grid_nodes *nodes, const double *x, const double *step)
+{
+    const int nb = nodes->nb_params;
+    int i, j;
+    for(i = 0; i < nodes->number; i++) {
+        const double *y = nodes->x + i * nb;
+        for(j = 0; j < nb; j++) {
+            if(fabs(x[j] - y[j]) > 0.25 * step[j]) break;
+        }
+        if(j == nb) return i;
+    }
+    return -1;
+}
+
+struct grid_best {
+    int number;
+    double chisq[GRID_BEST_NODES];
+    gsl_vector *x[GRID_BEST_NODES];
+};
+
+static void
+grid_best_insert(struct grid_best *best, const double *x, double chisq)
+{
+    gsl_vector *last;
+    int i, k;
+
+    for(i = 0; i < best->number; i++) {
+        if(chisq < best->chisq[i]) break;
+    }
+    if(i >= GRID_BEST_NODES) return;
+
+    if(best->number < GRID_BEST_NODES) {
+        best->number ++;
+    }
+    last = best->x[best->number - 1];
+    for(k = best->number - 1; k > i; k--) {
+        best->x[k] = best->x[k-1];
+        best->chisq[k] = best->chisq[k-1];
+    }
+    best->x[i] = last;
+    best->chisq[i] = chisq;
+    memcpy(last->data, x, last->size * sizeof(double));
+}
+
+/* Chi-square of the node "x" computed with the residuals only. */
+static double
+grid_node_chisq(struct fit_engine *fit, const double *x, gsl_vector *xv, gsl_vector *f)
+{
+    gsl_multifit_function_fdf *mf = &fit->run->mffun;
+    memcpy(xv->data, x, xv->size * sizeof(double));
+    mf->f(xv, mf->params, f);
+    return 1.0E6 * pow(gsl_blas_dnrm2(f), 2.0) / mf->n;
+}
+
+/* Coarse-to-fine search: the range parameters are first sampled with a
+   coarse grid, then the search is refined, halving the step at each level,
+   only around the best nodes found so far. The finest step is the one used
+   by the full grid search. Only the residuals are computed for each node.
+   The search ends as soon as a node below the chi-square threshold is
+   found. On return "x" and "chisq" are set to the best node. */
+static int
+grid_search_adaptive(struct fit_engine *fit, const seed_t *vseed,
+                     const gsl_vector *pstep, gsl_vector *x, double *chisq,
+                     gui_hook_func_t hfun, void *hdata)
+{
+    const int nb = fit->parameters->number;
+    const double chisq_threshold = fit->config->chisq_threshold;
+    struct grid_nodes visited[1];
+    struct grid_best best[1];
+    gsl_vector *xv = gsl_vector_alloc(nb);
+    gsl_vector *f = gsl_vector_alloc(fit->run->mffun.n);
+    double *step = emalloc(nb * sizeof(double));
+    double *y = emalloc(nb * sizeof(double));
+    int *ranges = emalloc(nb * sizeof(int));
+    int *k = emalloc(nb * sizeof(int));
+    int nb_ranges = 0, levels = 1, level, found = 0, stop_request = 0;
+    double found_chisq = 0.0;
+    int i, j;
+
+    for(j = 0; j < nb; j++) {
+        step[j] = 1.0;
+        if(vseed[j].type == SEED_RANGE) {
+            const double fine_step = gsl_vector_get(pstep, j);
+            int j_levels = 1;
+            step[j] = 2 * vseed[j].delta / (GRID_ADAPTIVE_COARSE_POINTS - 1);
+            if(step[j] < fine_step) {
+                step[j] = fine_step;
+            }
+            while(step[j] / (1 << (j_levels - 1)) > fine_step) {
+                j_levels ++;
+            }
+            if(j_levels > levels) {
+                levels = j_levels;
+            }
+            ranges[nb_ranges++] = j;
+        }
+    }
+
+    grid_nodes_init(visited, nb);
+    best->number = 0;
+    for(i = 0; i < GRID_BEST_NODES; i++) {
+        best->x[i] = gsl_vector_alloc(nb);
+    }
+
+    /* Coarse level: all the nodes of the coarse grid. */
+    memcpy(y, x->data, nb * sizeof(double));
+    for(i = 0; i < nb_ranges; i++) {
+        j = ranges[i];
+        k[i] = 0;
+        y[j] = vseed[j].seed - vseed[j].delta;
+    }
+    for(;;) {
+        double c = grid_node_chisq(fit, y, xv, f);
+        grid_nodes_add(visited, y);
+        grid_best_insert(best, y, c);
+        if(c < chisq_threshold) {
+            found_chisq = c;
+            found = 1;
+            break;
+        }
+
+        for(i = nb_ranges - 1; i >= 0; i--) {
+            j = ranges[i];
+            y[j] += step[j];
+            if(y[j] > vseed[j].seed + vseed[j].delta) {
+                y[j] = vseed[j].seed - vseed[j].delta;
+                continue;
+            }
+            break;
+        }
+        if(i < 0) break;
+    }
+
+    for(level = 1; !found && level < levels; level++) {
+        gsl_vector *centers[GRID_BEST_NODES];
+        int nb_centers = best->number, ic;
+
+        if(hfun) {
+            stop_request = (*hfun)(hdata, level / (float) levels, NULL);
+            if(stop_request) break;
+        }
+
+        for(i = 0; i < nb_ranges; i++) {
+            j = ranges[i];
+            step[j] /= 2;
+            if(step[j] < gsl_vector_get(pstep, j)) {
+                step[j] = gsl_vector_get(pstep, j);
+            }
+        }
+
+        for(ic = 0; ic < nb_centers; ic++) {
+            centers[ic] = gsl_vector_alloc(nb);
+            gsl_vector_memcpy(centers[ic], best->x[ic]);
+        }
+
+        /* Evaluate the neighbours of each center, moving each range
+           parameter by -1, 0 or +1 steps. */
+        for(ic = 0; ic < nb_centers && !found; ic++) {
+            for(i = 0; i < nb_ranges; i++) {
+                k[i] = -1;
+            }
+            for(;;) {
+                int inside = 1;
+                memcpy(y, centers[ic]->data, nb * sizeof(double));
+                for(i = 0; i < nb_ranges; i++) {
+                    j = ranges[i];
+                    y[j] += k[i] * step[j];
+                    if(y[j] < vseed[j].seed - vseed[j].delta ||
+                       y[j] > vseed[j].seed + vseed[j].delta) {
+                        inside = 0;
+                    }
+                }
+
+                if(inside && grid_nodes_find(visited, y, step) < 0) {
+                    double c = grid_node_chisq(fit, y, xv, f);
+                    grid_nodes_add(visited, y);
+                    grid_best_insert(best, y, c);
+                    if(c < chisq_threshold) {
+                        found_chisq = c;
+                        found = 1;
+                        break;
+                    }
+                }
+
+                for(i = nb_ranges - 1; i >= 0; i--) {
+                    if(k[i] < 1) {
+                        k[i] ++;
+                        break;
+                    }
+                    k[i] = -1;
+                }
+                if(i < 0) break;
+            }
+        }
+
+        for(ic = 0; ic < nb_centers; ic++) {
+            gsl_vector_free(centers[ic]);
+        }
+    }
+
+    /* When a node below the threshold is found it is the last one
+       evaluated, otherwise we take the best one. */
+    if(found) {
+        memcpy(x->data, y, nb * sizeof(double));
+        *chisq = found_chisq;
+    } else {
+        gsl_vector_memcpy(x, best->x[0]);
+        *chisq = best->chisq[0];
+    }
+
+    for(i = 0; i < GRID_BEST_NODES; i++) {
+        gsl_vector_free(best->x[i]);
+    }
+    free(visited->x);
+    free(k);
+    free(ranges);
+    free(y);
+    free(step);
+    gsl_vector_free(f);
+    gsl_vector_free(xv);
+
+    return stop_request;
+}
+
+/* Full grid search where only the residuals are computed for each node.
+   The LM iterations are done only on the best nodes, starting from the one
+   with the lowest residual, until a node below the chi-square threshold
+   is found. On return "x" and "chisq" are set to the best node. */
+static int
+grid_search_prescreen(struct fit_engine *fit, gsl_multifit_fdfsolver *s,
+                      struct lmfit_normal *ns, const seed_t *vseed, const gsl_vector *pstep,
+                      gsl_vector *x, double *chisq,
+                      gui_hook_func_t hfun, void *hdata)
+{
+    gsl_multifit_function_fdf *mf = &fit->run->mffun;
+    const int nb = fit->parameters->number;
+    const double chisq_threshold = fit->config->chisq_threshold;
+    struct grid_best best[1];
+    gsl_vector *xv = gsl_vector_alloc(nb);
+    gsl_vector *f = gsl_vector_alloc(mf->n);
+    double chisq_best = -1.0;
+    int nb_grid_pts = 1, j_grid_pts, stop_request = 0;
+    int i, j;
+
+    for(j = 0; j < nb; j++) {
+        if(vseed[j].type == SEED_RANGE) {
+            nb_grid_pts *= 2 * vseed[j].delta / gsl_vector_get(pstep, j) + 1;
+        }
+    }
+
+    best->number = 0;
+    for(i = 0; i < GRID_BEST_NODES; i++) {
+        best->x[i] = gsl_vector_alloc(nb);
+    }
+
+    for(j_grid_pts = 0; ; j_grid_pts++) {
+        double c = grid_node_chisq(fit, x->data, xv, f);
+        grid_best_insert(best, x->data, c);
+        if(c < chisq_threshold) {
+            break;
+        }
+
+        if(hfun) {
+            float xf = j_grid_pts / (float)nb_grid_pts;
+            stop_request = (*hfun)(hdata, xf, NULL);
+            if(stop_request) {
+                break;
+            }
+        }
+
+        for(j = nb-1; j >= 0; j--) {
+            if(vseed[j].type == SEED_RANGE) {
+                x->data[j] += gsl_vector_get(pstep, j);
+                if(x->data[j] > vseed[j].seed + vseed[j].delta) {
+                    x->data[j] = vseed[j].seed - vseed[j].delta;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        if(j < 0) {
+            break;
+        }
+    }
+
+    if(stop_request) {
+        gsl_vector_memcpy(x, best->x[0]);
+        *chisq = best->chisq[0];
+        goto prescreen_exit;
+    }
+
+    for(i = 0; i < best->number; i++) {
+        double c;
+
+        grid_node_iterate(fit, s, ns, best->x[i], &c);
+
+        if(chisq_best < 0 || c < chisq_best) {
+            chisq_best = c;
+            gsl_vector_memcpy(x, best->x[i]);
+        }
+
+        if(c < chisq_threshold) {
+            break;
+        }
+    }
+    *chisq = chisq_best;
+
+prescreen_exit:
+    for(i = 0; i < GRID_BEST_NODES; i++) {
+        gsl_vector_free(best->x[i]);
+    }
+    gsl_vector_free(f);
+    gsl_vector_free(xv);
+
+    return stop_request;
+}
 
 int
 lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
     int preserve_init_stack, struct fit_result *result,
     gui_hook_func_t hfun, void *hdata)
 {
-    const gsl_multifit_fdfsolver_type *T;
     gsl_multifit_fdfsolver *s;
+    struct lmfit_normal *ns;
     gsl_multifit_function_fdf *f;
     struct fit_config *cfg = fit->config;
     int nb, j, iter, nb_grid_pts, j_grid_pts;
@@ -72,26 +650,31 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
         (*hfun)(hdata, 0.0, "Running grid search...");
     }
 
-    /* We choose Levenberg-Marquardt algorithm, scaled version*/
-    T = gsl_multifit_fdfsolver_lmsder;
-    s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+    fit_engine_get_solver(fit, &s, &ns);
 
     result->interrupted = 0;
     result->chisq_threshold = cfg->chisq_threshold;
-    for(j_grid_pts = 0; ; j_grid_pts++) {
-        const int search_max_iters = 3;
 
-        gsl_multifit_fdfsolver_set(s, f, x);
+    if(cfg->grid_search == GRID_SEARCH_ADAPTIVE && nb_grid_pts > 1) {
+        stop_request = grid_search_adaptive(fit, vseed, pstep, x, &chisq, hfun, hdata);
+        status = GSL_SUCCESS;
+        goto grid_search_done;
+    }
 
-        for(j = 0; j < search_max_iters; j++) {
-            status = gsl_multifit_fdfsolver_iterate(s);
-            if(status != 0) {
-                break;
-            }
-        }
+    if(cfg->grid_search == GRID_SEARCH_PRESCREEN && nb_grid_pts > 1) {
+        stop_request = grid_search_prescreen(fit, s, ns, vseed, pstep, x, &chisq, hfun, hdata);
+        status = GSL_SUCCESS;
+        goto grid_search_done;
+    }
 
-        chi = gsl_blas_dnrm2(s->f);
-        chisq = 1.0E6 * pow(chi, 2.0) / f->n;
+    if(fit->run->pool && nb_grid_pts > 1) {
+        stop_request = grid_search_parallel(fit, vseed, pstep, x, &chisq, hfun, hdata);
+        status = GSL_SUCCESS;
+        goto grid_search_done;
+    }
+
+    for(j_grid_pts = 0; ; j_grid_pts++) {
+        status = grid_node_iterate(fit, s, ns, x, &chisq);
 
         if(chisq_best < 0 || chisq < chisq_best) {
             chisq_best = chisq;
@@ -132,17 +715,24 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
         chisq = chisq_best;
     }
 
+grid_search_done:
     result->gsearch_chisq = chisq;
     result->chisq = chisq;
     gsl_vector_memcpy(result->gsearch_x, x);
     result->interrupted = stop_request;
 
     if(stop_request == 0) {
-        status = lmfit_iter(x, f, s, cfg->nb_max_iters,
-                            cfg->epsabs, cfg->epsrel,
-                            & iter, hfun, hdata, & stop_request);
-
-        chi = gsl_blas_dnrm2(s->f);
+        if(ns) {
+            status = lmfit_normal_iter(x, ns, cfg->nb_max_iters,
+                                       cfg->epsabs, cfg->epsrel,
+                                       & iter, hfun, hdata, & stop_request);
+            chi = gsl_blas_dnrm2(ns->f);
+        } else {
+            status = lmfit_iter(x, f, s, cfg->nb_max_iters,
+                                cfg->epsabs, cfg->epsrel,
+                                & iter, hfun, hdata, & stop_request);
+            chi = gsl_blas_dnrm2(s->f);
+        }
         result->chisq = 1.0E6 * pow(chi, 2.0) / f->n;
         result->status = status;
         result->iter = iter;
@@ -163,8 +753,6 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
     gsl_vector_free(xbest);
     gsl_vector_free(pstep);
 
-    gsl_multifit_fdfsolver_free(s);
-
     return status;
 }
 
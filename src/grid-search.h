@@ -15,6 +15,14 @@ int lmfit_grid(struct fit_engine *fit, struct seeds *seeds,
                str_ptr error_msg, int preserve_init_stack,
                gui_hook_func_t hfun, void *hdata);
 
+struct fit_result;
+
+/* Same as lmfit_grid but the outcome of the grid search and of the fit is
+   stored in "result", initialized with fit_result_init. */
+int lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
+                   int preserve_init_stack, struct fit_result *result,
+                   gui_hook_func_t hfun, void *hdata);
+
 __END_DECLS
 
 #endif
@@ -1,6 +1,7 @@
 #include <gsl/gsl_multifit_nlin.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_vector.h>
+#include <gsl/gsl_linalg.h>
 #include <assert.h>
 
 #include "str.h"
@@ -10,6 +11,305 @@
 #include "multi-fit-engine.h"
 #include "vector_print.h"
 
+/* Number of samples from which the block solver is used instead of the
+   GSL solver with the dense Jacobian. */
+#define LMFIT_MULTI_BLOCK_SAMPLES 8
+
+/* Maximum number of rejected steps in a single iteration. */
+#define BLOCK_LM_MAX_REJECTS 10
+
+/* Levenberg-Marquardt solver for the multi-sample fit. The Jacobian is
+   stored in the compact form given by the engine's compact_fdf: the rows
+   of each sample depend only on the common parameters and on the private
+   parameters of the sample. The normal equations are solved using the
+   Schur complement on the common parameters so that memory and time
+   grow linearly with the number of samples. */
+struct block_lm {
+    struct multi_fit_engine *fit;
+    int nb_common, nb_priv, nb_samples;
+    /* first row of each sample in the residuals vector, owned by the
+       engine */
+    const size_t *row_offset;
+
+    gsl_vector *x, *f, *dx;
+    gsl_vector *x_trial, *f_trial;
+    gsl_matrix *jacob;
+    double chisq;
+
+    /* gradient J^T f and scaling factors of the parameters */
+    gsl_vector *g, *diag;
+
+    /* common block of J^T J and its Schur complement */
+    gsl_matrix *u, *schur;
+
+    /* for each sample: private block V and coupling block W of J^T J,
+       Cholesky factor of the damped V, Y = V^-1 W^T and z = V^-1 g. */
+    gsl_matrix **v, **w, **v_chol, **y;
+    gsl_vector **z;
+};
+
+static struct block_lm *
+block_lm_new(struct multi_fit_engine *fit)
+{
+    struct block_lm *b = emalloc(sizeof(struct block_lm));
+    const int nc = fit->common_parameters->number;
+    const int np = fit->private_parameters->number;
+    const size_t n = fit->mffun.n, p = fit->mffun.p;
+    int k;
+
+    b->fit = fit;
+    b->nb_common = nc;
+    b->nb_priv = np;
+    b->nb_samples = fit->samples_number;
+
+    b->row_offset = fit->row_offset;
+    assert(b->row_offset[b->nb_samples] == n);
+
+    b->x = gsl_vector_alloc(p);
+    b->dx = gsl_vector_alloc(p);
+    b->x_trial = gsl_vector_alloc(p);
+    b->f = gsl_vector_alloc(n);
+    b->f_trial = gsl_vector_alloc(n);
+    b->jacob = gsl_matrix_alloc(n, nc + np);
+
+    b->g = gsl_vector_alloc(p);
+    b->diag = gsl_vector_alloc(p);
+    b->u = gsl_matrix_alloc(nc, nc);
+    b->schur = gsl_matrix_alloc(nc, nc);
+
+    b->v = emalloc(b->nb_samples * sizeof(gsl_matrix *));
+    b->w = emalloc(b->nb_samples * sizeof(gsl_matrix *));
+    b->v_chol = emalloc(b->nb_samples * sizeof(gsl_matrix *));
+    b->y = emalloc(b->nb_samples * sizeof(gsl_matrix *));
+    b->z = emalloc(b->nb_samples * sizeof(gsl_vector *));
+    for(k = 0; k < b->nb_samples; k++) {
+        b->v[k] = gsl_matrix_alloc(np, np);
+        b->w[k] = gsl_matrix_alloc(nc, np);
+        b->v_chol[k] = gsl_matrix_alloc(np, np);
+        b->y[k] = gsl_matrix_alloc(np, nc);
+        b->z[k] = gsl_vector_alloc(np);
+    }
+
+    return b;
+}
+
+static void
+block_lm_free(struct block_lm *b)
+{
+    int k;
+    for(k = 0; k < b->nb_samples; k++) {
+        gsl_matrix_free(b->v[k]);
+        gsl_matrix_free(b->w[k]);
+        gsl_matrix_free(b->v_chol[k]);
+        gsl_matrix_free(b->y[k]);
+        gsl_vector_free(b->z[k]);
+    }
+    free(b->v);
+    free(b->w);
+    free(b->v_chol);
+    free(b->y);
+    free(b->z);
+    gsl_matrix_free(b->u);
+    gsl_matrix_free(b->schur);
+    gsl_vector_free(b->g);
+    gsl_vector_free(b->diag);
+    gsl_matrix_free(b->jacob);
+    gsl_vector_free(b->f_trial);
+    gsl_vector_free(b->f);
+    gsl_vector_free(b->x_trial);
+    gsl_vector_free(b->dx);
+    gsl_vector_free(b->x);
+    free(b);
+}
+
+/* Compute the residuals and the Jacobian at b->x and the blocks of the
+   normal equations. The scaling factors are updated like in MINPACK's
+   lmder, using the norms of the Jacobian's columns. */
+static void
+block_lm_set_jacob(struct block_lm *b)
+{
+    const int nc = b->nb_common, np = b->nb_priv;
+    int k, i;
+
+    b->fit->compact_fdf(b->x, b->fit, b->f, b->jacob);
+    b->chisq = pow(gsl_blas_dnrm2(b->f), 2.0);
+
+    gsl_matrix_set_zero(b->u);
+    gsl_vector_set_zero(b->g);
+
+    for(k = 0; k < b->nb_samples; k++) {
+        const size_t r0 = b->row_offset[k], nr = b->row_offset[k+1] - r0;
+        gsl_matrix_view jc = gsl_matrix_submatrix(b->jacob, r0, 0, nr, nc);
+        gsl_matrix_view jp = gsl_matrix_submatrix(b->jacob, r0, nc, nr, np);
+        gsl_vector_view fs = gsl_vector_subvector(b->f, r0, nr);
+        gsl_vector_view gc = gsl_vector_subvector(b->g, 0, nc);
+        gsl_vector_view gs = gsl_vector_subvector(b->g, nc + k * np, np);
+
+        gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jc.matrix, &jc.matrix, 1.0, b->u);
+        gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jp.matrix, &jp.matrix, 0.0, b->v[k]);
+        gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jc.matrix, &jp.matrix, 0.0, b->w[k]);
+        gsl_blas_dgemv(CblasTrans, 1.0, &jc.matrix, &fs.vector, 1.0, &gc.vector);
+        gsl_blas_dgemv(CblasTrans, 1.0, &jp.matrix, &fs.vector, 0.0, &gs.vector);
+
+        for(i = 0; i < np; i++) {
+            double *d = gsl_vector_ptr(b->diag, nc + k * np + i);
+            const double jn = gsl_matrix_get(b->v[k], i, i);
+            if(jn > *d) *d = jn;
+        }
+    }
+
+    for(i = 0; i < nc; i++) {
+        double *d = gsl_vector_ptr(b->diag, i);
+        const double jn = gsl_matrix_get(b->u, i, i);
+        if(jn > *d) *d = jn;
+    }
+}
+
+/* Solve (J^T J + lambda D) dx = - J^T f. Return a non-zero value if the
+   damped matrix is not positive definite. */
+static int
+block_lm_solve(struct block_lm *b, double lambda)
+{
+    const int nc = b->nb_common, np = b->nb_priv;
+    gsl_vector_view dxc = gsl_vector_subvector(b->dx, 0, nc);
+    gsl_vector_view gc = gsl_vector_subvector(b->g, 0, nc);
+    int k, i;
+
+    gsl_matrix_memcpy(b->schur, b->u);
+    for(i = 0; i < nc; i++) {
+        *gsl_matrix_ptr(b->schur, i, i) += lambda * gsl_vector_get(b->diag, i);
+    }
+
+    gsl_vector_memcpy(&dxc.vector, &gc.vector);
+    gsl_vector_scale(&dxc.vector, -1.0);
+
+    for(k = 0; k < b->nb_samples; k++) {
+        gsl_vector_view gs = gsl_vector_subvector(b->g, nc + k * np, np);
+
+        gsl_matrix_memcpy(b->v_chol[k], b->v[k]);
+        for(i = 0; i < np; i++) {
+            *gsl_matrix_ptr(b->v_chol[k], i, i) += lambda * gsl_vector_get(b->diag, nc + k * np + i);
+        }
+        if(gsl_linalg_cholesky_decomp(b->v_chol[k])) {
+            return 1;
+        }
+
+        for(i = 0; i < nc; i++) {
+            gsl_vector_view w_row = gsl_matrix_row(b->w[k], i);
+            gsl_vector_view y_col = gsl_matrix_column(b->y[k], i);
+            gsl_linalg_cholesky_solve(b->v_chol[k], &w_row.vector, &y_col.vector);
+        }
+        gsl_linalg_cholesky_solve(b->v_chol[k], &gs.vector, b->z[k]);
+
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, -1.0, b->w[k], b->y[k], 1.0, b->schur);
+        gsl_blas_dgemv(CblasNoTrans, 1.0, b->w[k], b->z[k], 1.0, &dxc.vector);
+    }
+
+    if(gsl_linalg_cholesky_decomp(b->schur)) {
+        return 1;
+    }
+    gsl_linalg_cholesky_svx(b->schur, &dxc.vector);
+
+    for(k = 0; k < b->nb_samples; k++) {
+        gsl_vector_view dxs = gsl_vector_subvector(b->dx, nc + k * np, np);
+        gsl_vector_memcpy(&dxs.vector, b->z[k]);
+        gsl_blas_dgemv(CblasNoTrans, 1.0, b->y[k], &dxc.vector, 1.0, &dxs.vector);
+        gsl_vector_scale(&dxs.vector, -1.0);
+    }
+
+    return 0;
+}
+
+/* Do a Levenberg-Marquardt step. The damping parameter is updated as
+   proposed by Nielsen. */
+static int
+block_lm_iterate(struct block_lm *b, double *lambda, double *nu)
+{
+    int k, i;
+
+    for(k = 0; k < BLOCK_LM_MAX_REJECTS; k++) {
+        double pred = 0.0, chisq_trial, dxg, rho;
+
+        if(block_lm_solve(b, *lambda)) {
+            *lambda *= *nu;
+            *nu *= 2;
+            continue;
+        }
+
+        /* Reduction predicted by the linear model. */
+        gsl_blas_ddot(b->dx, b->g, &dxg);
+        for(i = 0; i < (int) b->dx->size; i++) {
+            const double dxi = gsl_vector_get(b->dx, i);
+            pred += (*lambda) * gsl_vector_get(b->diag, i) * dxi * dxi;
+        }
+        pred = 0.5 * (pred - dxg);
+
+        gsl_vector_memcpy(b->x_trial, b->x);
+        gsl_vector_add(b->x_trial, b->dx);
+        b->fit->compact_fdf(b->x_trial, b->fit, b->f_trial, NULL);
+        chisq_trial = pow(gsl_blas_dnrm2(b->f_trial), 2.0);
+
+        rho = (pred > 0.0 ? 0.5 * (b->chisq - chisq_trial) / pred : -1.0);
+
+        if(rho > 0.0) {
+            const double t = 2 * rho - 1, shrink = 1 - t * t * t;
+            gsl_vector_memcpy(b->x, b->x_trial);
+            block_lm_set_jacob(b);
+            *lambda *= (shrink > 1.0 / 3.0 ? shrink : 1.0 / 3.0);
+            *nu = 2.0;
+            return GSL_SUCCESS;
+        }
+
+        *lambda *= *nu;
+        *nu *= 2;
+    }
+
+    return GSL_ENOPROG;
+}
+
+/* Same as lmfit_iter but using the block solver. On return "f" contains
+   the residuals at the solution. */
+static int
+lmfit_multi_block(struct block_lm *b, gsl_vector *x, const int max_iter,
+                  double epsabs, double epsrel, int *nb_iter,
+                  gui_hook_func_t hfun, void *hdata, int *user_stop)
+{
+    double lambda = 1.0E-3, nu = 2.0;
+    int iter = 0, status;
+    int stop_request = 0;
+
+    gsl_vector_memcpy(b->x, x);
+    gsl_vector_set_all(b->diag, 0.0);
+    block_lm_set_jacob(b);
+
+    if(hfun) {
+        stop_request = (*hfun)(hdata, 0.0, "Running Levenberg-Marquardt search...");
+    }
+
+    do {
+        if(hfun) {
+            stop_request = (*hfun)(hdata, iter / (float)max_iter, NULL);
+        }
+
+        iter++;
+        status = block_lm_iterate(b, &lambda, &nu);
+
+        if(status) {
+            break;
+        }
+
+        status = gsl_multifit_test_delta(b->dx, b->x, epsabs, epsrel);
+    } while(status == GSL_CONTINUE && iter < max_iter && !stop_request);
+
+    gsl_vector_memcpy(x, b->x);
+
+    *nb_iter = iter;
+    if(user_stop) {
+        *user_stop = stop_request;
+    }
+
+    return status;
+}
 
 int
 lmfit_multi(struct multi_fit_engine *fit,
@@ -18,11 +318,13 @@ lmfit_multi(struct multi_fit_engine *fit,
             gui_hook_func_t hfun, void *hdata)
 {
     const gsl_multifit_fdfsolver_type *T;
-    gsl_multifit_fdfsolver *s;
+    gsl_multifit_fdfsolver *s = NULL;
+    struct block_lm *b = NULL;
     gsl_multifit_function_fdf *f = & fit->mffun;
     struct fit_config *cfg = &fit->config;
     int status, stop_request = 0;
     gsl_vector *x;
+    const gsl_vector *fres;
     int iter, nb_common, nb_priv, nb_samples, k, ks, j_sample;
 
     nb_samples = fit->samples_number;
@@ -31,8 +333,13 @@ lmfit_multi(struct multi_fit_engine *fit,
 
     x = gsl_vector_alloc(nb_common + nb_priv * nb_samples);
 
-    T = gsl_multifit_fdfsolver_lmsder;
-    s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+    /* The block solver needs both common and private parameters. */
+    if(nb_samples >= LMFIT_MULTI_BLOCK_SAMPLES && nb_common > 0 && nb_priv > 0) {
+        b = block_lm_new(fit);
+    } else {
+        T = gsl_multifit_fdfsolver_lmsder;
+        s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+    }
 
     for(k = 0; k < seeds_common->number; k++) {
         gsl_vector_set(x, k, multi_fit_engine_get_seed_value(fit, &fit->common_parameters->values[k], &seeds_common->values[k]));
@@ -47,9 +354,17 @@ lmfit_multi(struct multi_fit_engine *fit,
         print_vector(analysis, "%.5f", x);
     }
 
-    status = lmfit_iter(x, f, s, cfg->nb_max_iters,
-                        cfg->epsabs, cfg->epsrel,
-                        & iter, hfun, hdata, & stop_request);
+    if(b) {
+        status = lmfit_multi_block(b, x, cfg->nb_max_iters,
+                                   cfg->epsabs, cfg->epsrel,
+                                   & iter, hfun, hdata, & stop_request);
+        fres = b->f;
+    } else {
+        status = lmfit_iter(x, f, s, cfg->nb_max_iters,
+                            cfg->epsabs, cfg->epsrel,
+                            & iter, hfun, hdata, & stop_request);
+        fres = s->f;
+    }
 
     j_sample = 0;
     for(k = 0; k < fit->samples_number; k++) {
@@ -58,8 +373,8 @@ lmfit_multi(struct multi_fit_engine *fit,
         int j, np = spectra_points(spectrum);
 
         for(j = 0; j < np; j++, j_sample++) {
-            double fres = gsl_vector_get(s->f, j_sample);
-            chisq += fres * fres;
+            double fj = gsl_vector_get(fres, j_sample);
+            chisq += fj * fj;
         }
 
         gsl_vector_set(fit->chisq, k, 1.0e6 * chisq / np);
@@ -82,7 +397,11 @@ lmfit_multi(struct multi_fit_engine *fit,
         str_printf_add(analysis, "Nb of iterations to converge: %i\n", iter);
     }
 
-    gsl_multifit_fdfsolver_free(s);
+    if(b) {
+        block_lm_free(b);
+    } else {
+        gsl_multifit_fdfsolver_free(s);
+    }
 
     if(stop_request) {
         status = 1;
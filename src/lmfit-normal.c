@@ -0,0 +1,187 @@
+#include <math.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_multifit_nlin.h>
+
+#include "lmfit-normal.h"
+
+/* Maximum number of rejected steps in a single iteration. */
+#define LMFIT_NORMAL_MAX_REJECTS 10
+
+struct lmfit_normal *
+lmfit_normal_new(struct fit_engine *fit)
+{
+    struct lmfit_normal *s = emalloc(sizeof(struct lmfit_normal));
+    const size_t n = fit->run->mffun.n, p = fit->run->mffun.p;
+
+    s->fit = fit;
+    s->x = gsl_vector_alloc(p);
+    s->dx = gsl_vector_alloc(p);
+    s->x_trial = gsl_vector_alloc(p);
+    s->f = gsl_vector_alloc(n);
+    s->f_trial = gsl_vector_alloc(n);
+    s->jtj = gsl_matrix_alloc(p, p);
+    s->jtj_damped = gsl_matrix_alloc(p, p);
+    s->jtf = gsl_vector_alloc(p);
+    s->diag = gsl_vector_alloc(p);
+
+    return s;
+}
+
+void
+lmfit_normal_free(struct lmfit_normal *s)
+{
+    gsl_vector_free(s->diag);
+    gsl_vector_free(s->jtf);
+    gsl_matrix_free(s->jtj_damped);
+    gsl_matrix_free(s->jtj);
+    gsl_vector_free(s->f_trial);
+    gsl_vector_free(s->f);
+    gsl_vector_free(s->x_trial);
+    gsl_vector_free(s->dx);
+    gsl_vector_free(s->x);
+    free(s);
+}
+
+/* Compute the residuals and the normal equations at s->x. The damping
+   matrix D is Marquardt's diag(J^T J), the squared norms of the
+   Jacobian's columns, each element keeping the largest value found since
+   lmfit_normal_set. */
+static void
+lmfit_normal_eval(struct lmfit_normal *s)
+{
+    struct fit_engine *fit = s->fit;
+    size_t i;
+
+    fit->run->normal_fdf(s->x, fit, s->f, s->jtj, s->jtf);
+    s->chisq = pow(gsl_blas_dnrm2(s->f), 2.0);
+
+    for(i = 0; i < s->x->size; i++) {
+        double *d = gsl_vector_ptr(s->diag, i);
+        const double jn = gsl_matrix_get(s->jtj, i, i);
+        if(jn > *d) *d = jn;
+        if(*d == 0.0) *d = 1.0;
+    }
+}
+
+void
+lmfit_normal_set(struct lmfit_normal *s, const gsl_vector *x)
+{
+    gsl_vector_memcpy(s->x, x);
+    gsl_vector_set_zero(s->dx);
+    gsl_vector_set_zero(s->diag);
+    s->lambda = 1.0E-3;
+    s->nu = 2.0;
+    lmfit_normal_eval(s);
+}
+
+/* Solve (J^T J + lambda D) dx = - J^T f. Return a non-zero value if the
+   damped matrix is not positive definite. */
+static int
+lmfit_normal_solve(struct lmfit_normal *s)
+{
+    size_t i;
+
+    gsl_matrix_memcpy(s->jtj_damped, s->jtj);
+    for(i = 0; i < s->x->size; i++) {
+        *gsl_matrix_ptr(s->jtj_damped, i, i) += s->lambda * gsl_vector_get(s->diag, i);
+    }
+
+    if(gsl_linalg_cholesky_decomp(s->jtj_damped)) {
+        return 1;
+    }
+
+    gsl_linalg_cholesky_solve(s->jtj_damped, s->jtf, s->dx);
+    gsl_vector_scale(s->dx, -1.0);
+
+    return 0;
+}
+
+/* Do a Levenberg-Marquardt step. The damping parameter is updated as
+   proposed by Nielsen. */
+int
+lmfit_normal_iterate(struct lmfit_normal *s)
+{
+    gsl_multifit_function_fdf *mf = &s->fit->run->mffun;
+    int k;
+    size_t i;
+
+    for(k = 0; k < LMFIT_NORMAL_MAX_REJECTS; k++) {
+        double pred = 0.0, chisq_trial, dxg, rho;
+
+        if(lmfit_normal_solve(s)) {
+            s->lambda *= s->nu;
+            s->nu *= 2;
+            continue;
+        }
+
+        /* Reduction predicted by the linear model. */
+        gsl_blas_ddot(s->dx, s->jtf, &dxg);
+        for(i = 0; i < s->dx->size; i++) {
+            const double dxi = gsl_vector_get(s->dx, i);
+            pred += s->lambda * gsl_vector_get(s->diag, i) * dxi * dxi;
+        }
+        pred = 0.5 * (pred - dxg);
+
+        gsl_vector_memcpy(s->x_trial, s->x);
+        gsl_vector_add(s->x_trial, s->dx);
+        mf->f(s->x_trial, s->fit, s->f_trial);
+        chisq_trial = pow(gsl_blas_dnrm2(s->f_trial), 2.0);
+
+        rho = (pred > 0.0 ? 0.5 * (s->chisq - chisq_trial) / pred : -1.0);
+
+        if(rho > 0.0) {
+            const double t = 2 * rho - 1, shrink = 1 - t * t * t;
+            gsl_vector_memcpy(s->x, s->x_trial);
+            lmfit_normal_eval(s);
+            s->lambda *= (shrink > 1.0 / 3.0 ? shrink : 1.0 / 3.0);
+            s->nu = 2.0;
+            return GSL_SUCCESS;
+        }
+
+        s->lambda *= s->nu;
+        s->nu *= 2;
+    }
+
+    return GSL_ENOPROG;
+}
+
+int
+lmfit_normal_iter(gsl_vector *x, struct lmfit_normal *s, const int max_iter,
+                  double epsabs, double epsrel, int *nb_iter,
+                  gui_hook_func_t hfun, void *hdata, int *user_stop)
+{
+    int iter = 0, status;
+    int stop_request = 0;
+
+    lmfit_normal_set(s, x);
+
+    if(hfun) {
+        stop_request = (*hfun)(hdata, 0.0, "Running Levenberg-Marquardt search...");
+    }
+
+    do {
+        if(hfun) {
+            stop_request = (*hfun)(hdata, iter / (float)max_iter, NULL);
+        }
+
+        iter++;
+        status = lmfit_normal_iterate(s);
+
+        if(status) {
+            break;
+        }
+
+        status = gsl_multifit_test_delta(s->dx, s->x, epsabs, epsrel);
+    } while(status == GSL_CONTINUE && iter < max_iter && !stop_request);
+
+    gsl_vector_memcpy(x, s->x);
+
+    *nb_iter = iter;
+    if(user_stop) {
+        *user_stop = stop_request;
+    }
+
+    return status;
+}
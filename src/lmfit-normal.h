@@ -0,0 +1,43 @@
+#ifndef LMFIT_NORMAL_H
+#define LMFIT_NORMAL_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+
+#include "lmfit.h"
+#include "fit-engine.h"
+
+__BEGIN_DECLS
+
+/* Levenberg-Marquardt solver for the single-sample fits that works on the
+   normal equations. The Jacobian is never stored: its rows are accumulated
+   in J^T J and J^T f while the spectral points are computed, so the memory
+   used does not depend on the number of points.
+   The fields x, f and dx have the same meaning as in the GSL solver. */
+struct lmfit_normal {
+    struct fit_engine *fit;
+
+    gsl_vector *x, *f, *dx;
+    gsl_vector *x_trial, *f_trial;
+    double chisq;
+
+    gsl_matrix *jtj, *jtj_damped;
+    gsl_vector *jtf, *diag;
+
+    double lambda, nu;
+};
+
+extern struct lmfit_normal *lmfit_normal_new(struct fit_engine *fit);
+extern void lmfit_normal_free(struct lmfit_normal *s);
+extern void lmfit_normal_set(struct lmfit_normal *s, const gsl_vector *x);
+extern int  lmfit_normal_iterate(struct lmfit_normal *s);
+
+/* Same as lmfit_iter but using the normal equations solver. */
+extern int  lmfit_normal_iter(gsl_vector *x, struct lmfit_normal *s,
+                              const int max_iter, double epsabs, double epsrel,
+                              int *nb_iter, gui_hook_func_t hfun, void *hdata,
+                              int *user_stop);
+
+__END_DECLS
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "lmfit.h"
 #include "lmfit-simple.h"
+#include "lmfit-normal.h"
 #include "stack.h"
 #include "vector_print.h"
 
@@ -13,8 +14,8 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
              struct lmfit_result *result, str_ptr analysis, str_ptr error_msg,
              gui_hook_func_t hfun, void *hdata)
 {
-    const gsl_multifit_fdfsolver_type *T;
     gsl_multifit_fdfsolver *s;
+    struct lmfit_normal *ns;
     gsl_multifit_function_fdf *f;
     struct fit_config *cfg = fit->config;
     int iter;
@@ -26,19 +27,23 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
 
     f = &fit->run->mffun;
 
-    /* We choose Levenberg-Marquardt algorithm, scaled version*/
-    T = gsl_multifit_fdfsolver_lmsder;
-    s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+    fit_engine_get_solver(fit, &s, &ns);
 
     if(analysis) {
         str_copy_c(analysis, "Seed used: ");
         print_vector(analysis, "%.5g", x);
     }
 
-    status = lmfit_iter(x, f, s, cfg->nb_max_iters, cfg->epsabs, cfg->epsrel,
-                        & iter, hfun, hdata, & stop_request);
+    if(ns) {
+        status = lmfit_normal_iter(x, ns, cfg->nb_max_iters, cfg->epsabs, cfg->epsrel,
+                                   & iter, hfun, hdata, & stop_request);
+        chi = gsl_blas_dnrm2(ns->f);
+    } else {
+        status = lmfit_iter(x, f, s, cfg->nb_max_iters, cfg->epsabs, cfg->epsrel,
+                            & iter, hfun, hdata, & stop_request);
+        chi = gsl_blas_dnrm2(s->f);
+    }
 
-    chi = gsl_blas_dnrm2(s->f);
     result->chisq = 1.0E6 * pow(chi, 2.0) / f->n;
     result->nb_iterations = iter;
     result->gsl_status = status;
@@ -75,7 +80,5 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
 
     gsl_vector_memcpy(fit->run->results, x);
 
-    gsl_multifit_fdfsolver_free(s);
-
     return status;
 }
@@ -8,6 +8,30 @@
 #include "elliss-multifit.h"
 #include "refl-multifit.h"
 #include "multi-fit-engine.h"
+#include "thread-pool.h"
+
+/* Each thread has its own stack cache and Jacobian scratch vectors. The
+   stack is the one of the sample being computed: each sample is computed
+   by a single thread. */
+struct multi_fit_worker {
+    struct stack_cache cache;
+    struct fit_scratch scratch;
+};
+
+struct multi_fit_workers {
+    struct thread_pool *pool;
+    /* The first worker, executed by the calling thread, uses the
+       engine's own cache so its entry is not used. */
+    struct multi_fit_worker *list;
+};
+
+struct multi_fit_eval_job {
+    struct multi_fit_engine *fit;
+    multi_fit_sample_func_t func;
+    gsl_vector *f;
+    gsl_matrix *jacob;
+    int compact;
+};
 
 static int  mengine_apply_param_common(struct multi_fit_engine *fit,
                                        const fit_param_t *fp,
@@ -21,32 +45,195 @@ static void build_multi_fit_engine_cache(struct multi_fit_engine *f);
 
 static void dispose_multi_fit_engine_cache(struct multi_fit_engine *f);
 
+static void build_samples_cache(struct multi_fit_engine *f);
+
+static void dispose_samples_cache(struct multi_fit_engine *f);
+
+static void build_multi_fit_workers(struct multi_fit_engine *f, int threads_number);
+
+static void dispose_multi_fit_workers(struct multi_fit_engine *f);
+
 void
 build_multi_fit_engine_cache(struct multi_fit_engine *f)
 {
-    const int RI_IS_VARIABLE = 0;
-    int nbmed = f->stack_list[0]->nb;
-    int nblyr = nbmed - 2;
-    size_t dmultipl = (f->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
-
-    /* We have just one cache for the fit engine.
-       A cache for each sample is not needed because we assume that
-       the RI are not fixed and so we don't do presampling of n values */
+    struct fit_scratch scratch[1];
+
+    /* The engine's cache is the scratch space of the calling thread.
+       The refractive indexes of the layers not fitted are kept in the
+       caches of the samples. */
     build_stack_cache(& f->cache, f->stack_list[0],
-                      f->spectra_list[0], RI_IS_VARIABLE);
+                      f->spectra_list[0], NULL);
 
-    f->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+    build_samples_cache(f);
 
-    switch(f->system_kind) {
-    case SYSTEM_REFLECTOMETER:
-        f->jac_n.refl = gsl_vector_alloc(2 * nbmed);
-        break;
-    case SYSTEM_ELLISS_AB:
-    case SYSTEM_ELLISS_PSIDEL:
-        f->jac_n.ell = cmpl_vector_alloc(2 * nbmed);
-    default:
-        /* */
-        ;
+    alloc_scratch_jacob(scratch, f->system_kind, f->stack_list[0]->nb);
+    f->jac_th = scratch->jac_th;
+    f->jac_n = scratch->jac_n;
+}
+
+/* Each sample has its own spectrum and stack so the table of the
+   refractive indexes of the layers not fitted is computed for each
+   sample. Both the common and the private parameters are considered. */
+void
+build_samples_cache(struct multi_fit_engine *f)
+{
+    struct fit_parameters *fps = fit_parameters_new();
+    size_t j;
+    int k;
+
+    for(j = 0; j < f->common_parameters->number; j++) {
+        fit_parameters_add(fps, f->common_parameters->values + j);
+    }
+    for(j = 0; j < f->private_parameters->number; j++) {
+        fit_parameters_add(fps, f->private_parameters->values + j);
+    }
+
+    f->samples_cache = emalloc(f->samples_number * sizeof(struct stack_cache));
+
+    build_stack_cache(&f->samples_cache[0], f->stack_list[0], f->spectra_list[0], fps);
+    if(f->samples_cache[0].ns_full_spectr == NULL) {
+        dispose_stack_cache(&f->samples_cache[0]);
+        free(f->samples_cache);
+        f->samples_cache = NULL;
+        goto free_fps;
+    }
+
+    for(k = 1; k < f->samples_number; k++) {
+        build_stack_cache(&f->samples_cache[k], f->stack_list[k], f->spectra_list[k], fps);
+    }
+
+free_fps:
+    fit_parameters_free(fps);
+}
+
+void
+dispose_samples_cache(struct multi_fit_engine *f)
+{
+    int k;
+
+    if(!f->samples_cache) return;
+
+    for(k = 0; k < f->samples_number; k++) {
+        dispose_stack_cache(&f->samples_cache[k]);
+    }
+    free(f->samples_cache);
+    f->samples_cache = NULL;
+}
+
+/* Return the refractive indexes of the layers of sample "sample" for its
+   spectral point "j". Works like fit_engine_get_ns using the sample's
+   cache for the layers whose RI is not fitted. */
+cmpl *
+multi_fit_engine_get_ns(struct multi_fit_engine *fit, struct fit_scratch *scratch,
+                        int sample, size_t j, double lambda)
+{
+    stack_t *stack = scratch->stack;
+    cmpl *ns = scratch->cache->ns;
+    const struct stack_cache *cache;
+    const cmpl *ns_fixed;
+    int k, nb_med;
+
+    if(!fit->samples_cache) {
+        stack_get_ns_list(stack, ns, lambda);
+        return ns;
+    }
+
+    cache = &fit->samples_cache[sample];
+    nb_med = cache->nb_med;
+    ns_fixed = cache->ns_full_spectr + j * nb_med;
+
+    if(cache->th_only) {
+        return (cmpl *) ns_fixed;
+    }
+
+    for(k = 0; k < nb_med; k++) {
+        ns[k] = (cache->ri_fixed[k] ? ns_fixed[k] : n_value(stack->disp[k], lambda));
+    }
+
+    return ns;
+}
+
+void
+build_multi_fit_workers(struct multi_fit_engine *f, int threads_number)
+{
+    struct multi_fit_workers *workers = emalloc(sizeof(struct multi_fit_workers));
+    int k;
+
+    workers->list = emalloc(threads_number * sizeof(struct multi_fit_worker));
+    for(k = 1; k < threads_number; k++) {
+        struct multi_fit_worker *w = &workers->list[k];
+        build_stack_cache(&w->cache, f->stack_list[0], f->spectra_list[0], NULL);
+        w->scratch.stack = NULL;
+        w->scratch.cache = &w->cache;
+        w->scratch.normal = NULL;
+        alloc_scratch_jacob(&w->scratch, f->system_kind, f->stack_list[0]->nb);
+    }
+    workers->pool = thread_pool_new(threads_number);
+    f->workers = workers;
+}
+
+void
+dispose_multi_fit_workers(struct multi_fit_engine *f)
+{
+    struct multi_fit_workers *workers = f->workers;
+    int k, threads_number;
+
+    if(!workers) return;
+
+    threads_number = thread_pool_size(workers->pool);
+    thread_pool_free(workers->pool);
+    for(k = 1; k < threads_number; k++) {
+        struct multi_fit_worker *w = &workers->list[k];
+        free_scratch_jacob(&w->scratch, f->system_kind);
+        dispose_stack_cache(&w->cache);
+    }
+    free(workers->list);
+    free(workers);
+    f->workers = NULL;
+}
+
+static void
+multi_fit_eval_worker(void *data, int index)
+{
+    struct multi_fit_eval_job *job = data;
+    struct multi_fit_engine *fit = job->fit;
+    struct multi_fit_workers *workers = fit->workers;
+    const int threads_number = (workers ? thread_pool_size(workers->pool) : 1);
+    struct fit_scratch scratch[1];
+    int sample;
+
+    if(index == 0) {
+        scratch->cache = &fit->cache;
+        scratch->jac_th = fit->jac_th;
+        scratch->jac_n = fit->jac_n;
+        scratch->normal = NULL;
+    } else {
+        *scratch = workers->list[index].scratch;
+    }
+
+    for(sample = index; sample < fit->samples_number; sample += threads_number) {
+        scratch->stack = fit->stack_list[sample];
+        job->func(fit, scratch, sample, job->f, job->jacob, job->compact);
+    }
+}
+
+/* Apply the fit parameters "x" and compute all the samples using "func".
+   The samples are shared between the engine's threads, if any. Each
+   sample writes only its own rows so no locking is needed. */
+void
+multi_fit_engine_eval_samples(struct multi_fit_engine *fit,
+                              const gsl_vector *x,
+                              multi_fit_sample_func_t func,
+                              gsl_vector *f, gsl_matrix *jacob, int compact)
+{
+    struct multi_fit_eval_job job[1] = {{fit, func, f, jacob, compact}};
+
+    multi_fit_engine_commit_parameters(fit, x);
+
+    if(fit->workers) {
+        thread_pool_run(fit->workers->pool, multi_fit_eval_worker, job);
+    } else {
+        multi_fit_eval_worker(job, 0);
     }
 }
 
@@ -76,17 +263,22 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
 
     build_multi_fit_engine_cache(fit);
 
+    fit->row_offset = emalloc((fit->samples_number + 1) * sizeof(size_t));
+
     switch(fit->system_kind) {
         int k, npt;
     case SYSTEM_REFLECTOMETER:
 
         for(npt = 0, k = 0; k < fit->samples_number; k++) {
+            fit->row_offset[k] = npt;
             npt += spectra_points(fit->spectra_list[k]);
         }
+        fit->row_offset[k] = npt;
 
         fit->mffun.f      = & refl_multifit_f;
         fit->mffun.df     = & refl_multifit_df;
         fit->mffun.fdf    = & refl_multifit_fdf;
+        fit->compact_fdf  = & refl_multifit_compact_fdf;
         fit->mffun.n      = npt;
         fit->mffun.p      = nb_total_params;
         fit->mffun.params = fit;
@@ -94,12 +286,15 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
         for(npt = 0, k = 0; k < fit->samples_number; k++) {
+            fit->row_offset[k] = npt;
             npt += 2 * spectra_points(fit->spectra_list[k]);
         }
+        fit->row_offset[k] = npt;
 
         fit->mffun.f      = & elliss_multifit_f;
         fit->mffun.df     = & elliss_multifit_df;
         fit->mffun.fdf    = & elliss_multifit_fdf;
+        fit->compact_fdf  = & elliss_multifit_compact_fdf;
         fit->mffun.n      = npt;
         fit->mffun.p      = nb_total_params;
         fit->mffun.params = fit;
@@ -114,6 +309,14 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
 
     cfg->chisq_threshold *= fit->samples_number;
 
+    if(cfg->threads > 1 && fit->samples_number > 1) {
+        int threads_number = cfg->threads;
+        if(threads_number > fit->samples_number) {
+            threads_number = fit->samples_number;
+        }
+        build_multi_fit_workers(fit, threads_number);
+    }
+
     fit->results = gsl_vector_alloc(nb_total_params);
     fit->chisq   = gsl_vector_alloc(fit->samples_number);
 
@@ -125,25 +328,21 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
 void
 dispose_multi_fit_engine_cache(struct multi_fit_engine *f)
 {
-    gsl_vector_free(f->jac_th);
+    struct fit_scratch scratch[1];
 
-    switch(f->system_kind) {
-    case SYSTEM_REFLECTOMETER:
-        gsl_vector_free(f->jac_n.refl);
-        f->jac_n.refl = NULL;
-        break;
-    case SYSTEM_ELLISS_AB:
-    case SYSTEM_ELLISS_PSIDEL:
-        cmpl_vector_free(f->jac_n.ell);
-        f->jac_n.ell = NULL;
-    default:
-        /* */
-        ;
-    }
+    dispose_multi_fit_workers(f);
+
+    scratch->jac_th = f->jac_th;
+    scratch->jac_n = f->jac_n;
+    free_scratch_jacob(scratch, f->system_kind);
 
     f->jac_th = NULL;
 
     dispose_stack_cache(& f->cache);
+    dispose_samples_cache(f);
+
+    free(f->row_offset);
+    f->row_offset = NULL;
 }
 
 void
@@ -265,6 +464,9 @@ multi_fit_engine_new(struct fit_config const *cfg, int samples_number) {
     f->private_parameters = NULL;
 
     f->results = NULL;
+    f->row_offset = NULL;
+    f->samples_cache = NULL;
+    f->workers = NULL;
 
     f->initialized = 0;
 
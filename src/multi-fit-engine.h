@@ -30,18 +30,42 @@ struct multi_fit_engine {
 
     gsl_multifit_function_fdf mffun;
 
+    /* Same as mffun.fdf but the Jacobian has only the columns of the
+       common parameters followed by the columns of the private parameters
+       of the sample each row belongs to. */
+    int (*compact_fdf)(const gsl_vector *x, void *params,
+                       gsl_vector *f, gsl_matrix *jacob);
+
     gsl_vector *results;
     gsl_vector *chisq;
 
+    /* first row of each sample in the residuals vector, the last entry
+       is the total number of rows */
+    size_t *row_offset;
+
     struct stack_cache cache;
 
+    /* For each sample, the refractive indexes of the layers whose RI is
+       not fitted. NULL if the RI of all the layers are fitted. */
+    struct stack_cache *samples_cache;
+
     gsl_vector *jac_th;
-    union {
-        gsl_vector *refl;
-        cmpl_vector *ell;
-    } jac_n;
+    union jac_n_vector jac_n;
+
+    /* Threads and per-thread data used when the samples are computed
+       in parallel, NULL otherwise. */
+    struct multi_fit_workers *workers;
 };
 
+/* Compute the rows of "f" and "jacob" for the sample "sample" using the
+   scratch space of the calling thread. When "compact" is non-zero the
+   Jacobian has the layout of the compact_fdf function. Either "f" or
+   "jacob" can be NULL. */
+typedef void (*multi_fit_sample_func_t)(struct multi_fit_engine *fit,
+                                        struct fit_scratch *scratch,
+                                        int sample, gsl_vector *f,
+                                        gsl_matrix *jacob, int compact);
+
 extern struct multi_fit_engine * \
 multi_fit_engine_new(struct fit_config const *cfg,
                      int samples_number);
@@ -58,6 +82,13 @@ extern void multi_fit_engine_disable(struct multi_fit_engine *f);
 extern int  multi_fit_engine_commit_parameters(struct multi_fit_engine *fit,
         const gsl_vector *x);
 
+extern cmpl * multi_fit_engine_get_ns(struct multi_fit_engine *fit,
+        struct fit_scratch *scratch, int sample, size_t j, double lambda);
+
+extern void multi_fit_engine_eval_samples(struct multi_fit_engine *fit,
+        const gsl_vector *x, multi_fit_sample_func_t func,
+        gsl_vector *f, gsl_matrix *jacob, int compact);
+
 extern void multi_fit_engine_print_fit_results(struct multi_fit_engine *fit,
         str_t text);
 
@@ -1,29 +1,90 @@
+#include <math.h>
+#include <stdint.h>
+
 #include "number-parse.h"
 
-static int parse_int(const char *text, int *nread)
+/* Maximum number of significant digits kept in the mantissa. */
+#define MANTISSA_DIGITS 19
+
+static const double pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define POW10_TABLE_MAX 22
+
+/* Read the decimal digits at "s" into the mantissa "m". Once the mantissa
+   has MANTISSA_DIGITS significant digits the following ones are dropped
+   and counted in "dropped". */
+static const char *parse_digits(const char *s, uint64_t *m, int *ndigits, int *dropped)
 {
-    int n = 0;
-    const char *s = text;
     while ((int) *s >= (int) '0' && (int) *s <= (int) '9') {
-        int d = (int) *s - (int) '0';
-        n = 10 * n + d;
+        if (*ndigits < MANTISSA_DIGITS) {
+            *m = 10 * (*m) + (uint64_t) (*s - '0');
+            if (*m > 0) {
+                (*ndigits) ++;
+            }
+        } else {
+            (*dropped) ++;
+        }
         s ++;
     }
-    *nread = s - text;
+    return s;
+}
+
+static double scale_pow10(double x, int exp)
+{
+    while (exp > POW10_TABLE_MAX) {
+        x *= pow10_table[POW10_TABLE_MAX];
+        exp -= POW10_TABLE_MAX;
+    }
+    while (exp < - POW10_TABLE_MAX) {
+        x /= pow10_table[POW10_TABLE_MAX];
+        exp += POW10_TABLE_MAX;
+    }
+    return (exp >= 0 ? x * pow10_table[exp] : x / pow10_table[-exp]);
+}
+
+/* Return the length of "word" if the text at "s" begins with it, ignoring
+   the case, or zero otherwise. */
+static int match_word(const char *s, const char *word)
+{
+    int n;
+    for (n = 0; word[n]; n++) {
+        char c = s[n];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c != word[n]) return 0;
+    }
     return n;
 }
 
-static float ipowf(float base, int exp)
+/* Read "inf", "infinity" or "nan", optionally followed by a parenthesized
+   sequence of characters, like strtod does. Return the number of
+   characters read or zero. */
+static int parse_special(const char *s, double *value)
 {
-    float result = 1;
-    while (exp)
-    {
-        if (exp & 1)
-            result *= base;
-        exp >>= 1;
-        base *= base;
+    int n;
+    if ((n = match_word(s, "infinity")) || (n = match_word(s, "inf"))) {
+        *value = INFINITY;
+        return n;
     }
-    return result;
+    if ((n = match_word(s, "nan"))) {
+        *value = NAN;
+        if (s[n] == '(') {
+            int k = n + 1;
+            while ((s[k] >= '0' && s[k] <= '9') || (s[k] >= 'a' && s[k] <= 'z') ||
+                   (s[k] >= 'A' && s[k] <= 'Z') || s[k] == '_') {
+                k ++;
+            }
+            if (s[k] == ')') {
+                n = k + 1;
+            }
+        }
+        return n;
+    }
+    return 0;
 }
 
 const char *skip_spaces(const char *s)
@@ -34,60 +95,81 @@ const char *skip_spaces(const char *s)
     return s;
 }
 
-int parse_float(const char *text, unsigned int flags, float *value, int *n_parsed)
+int parse_double(const char *text, unsigned int flags, double *value, int *n_parsed)
 {
-    const char *s = text;
+    const char *s = text, *digits_end;
+    const char decimal_sym = (flags & PARSE_FLOAT_FRENCH_LOCALE ? ',' : '.');
+    uint64_t m = 0;
+    int ndigits = 0, dropped = 0, exp10 = 0;
+    int sign = 1, n_special;
+
     if (flags & PARSE_FLOAT_SKIP_SPACES) {
         s = skip_spaces(s);
     }
-    int dec_pending = 1;
-    int sign = 1;
     if (*s == '+' || *s == '-') {
         sign = (*s == '+' ? 1 : -1);
         s ++;
     }
 
-    int nread;
-    int int_part = parse_int(s, &nread);
-    if (nread > 0) {
-        dec_pending = 0;
+    n_special = parse_special(s, value);
+    if (n_special > 0) {
+        *value *= sign;
+        *n_parsed = (s + n_special) - text;
+        return 0;
     }
-    s += nread;
 
-    const char decimal_sym = (flags & PARSE_FLOAT_FRENCH_LOCALE ? ',' : '.');
+    digits_end = parse_digits(s, &m, &ndigits, &dropped);
+    int has_digits = (digits_end > s);
+    s = digits_end;
+    exp10 = dropped;
 
-    int dec_part = 0, dec_power = 0;
     if (*s == decimal_sym) {
-        dec_part = parse_int(s + 1, &nread);
-        if (nread > 0) {
-            dec_pending = 0;
+        const char *frac = s + 1;
+        dropped = 0;
+        digits_end = parse_digits(frac, &m, &ndigits, &dropped);
+        /* The fractional digits kept in the mantissa scale it down. */
+        exp10 -= (digits_end - frac) - dropped;
+        if (digits_end > frac) {
+            has_digits = 1;
         }
-        s += nread + 1;
-        dec_power = nread;
+        s = digits_end;
     }
 
-    if (dec_pending) return 1;
+    if (!has_digits) return 1;
 
-    int exp_int = 0;
     if (*s == 'e' || *s == 'E') {
+        int esign = 1, e = 0;
+        const char *exp_start;
         s ++;
-        int esign = 1;
         if (*s == '+' || *s == '-') {
             esign = (*s == '+' ? 1 : -1);
             s ++;
         }
-        exp_int = esign * parse_int(s, &nread);
-        if (nread == 0) return 1;
-        s += nread;
-    }
-
-    float x = sign * int_part + dec_part / ipowf(10.0, dec_power);
-    if (exp_int >= 0) {
-        *value = x * ipowf(10.0, exp_int);
-    } else if (exp_int < 0) {
-        *value = x / ipowf(10.0, - exp_int);
+        exp_start = s;
+        while ((int) *s >= (int) '0' && (int) *s <= (int) '9') {
+            if (e < 10000) {
+                e = 10 * e + (*s - '0');
+            }
+            s ++;
+        }
+        if (s == exp_start) return 1;
+        exp10 += esign * e;
     }
 
+    /* With up to 15 significant digits and a decimal exponent in the range
+       of the table both the mantissa and the power of ten are exact and
+       the result is correctly rounded. Longer mantissas, up to
+       MANTISSA_DIGITS digits, are rounded when converted to double and the
+       result can be off by one unit in the last place. */
+    *value = sign * scale_pow10((double) m, exp10);
     *n_parsed = s - text;
     return 0;
 }
+
+int parse_float(const char *text, unsigned int flags, float *value, int *n_parsed)
+{
+    double x;
+    if (parse_double(text, flags, &x, n_parsed)) return 1;
+    *value = x;
+    return 0;
+}
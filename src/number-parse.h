@@ -11,6 +11,10 @@ enum {
 };
 
 extern const char *skip_spaces(const char *s);
+/* Locale independent parsing of a decimal number, or of "inf", "infinity"
+   and "nan" in any case. Return zero on success and store in "n_parsed"
+   the number of characters read. */
+extern int parse_double(const char *text, unsigned int flags, double *value, int *n_parsed);
 extern int parse_float(const char *text, unsigned int flags, float *value, int *n_parsed);
 
 __END_DECLS
@@ -11,13 +11,12 @@ rc_matrix *rc_matrix_alloc(size_t rows, size_t cols)
 
 void rc_matrix_ref(rc_matrix *m)
 {
-    m->ref_count++;
+    __sync_fetch_and_add(&m->ref_count, 1);
 }
 
 void rc_matrix_unref(rc_matrix *m)
 {
-    m->ref_count--;
-    if (m->ref_count <= 0) {
+    if (__sync_sub_and_fetch(&m->ref_count, 1) <= 0) {
         free(m);
     }
 }
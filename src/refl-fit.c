@@ -53,49 +53,95 @@ get_parameter_jacob_r(fit_param_t const *fp, stack_t const *stack,
     return result;
 }
 
-int
-refl_fit_fdf(const gsl_vector *x, void *params,
-             gsl_vector *f, gsl_matrix * jacob)
+/* Residuals only, the points are computed by groups of REFL_BATCH_LANES
+   wavelengths using the batched kernel. Only the interfaces from
+   cache->start up to the ambient are computed. */
+static void
+refl_fit_points_batch(struct fit_engine *fit, struct fit_scratch *scratch,
+                      size_t j_start, size_t j_end, gsl_vector *f)
 {
-    struct fit_engine *fit = params;
     struct spectrum *s = fit->run->spectr;
-    size_t nb_med = fit->stack->nb;
+    const struct refl_fit_cache *cache = &fit->run->refl_cache;
+    const double rmult = fit->extra->rmult;
+    size_t nb_med = scratch->stack->nb;
+    double const * ths = stack_get_ths_list(scratch->stack);
+    double lambda[REFL_BATCH_LANES], r_raw[REFL_BATCH_LANES];
+    double *ns_re = scratch->cache->ns_planes;
+    double *ns_im = ns_re + nb_med * REFL_BATCH_LANES;
+    size_t j, i, k;
+
+    for(j = j_start; j < j_end; j += REFL_BATCH_LANES) {
+        size_t n = j_end - j;
+
+        if(n > REFL_BATCH_LANES) {
+            n = REFL_BATCH_LANES;
+        }
+
+        for(i = 0; i < n; i++) {
+            const cmpl *ns;
+            lambda[i] = spectra_get_values(s, j + i)[0];
+            ns = fit_engine_get_ns(fit, scratch, j + i, lambda[i]);
+            for(k = 0; k < nb_med; k++) {
+                ns_re[k * n + i] = creal(ns[k]);
+                ns_im[k * n + i] = cimag(ns[k]);
+            }
+        }
+
+        mult_layer_refl_ni_batch_cached(cache->rc, j, n, ns_re, ns_im, ths,
+                                        lambda, cache->start, r_raw);
+
+        for(i = 0; i < n; i++) {
+            const double r_meas = spectra_get_values(s, j + i)[1];
+            gsl_vector_set(f, j + i, rmult * r_raw[i] - r_meas);
+        }
+    }
+}
+
+static void
+refl_fit_points(struct fit_engine *fit, struct fit_scratch *scratch,
+                size_t j_start, size_t j_end,
+                gsl_vector *f, gsl_matrix * jacob)
+{
+    struct spectrum *s = fit->run->spectr;
+    stack_t *stack = scratch->stack;
+    struct normal_eqs *normal = scratch->normal;
+    const int need_jacob = (jacob != NULL || normal != NULL);
+    size_t nb_med = stack->nb;
     gsl_vector *r_th_jacob, *r_n_jacob;
     double const * ths;
     cmpl * ns;
     size_t j;
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
-
-    fit_engine_commit_parameters(fit, x);
+    if(! need_jacob) {
+        if(f != NULL) {
+            refl_fit_points_batch(fit, scratch, j_start, j_end, f);
+        }
+        return;
+    }
 
     /* STEP 2 : From the stack we retrive the thicknesses and RIs
                 informations. */
 
-    ths = stack_get_ths_list(fit->stack);
+    ths = stack_get_ths_list(stack);
 
-    r_th_jacob = (jacob ? fit->run->jac_th : NULL);
-    r_n_jacob  = (jacob ? fit->run->jac_n.refl : NULL);
+    r_th_jacob = (need_jacob ? scratch->jac_th : NULL);
+    r_n_jacob  = (need_jacob ? scratch->jac_n.refl : NULL);
 
-    for(j = 0; j < spectra_points(s); j++) {
+    for(j = j_start; j < j_end; j++) {
         float const * spectr_data = spectra_get_values(s, j);
         const double lambda = spectr_data[0];
         const double r_meas = spectr_data[1];
         double r_raw, r_theory;
         double rmult = fit->extra->rmult;
 
-        if(fit->run->cache.th_only) {
-            ns = fit->run->cache.ns_full_spectr + j * nb_med;
-        } else {
-            ns = fit->run->cache.ns;
-            stack_get_ns_list(fit->stack, ns, lambda);
-        }
+        ns = fit_engine_get_ns(fit, scratch, j, lambda);
 
-        /* STEP 3 : We call the procedure mult_layer_refl_ni */
+        /* STEP 3 : We call the procedure mult_layer_refl_ni, specialized
+                    for the number of media */
 
-        r_raw = mult_layer_refl_ni(nb_med, ns, ths, lambda,
-                                   r_th_jacob, r_n_jacob);
+        r_raw = fit->run->refl_kernel(nb_med, ns, ths, lambda,
+                                      r_th_jacob, r_n_jacob,
+                                      scratch->cache->jac_ws);
 
         r_theory = rmult * r_raw;
 
@@ -103,9 +149,9 @@ refl_fit_fdf(const gsl_vector *x, void *params,
             gsl_vector_set(f, j, r_theory - r_meas);
         }
 
-        if(jacob) {
+        if(need_jacob) {
             size_t kp, ic;
-            struct deriv_info * ideriv = fit->run->cache.deriv_info;
+            struct deriv_info * ideriv = scratch->cache->deriv_info;
 
             if(! fit->run->cache.th_only) {
                 for(ic = 0; ic < nb_med; ic++) {
@@ -117,15 +163,94 @@ refl_fit_fdf(const gsl_vector *x, void *params,
                 const fit_param_t *fp = fit->parameters->values + kp;
                 double pjac;
 
-                pjac = get_parameter_jacob_r(fp, fit->stack, ideriv, lambda,
+                pjac = get_parameter_jacob_r(fp, stack, ideriv, lambda,
                                              r_th_jacob, r_n_jacob,
                                              rmult, r_raw);
 
-                gsl_matrix_set(jacob, j, kp, pjac);
+                if(normal) {
+                    gsl_matrix_set(normal->rows, 0, kp, pjac);
+                } else {
+                    gsl_matrix_set(jacob, j, kp, pjac);
+                }
             }
+
+            if(normal) {
+                const double r = r_theory - r_meas;
+                normal_eqs_add_rows(normal, &r);
+            }
+        }
+    }
+}
+
+/* Return the deepest interface whose reflection coefficient is changed
+   by moving from the parameters stored in the cache to "x". */
+static int
+refl_cache_start(struct fit_engine *fit, const gsl_vector *x)
+{
+    const struct refl_fit_cache *cache = &fit->run->refl_cache;
+    const int nb = fit->stack->nb;
+    int start = -1;
+    size_t kp;
+
+    if(! cache->valid) {
+        return nb - 2;
+    }
+
+    for(kp = 0; kp < fit->parameters->number; kp++) {
+        const fit_param_t *fp = fit->parameters->values + kp;
+        int lyr = fp->layer_nb, k;
+
+        if(gsl_vector_get(x, kp) == gsl_vector_get(cache->x, kp)) {
+            continue;
+        }
+
+        /* The RI of a medium enters the interfaces above and below it, its
+           thickness only the interface above. */
+        switch(fp->id) {
+        case PID_THICKNESS:
+            k = lyr - 1;
+            break;
+        case PID_LAYER_N:
+            k = (lyr < nb - 2 ? lyr : nb - 2);
+            break;
+        default:
+            k = -1;
+        }
+
+        if(k > start) {
+            start = k;
         }
     }
 
+    return start;
+}
+
+int
+refl_fit_fdf(const gsl_vector *x, void *params,
+             gsl_vector *f, gsl_matrix * jacob)
+{
+    struct fit_engine *fit = params;
+
+    if(jacob == NULL && f != NULL) {
+        struct refl_fit_cache *cache = &fit->run->refl_cache;
+        cache->start = refl_cache_start(fit, x);
+        gsl_vector_memcpy(cache->x, x);
+        cache->valid = 1;
+    }
+
+    /* STEP 1 : We apply the actual values of the fit parameters
+                to the stack and compute each spectral point. */
+
+    fit_engine_eval_points(fit, x, refl_fit_points, f, jacob);
+
+    return GSL_SUCCESS;
+}
+
+int
+refl_fit_normal_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+                    gsl_matrix *jtj, gsl_vector *jtf)
+{
+    fit_engine_eval_normal(params, x, refl_fit_points, f, jtj, jtf);
     return GSL_SUCCESS;
 }
 
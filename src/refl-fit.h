@@ -16,6 +16,9 @@ extern int          refl_fit_f(const gsl_vector *x, void *params,
                                gsl_vector * f);
 extern int          refl_fit_df(const gsl_vector *x,
                                 void *params, gsl_matrix *jacob);
+extern int          refl_fit_normal_fdf(const gsl_vector *x, void *params,
+                                        gsl_vector *f, gsl_matrix *jtj,
+                                        gsl_vector *jtf);
 
 __END_DECLS
 
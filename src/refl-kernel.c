@@ -1,7 +1,19 @@
 #include <assert.h>
+#include <math.h>
 
 #include "refl-kernel.h"
 
+/* On x86-64 GNU/Linux the batched kernel is compiled also for AVX2 and
+   AVX-512 and the best version is selected at load time. The load time
+   selection does not work with ThreadSanitizer. */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__) && (__GNUC__ >= 6) && !defined(__SANITIZE_THREAD__)
+#define REFL_BATCH_CLONES \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define REFL_BATCH_CLONES
+#endif
+
 static inline cmpl
 csqr(cmpl x)
 {
@@ -25,7 +37,7 @@ refl_coeff_ext_ni(cmpl nt, cmpl nb, cmpl * drdnt, cmpl * drdnb)
     return r;
 }
 
-static cmpl
+static inline cmpl
 mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
                            double lambda)
 {
@@ -47,7 +59,7 @@ mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
         nt = ns[j];
 
         beta = - 2.0 * I * omega * nc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
 
         r = refl_coeff_ni(nt, nc);
 
@@ -58,13 +70,19 @@ mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
     return R;
 }
 
-static cmpl
+/* The derivatives are computed in two sweeps. The first one, from the
+   substrate to the ambient, computes the derivatives of each interface
+   reflection coefficient respect to its own parameters and stores in
+   "dfdR" the derivative respect to the reflection coefficient below.
+   The second sweep, from the ambient to the substrate, multiplies them by
+   the product of the "dfdR" of the layers above. Both are O(layers). */
+static inline cmpl
 mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
-                            double lambda, cmpl *jacth)
+                            double lambda, cmpl *jacth, cmpl *dfdR)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
-    cmpl R;
+    cmpl R, a;
     cmpl nt, nc;
     int j;
 
@@ -75,27 +93,22 @@ mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r, rho, beta, drhodth;
-        cmpl dfdR, dfdrho;
+        cmpl dfdrho;
         cmpl den, isqden;
         double th = ds[j];
-        int k;
 
         nc = nt;
         nt = ns[j];
 
         beta = - 2.0 * I * omega * nc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
 
         r = refl_coeff_ni(nt, nc);
 
         den = 1 + r * R * rho;
         isqden = 1 / csqr(den);
-        dfdR = rho * (1 - r*r) * isqden;
-
-        for(k = nblyr; k > j+1; k--) {
-            jacth[k-1] *= dfdR;
-        }
+        dfdR[j] = rho * (1 - r*r) * isqden;
 
         dfdrho = R * (1 - r*r) * isqden;
 
@@ -104,16 +117,26 @@ mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
         R = (r + R * rho) / den;
     }
 
+    a = 1.0;
+    for(j = 0; j < nblyr; j++) {
+        jacth[j] *= a;
+        a *= dfdR[j];
+    }
+
     return R;
 }
 
-static cmpl
+/* Same as mult_layer_refl_ni_jacob_th for both the thickness and the
+   RI derivatives. Each RI but the substrate's one appears in two
+   interfaces: the contribution of the lower one is multiplied by its
+   "dfdR" in the first sweep. */
+static inline cmpl
 mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
-                         double lambda, cmpl *jacth, cmpl *jacn)
+                         double lambda, cmpl *jacth, cmpl *jacn, cmpl *dfdR)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
-    cmpl R;
+    cmpl R, a;
     cmpl nt, nc;
     cmpl drdnt, drdnb;
     int j;
@@ -128,16 +151,15 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r, rho, beta, drhodn, drhodth;
-        cmpl dfdR, dfdr, dfdrho;
+        cmpl dfdr, dfdrho;
         cmpl den, isqden;
         double th = ds[j];
-        int k;
 
         nc = nt;
         nt = ns[j];
 
         beta = - 2.0 * I * omega * nc;
-        rho = cexp(beta * THICKNESS_TO_NM(th));
+        rho = cmpl_phase_factor(beta * THICKNESS_TO_NM(th));
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
         drhodn = - 2.0 * I * rho * omega * THICKNESS_TO_NM(th);
 
@@ -145,20 +167,12 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
 
         den = 1 + r * R * rho;
         isqden = 1 / csqr(den);
-        dfdR = rho * (1 - r*r) * isqden;
-
-        for(k = nb - 1; k > j+1; k--) {
-            jacn[k] *= dfdR;
-        }
-
-        for(k = nblyr; k > j+1; k--) {
-            jacth[k-1] *= dfdR;
-        }
+        dfdR[j] = rho * (1 - r*r) * isqden;
 
         dfdr = (1 - csqr(R*rho)) * isqden;
         dfdrho = R * (1 - r*r) * isqden;
 
-        jacn[j+1] = dfdR * jacn[j+1] + dfdr * drdnb + dfdrho * drhodn;
+        jacn[j+1] = dfdR[j] * jacn[j+1] + dfdr * drdnb + dfdrho * drhodn;
         jacn[j] = dfdr * drdnt;
 
         jacth[j] = dfdrho * drhodth;
@@ -166,22 +180,197 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
         R = (r + R * rho) / den;
     }
 
+    a = 1.0;
+    for(j = 0; j < nblyr; j++) {
+        jacth[j] *= a;
+        jacn[j+1] *= a;
+        a *= dfdR[j];
+    }
+    jacn[nb-1] *= a;
+
     return R;
 }
 
-double
-mult_layer_refl_ni(size_t _nb, const cmpl ns[], const double ds[],
-                   double lambda,
-                   gsl_vector *r_jacob_th, gsl_vector *r_jacob_n)
+/* Batched version of mult_layer_refl_ni_nojacob for "n" wavelengths, with
+   n <= REFL_BATCH_LANES. The RIs are given as structure of arrays, the
+   real and imaginary parts of medium "k" at wavelength "i" being
+   ns_re[k*stride + i] and ns_im[k*stride + i]. All the complex arithmetic
+   is written in real form so that the loops on the wavelengths can be
+   vectorized.
+
+   If "cache" is not NULL the reflection coefficients below each interface
+   are stored there for the wavelengths from "j0". Only the interfaces
+   from "start" to the ambient are computed, the reflection coefficient
+   below "start" being taken from the cache. With start = nb - 2 all the
+   interfaces are computed, with start = -1 only the stored reflection
+   coefficient at the ambient is used. */
+REFL_BATCH_CLONES
+static void
+mult_layer_refl_ni_lanes(int nb, int n, int stride, const double ns_re[],
+                         const double ns_im[], const double ds[],
+                         const double lambda[], double refl[],
+                         struct refl_ni_cache *cache, size_t j0, int start)
+{
+    double R_re[REFL_BATCH_LANES], R_im[REFL_BATCH_LANES];
+    double rho_re[REFL_BATCH_LANES], rho_im[REFL_BATCH_LANES];
+    double ph_re[REFL_BATCH_LANES], ph_im[REFL_BATCH_LANES];
+    double omega[REFL_BATCH_LANES];
+    double *rc_re = NULL, *rc_im = NULL;
+    int rc_stride = 0;
+    int i, j;
+
+    if(cache) {
+        rc_re = cache->rc_re + j0;
+        rc_im = cache->rc_im + j0;
+        rc_stride = cache->npt;
+    } else {
+        start = nb - 2;
+    }
+
+    for(i = 0; i < n; i++) {
+        omega[i] = 2 * M_PI / lambda[i];
+    }
+
+    if(start >= nb - 2) {
+        for(i = 0; i < n; i++) {
+            const double ntr = ns_re[(nb-2)*stride + i];
+            const double nti = ns_im[(nb-2)*stride + i];
+            const double ncr = ns_re[(nb-1)*stride + i];
+            const double nci = ns_im[(nb-1)*stride + i];
+            const double sr = ncr + ntr, si = nci + nti;
+            const double dr = ncr - ntr, di = nci - nti;
+            const double isq = 1 / (sr*sr + si*si);
+            R_re[i] = (dr*sr + di*si) * isq;
+            R_im[i] = (di*sr - dr*si) * isq;
+        }
+        start = nb - 3;
+        if(rc_re) {
+            for(i = 0; i < n; i++) {
+                rc_re[(nb-2)*rc_stride + i] = R_re[i];
+                rc_im[(nb-2)*rc_stride + i] = R_im[i];
+            }
+        }
+    } else {
+        for(i = 0; i < n; i++) {
+            R_re[i] = rc_re[(start+1)*rc_stride + i];
+            R_im[i] = rc_im[(start+1)*rc_stride + i];
+        }
+    }
+
+    for(j = start; j >= 0; j--) {
+        const double *ntr = ns_re + j*stride, *nti = ns_im + j*stride;
+        const double *ncr = ns_re + (j+1)*stride, *nci = ns_im + (j+1)*stride;
+        const double th = THICKNESS_TO_NM(ds[j]);
+
+        /* rho = exp(- 2 I omega nc th) */
+        for(i = 0; i < n; i++) {
+            const double ph = 2 * omega[i] * th;
+            ph_re[i] = ph * nci[i];
+            ph_im[i] = - ph * ncr[i];
+        }
+        cmpl_phase_factor_planes(n, ph_re, ph_im, rho_re, rho_im);
+
+        for(i = 0; i < n; i++) {
+            const double sr = ncr[i] + ntr[i], si = nci[i] + nti[i];
+            const double dr = ncr[i] - ntr[i], di = nci[i] - nti[i];
+            const double isq = 1 / (sr*sr + si*si);
+            const double r_re = (dr*sr + di*si) * isq;
+            const double r_im = (di*sr - dr*si) * isq;
+            /* Rrho = R * rho, num = r + Rrho, den = 1 + r * Rrho */
+            const double Rrho_re = R_re[i]*rho_re[i] - R_im[i]*rho_im[i];
+            const double Rrho_im = R_re[i]*rho_im[i] + R_im[i]*rho_re[i];
+            const double num_re = r_re + Rrho_re, num_im = r_im + Rrho_im;
+            const double den_re = 1 + r_re*Rrho_re - r_im*Rrho_im;
+            const double den_im = r_re*Rrho_im + r_im*Rrho_re;
+            const double iden = 1 / (den_re*den_re + den_im*den_im);
+            R_re[i] = (num_re*den_re + num_im*den_im) * iden;
+            R_im[i] = (num_im*den_re - num_re*den_im) * iden;
+        }
+
+        if(rc_re) {
+            for(i = 0; i < n; i++) {
+                rc_re[j*rc_stride + i] = R_re[i];
+                rc_im[j*rc_stride + i] = R_im[i];
+            }
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        refl[i] = R_re[i]*R_re[i] + R_im[i]*R_im[i];
+    }
+}
+
+void
+mult_layer_refl_ni_batch(size_t nb, size_t n,
+                         const double ns_re[], const double ns_im[],
+                         const double ds[], const double lambda[],
+                         double refl[])
+{
+    size_t i;
+
+    assert(nb >= 2);
+
+    for(i = 0; i < n; i += REFL_BATCH_LANES) {
+        int lanes = (n - i < REFL_BATCH_LANES ? n - i : REFL_BATCH_LANES);
+        mult_layer_refl_ni_lanes(nb, lanes, n, ns_re + i, ns_im + i, ds,
+                                 lambda + i, refl + i, NULL, 0, nb - 2);
+    }
+}
+
+struct refl_ni_cache *
+refl_ni_cache_new(size_t nb, size_t npt)
+{
+    struct refl_ni_cache *cache = emalloc(sizeof(struct refl_ni_cache));
+
+    assert(nb >= 2);
+
+    cache->nb = nb;
+    cache->npt = npt;
+    cache->rc_re = emalloc(2 * (nb-1) * npt * sizeof(double));
+    cache->rc_im = cache->rc_re + (nb-1) * npt;
+
+    return cache;
+}
+
+void
+refl_ni_cache_free(struct refl_ni_cache *cache)
+{
+    free(cache->rc_re);
+    free(cache);
+}
+
+void
+mult_layer_refl_ni_batch_cached(struct refl_ni_cache *cache, size_t j0,
+                                size_t n, const double ns_re[],
+                                const double ns_im[], const double ds[],
+                                const double lambda[], int start,
+                                double refl[])
+{
+    size_t i;
+
+    assert(j0 + n <= cache->npt && start < (int) cache->nb - 1);
+
+    for(i = 0; i < n; i += REFL_BATCH_LANES) {
+        int lanes = (n - i < REFL_BATCH_LANES ? n - i : REFL_BATCH_LANES);
+        mult_layer_refl_ni_lanes(cache->nb, lanes, n, ns_re + i, ns_im + i,
+                                 ds, lambda + i, refl + i,
+                                 cache, j0 + i, start);
+    }
+}
+
+/* For up to NB_JAC_STATIC media the derivatives are stored on the stack,
+   otherwise in the caller's workspace. */
+static inline double
+refl_ni_eval(int nb, const cmpl ns[], const double ds[], double lambda,
+             gsl_vector *r_jacob_th, gsl_vector *r_jacob_n, cmpl *jac_ws)
 {
 #define NB_JAC_STATIC 10
     struct {
-        cmpl th[NB_JAC_STATIC], n[NB_JAC_STATIC];
+        cmpl th[NB_JAC_STATIC], n[NB_JAC_STATIC], dfdR[NB_JAC_STATIC];
     } jacs;
     struct {
-        cmpl *th, *n;
+        cmpl *th, *n, *dfdR;
     } jacd;
-    int nb = _nb;
     int use_static = (nb <= NB_JAC_STATIC);
     size_t k;
     cmpl r;
@@ -191,15 +380,18 @@ mult_layer_refl_ni(size_t _nb, const cmpl ns[], const double ds[],
     if(use_static) {
         jacd.th = jacs.th;
         jacd.n  = jacs.n;
+        jacd.dfdR = jacs.dfdR;
     } else {
-        jacd.th = emalloc(nb * sizeof(cmpl));
-        jacd.n  = emalloc(nb * sizeof(cmpl));
+        assert(jac_ws != NULL || (r_jacob_th == NULL && r_jacob_n == NULL));
+        jacd.th = jac_ws;
+        jacd.n  = jac_ws + nb;
+        jacd.dfdR = jac_ws + 2 * nb;
     }
 
     if(r_jacob_th && r_jacob_n) {
-        r = mult_layer_refl_ni_jacob(nb, ns, ds, lambda, jacd.th, jacd.n);
+        r = mult_layer_refl_ni_jacob(nb, ns, ds, lambda, jacd.th, jacd.n, jacd.dfdR);
     } else if(r_jacob_th) {
-        r = mult_layer_refl_ni_jacob_th(nb, ns, ds, lambda, jacd.th);
+        r = mult_layer_refl_ni_jacob_th(nb, ns, ds, lambda, jacd.th, jacd.dfdR);
     } else {
         r = mult_layer_refl_ni_nojacob(nb, ns, ds, lambda);
     }
@@ -220,11 +412,47 @@ mult_layer_refl_ni(size_t _nb, const cmpl ns[], const double ds[],
             gsl_vector_set(r_jacob_n, nb + k, drsqi);
         }
 
-    if(! use_static) {
-        free(jacd.th);
-        free(jacd.n);
-    }
-
     return CSQABS(r);
 #undef NB_JAC_STATIC
 }
+
+double
+mult_layer_refl_ni(size_t nb, const cmpl ns[], const double ds[],
+                   double lambda,
+                   gsl_vector *r_jacob_th, gsl_vector *r_jacob_n,
+                   cmpl *jac_ws)
+{
+    return refl_ni_eval(nb, ns, ds, lambda, r_jacob_th, r_jacob_n, jac_ws);
+}
+
+/* Versions of mult_layer_refl_ni for a fixed number of media: the layer
+   loops can be unrolled and the jacobian arrays are always static. */
+#define REFL_NI_FIXED_NB(N)                                                \
+static double                                                              \
+mult_layer_refl_ni_ ## N(size_t nb, const cmpl ns[], const double ds[],    \
+                         double lambda,                                    \
+                         gsl_vector *r_jacob_th, gsl_vector *r_jacob_n,    \
+                         cmpl *jac_ws)                                     \
+{                                                                          \
+    assert(nb == N);                                                       \
+    return refl_ni_eval(N, ns, ds, lambda, r_jacob_th, r_jacob_n, jac_ws); \
+}
+
+REFL_NI_FIXED_NB(3)
+REFL_NI_FIXED_NB(4)
+REFL_NI_FIXED_NB(5)
+REFL_NI_FIXED_NB(6)
+
+mult_layer_refl_ni_func_t *
+mult_layer_refl_ni_kernel(size_t nb)
+{
+    switch(nb) {
+    case 3: return mult_layer_refl_ni_3;
+    case 4: return mult_layer_refl_ni_4;
+    case 5: return mult_layer_refl_ni_5;
+    case 6: return mult_layer_refl_ni_6;
+    default:
+        ;
+    }
+    return mult_layer_refl_ni;
+}
@@ -9,10 +9,65 @@
 #include <gsl/gsl_vector.h>
 
 
-/* reflectivity for normal incidence with multi-layer film */
+/* Number of complex values needed by mult_layer_refl_ni as a workspace
+   for "nb" media. */
+#define REFL_NI_WORKSPACE_SIZE(nb) (3 * (nb))
+
+/* reflectivity for normal incidence with multi-layer film. The workspace
+   "jac_ws" is used only for more than 10 media and if "rjacob_th" or
+   "rjacob_n" are given, otherwise it can be NULL. */
 double mult_layer_refl_ni(size_t nb /*nb of mediums */,
                           const cmpl ns[], const double ds[],
                           double lambda,
-                          gsl_vector *rjacob_th, gsl_vector *rjacob_n);
+                          gsl_vector *rjacob_th, gsl_vector *rjacob_n,
+                          cmpl *jac_ws);
+
+typedef double mult_layer_refl_ni_func_t(size_t nb, const cmpl ns[],
+                                         const double ds[], double lambda,
+                                         gsl_vector *rjacob_th,
+                                         gsl_vector *rjacob_n,
+                                         cmpl *jac_ws);
+
+/* Return a version of mult_layer_refl_ni specialized for "nb" media, or
+   mult_layer_refl_ni itself if there is none. */
+extern mult_layer_refl_ni_func_t *mult_layer_refl_ni_kernel(size_t nb);
+
+/* Number of wavelengths computed together by mult_layer_refl_ni_batch. */
+#define REFL_BATCH_LANES 8
+
+/* reflectivity for normal incidence of "n" wavelengths, without
+   derivatives. The RIs are given as separate planes of real and
+   imaginary parts, the value of medium "k" at wavelength "i" being at
+   index k*n + i. */
+extern void mult_layer_refl_ni_batch(size_t nb, size_t n,
+                                     const double ns_re[], const double ns_im[],
+                                     const double ds[], const double lambda[],
+                                     double refl[]);
+
+/* Reflection coefficients below each interface for a spectrum of "npt"
+   points, the value of interface "k" at point "j" being at index
+   k*npt + j. */
+struct refl_ni_cache {
+    size_t nb, npt;
+    double *rc_re, *rc_im;
+};
+
+extern struct refl_ni_cache *refl_ni_cache_new(size_t nb, size_t npt);
+extern void refl_ni_cache_free(struct refl_ni_cache *cache);
+
+/* Same as mult_layer_refl_ni_batch for the points from "j0" to j0 + n of
+   the spectrum of "cache". Only the interfaces from "start" up to the
+   ambient are computed. The reflection coefficient below "start" is
+   taken from the cache, which must have been filled by a previous call
+   with the same wavelengths and the same RIs and thicknesses of the media
+   below "start". With start = nb - 2 all the interfaces are computed and
+   with start = -1 the stored coefficient at the ambient is used. */
+extern void mult_layer_refl_ni_batch_cached(struct refl_ni_cache *cache,
+                                            size_t j0, size_t n,
+                                            const double ns_re[],
+                                            const double ns_im[],
+                                            const double ds[],
+                                            const double lambda[],
+                                            int start, double refl[]);
 
 #endif
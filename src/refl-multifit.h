@@ -10,6 +10,8 @@ __BEGIN_DECLS
 
 extern int      refl_multifit_fdf(const gsl_vector *x, void *params,
                                   gsl_vector *f, gsl_matrix * jacob);
+extern int      refl_multifit_compact_fdf(const gsl_vector *x, void *params,
+                                          gsl_vector *f, gsl_matrix * jacob);
 extern int      refl_multifit_f(const gsl_vector *x, void *params,
                                 gsl_vector * f);
 extern int      refl_multifit_df(const gsl_vector *x,
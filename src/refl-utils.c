@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "refl-utils.h"
@@ -14,13 +15,13 @@ get_lambda(double w[], int k)
     return w[0] + k * w[1] + k*k * w[2] + k*k*k * w[3];
 }
 
-struct data_table *
-read_nova_spectrum(FILE *f, str_ptr ln, const int polarization_number, const int sample_number) {
+static struct data_table *
+read_nova_spectrum(const char *text, str_ptr ln, const int polarization_number, const int sample_number) {
     struct data_table *table;
     int pol, na, j;
     int lcount[2], lc0[2];
     unsigned int c, c_save[2];
-    long dpos[2];
+    const char *dpos[2];
     double w[4];
     int offset[2];
 
@@ -30,13 +31,14 @@ read_nova_spectrum(FILE *f, str_ptr ln, const int polarization_number, const int
         int i;
         for(lc0[pol] = 0, i = 0; i < sample_number; i++) {
             char tc;
-            if(str_getline(ln, f) < 0) return NULL;
+            text = str_getline_text(ln, text);
+            if(text == NULL) return NULL;
             na = sscanf(CSTR(ln), "%u %c", &c, &tc);
             if(na > 1) return NULL;
 
             if(c > 0 && starting_zeroes) {
                 c_save[pol] = c;
-                dpos[pol] = ftell(f);
+                dpos[pol] = text;
                 starting_zeroes = 0;
                 lcount[pol] = 1;
                 continue;
@@ -59,7 +61,7 @@ read_nova_spectrum(FILE *f, str_ptr ln, const int polarization_number, const int
         }
     }
 
-    if(str_getline(ln, f) < 0) return NULL;
+    if(str_getline_text(ln, text) == NULL) return NULL;
     int wavelen_scanf_match = sscanf(CSTR(ln), "%lf %lf %lf %lf %d;%d \n", w, w+1, w+2, w+3, offset, offset+1);
     if(wavelen_scanf_match < 5) {
         return NULL;
@@ -80,10 +82,15 @@ read_nova_spectrum(FILE *f, str_ptr ln, const int polarization_number, const int
     }
 
     for (pol = 0; pol < polarization_number; pol++) {
-        if(fseek(f, dpos[pol], SEEK_SET) < 0) return NULL;
+        const char *p = dpos[pol];
         data_table_set(table, 0, 1, data_table_get(table, 0, 1) + NORMALIZE(c_save[pol]) / (double)polarization_number);
         for(j = 1; j < lcount_uni; j++) {
-            fscanf(f, " %u", &c);
+            char *tail;
+            unsigned long cn = strtoul(p, &tail, 10);
+            if(tail > p) {
+                c = cn;
+                p = tail;
+            }
             data_table_set(table, j, 1, data_table_get(table, j, 1) + NORMALIZE(c) / (double)polarization_number);
         }
     }
@@ -92,25 +99,18 @@ read_nova_spectrum(FILE *f, str_ptr ln, const int polarization_number, const int
 }
 
 struct spectrum *
-load_refl_data(const char *filename, str_ptr *error_msg) {
+read_refl_data(const char *filename, const char *text, str_ptr *error_msg) {
     struct spectrum *s;
     struct data_table *table;
+    const char *data;
     str_t ln;
-    FILE *f;
-
-    f = fopen(filename, "r");
-
-    if(f == NULL) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
-        return NULL;
-    }
 
     str_init(ln, 64);
 
     s = emalloc(sizeof(struct spectrum));
     s->config.system = SYSTEM_REFLECTOMETER;
 
-    str_getline(ln, f);
+    data = str_getline_text(ln, text);
 
     if(strstr(CSTR(ln), ";Experimental Spectrum") || \
             strstr(CSTR(ln), ";Theoretical Spectrum")) {
@@ -129,10 +129,10 @@ load_refl_data(const char *filename, str_ptr *error_msg) {
             goto invalid_s;
         }
         const int sample_number = (polarization_number == 1 ? 256 : 1024);
-        table = read_nova_spectrum(f, ln, polarization_number, sample_number);
+        table = (data ? read_nova_spectrum(data, ln, polarization_number, sample_number) : NULL);
     } else {
-        str_getline(ln, f);
-        table = data_table_read_lines(f, "%*s %f %*f %f %*f\n", 0, 2);
+        data = (data ? str_getline_text(ln, data) : NULL);
+        table = (data ? data_table_read_text(data, "sfxfx", 2) : NULL);
     }
 
     if(table == NULL) {
@@ -142,18 +142,18 @@ load_refl_data(const char *filename, str_ptr *error_msg) {
     data_view_init(s->table, table);
 
     str_free(ln);
-    fclose(f);
 
     return s;
 invalid_s:
     *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra \"%s\" is incorrect", filename);
     free(s);
     str_free(ln);
-    fclose(f);
     return NULL;
 }
 
-static int filmetrics_parse_line(const char *s, unsigned int flags, float x[])
+/* Parse a line of data. On success "next" is set to the beginning of the
+   following line. */
+static int filmetrics_parse_line(const char *s, unsigned int flags, float x[], const char **next)
 {
     int n;
     const char list_sep = (flags & PARSE_FLOAT_FRENCH_LOCALE ? ';' : ',');
@@ -163,95 +163,92 @@ static int filmetrics_parse_line(const char *s, unsigned int flags, float x[])
     s = skip_spaces(s + 1);
     if (parse_float(s, flags, &x[1], &n)) return 1;
     s = skip_spaces(s + n);
-    while (*s == '\r' || *s == '\n') {
+    while (*s == '\r') {
         s ++;
     }
-    return (*s == '\0' ? 0 : 1);
+    if (*s == '\n') {
+        s ++;
+    } else if (*s != '\0') {
+        return 1;
+    }
+    *next = s;
+    return 0;
 }
 
 static int filmetrics_test_line_format(const char *s)
 {
     float x[2];
+    const char *next;
     unsigned int test_flags = PARSE_FLOAT_SKIP_SPACES;
-    if (filmetrics_parse_line(s, test_flags, x) == 0) {
+    if (filmetrics_parse_line(s, test_flags, x, &next) == 0) {
         return test_flags;
     }
     test_flags |= PARSE_FLOAT_FRENCH_LOCALE;
-    if (filmetrics_parse_line(s, test_flags, x) == 0) {
+    if (filmetrics_parse_line(s, test_flags, x, &next) == 0) {
         return test_flags;
     }
     return -1;
 }
 
 static struct data_table *
-filmetrics_read_data_table(FILE *f, unsigned parse_flags, str_ptr ln) {
+filmetrics_read_data_table(const char *text, unsigned parse_flags) {
     const int columns = 2;
-    struct generic_array *data = ARRAY_NEW(float);
-    struct data_table *r = NULL;
-    int row, index = 0;
-
-    for(row = 0; /* */; row++, index += columns) {
-        ARRAY_CHECK_ALLOC(data, float, index + columns - 1);
-        data->number += columns;
-        str_getline(ln, f);
-        if (filmetrics_parse_line(CSTR(ln), parse_flags, ARRAY_GET_PTR(data, float, index))) {
-            if(feof(f) && row >= 2) {
-                r = data_table_new(row, columns);
-                memcpy(r->heap, data->heap, row * columns * sizeof(float));
-            }
+    struct data_table *r;
+    const char *s, *p;
+    int row, alloc_rows = 1;
+
+    for (p = text; (p = strchr(p, '\n')) != NULL; p++) {
+        alloc_rows ++;
+    }
+
+    r = data_table_new(alloc_rows, columns);
+
+    for(s = text, row = 0; row < alloc_rows && *s != '\0'; row++) {
+        if (filmetrics_parse_line(s, parse_flags, r->heap + row * columns, &s)) {
             break;
         }
     }
-    ARRAY_FREE(data);
-    return r;
+
+    /* Only blank lines can follow the data. */
+    s += strspn(s, " \t\r\n");
+    if(*s != '\0' || row < 2) {
+        free(r);
+        return NULL;
+    }
+
+    r->rows = row;
+    return erealloc(r, sizeof(struct data_table) + (row * columns - 1) * sizeof(float));
 }
 
 struct spectrum *
-load_filmetrics_spectrum(const char *filename, str_ptr *error_msg) {
+read_filmetrics_spectrum(const char *filename, const char *text, str_ptr *error_msg) {
     struct spectrum *s;
+    const char *data;
     str_t ln;
-    FILE *f;
-
-    f = fopen(filename, "r");
-
-    if(f == NULL) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
-        return NULL;
-    }
 
     s = emalloc(sizeof(struct spectrum));
     s->config.system = SYSTEM_REFLECTOMETER;
 
     str_init(ln, 64);
-    str_getline(ln, f);
+    data = str_getline_text(ln, text);
+    if (data == NULL) goto filmetrics_fail;
 
-    long data_pos = ftell(f);
-    str_getline(ln, f);
+    str_getline_text(ln, data);
 
     int line_flags = filmetrics_test_line_format(CSTR(ln));
-    if (line_flags < 0) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "Unknown Filmetrics file format");
-        goto filmetrics_fail;
-    }
-
-    if (fseek(f, data_pos, SEEK_SET) != 0) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "cannot seek file");
-        goto filmetrics_fail;
-    }
+    if (line_flags < 0) goto filmetrics_fail;
 
-    struct data_table *table = filmetrics_read_data_table(f, line_flags, ln);
+    struct data_table *table = filmetrics_read_data_table(data, line_flags);
     if (!table) goto filmetrics_fail;
 
     data_view_init(s->table, table);
 
     str_free(ln);
-    fclose(f);
     return s;
 
 filmetrics_fail:
     *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra \"%s\" is incorrect", filename);
     free(s);
     str_free(ln);
-    fclose(f);
     return NULL;
 }
@@ -6,8 +6,10 @@
 
 __BEGIN_DECLS
 
-extern struct spectrum * load_refl_data(const char *filename, str_ptr *error_msg);
-extern struct spectrum * load_filmetrics_spectrum(const char *filename, str_ptr *error_msg);
+/* Parse the text of a spectrum file. The filename is used only for the
+   error messages. */
+extern struct spectrum * read_refl_data(const char *filename, const char *text, str_ptr *error_msg);
+extern struct spectrum * read_filmetrics_spectrum(const char *filename, const char *text, str_ptr *error_msg);
 
 __END_DECLS
 
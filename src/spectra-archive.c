@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "spectra-archive.h"
+#include "error-messages.h"
+
+#define ARCHIVE_MAGIC "RPSPECTA"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BYTE_ORDER 0x01020304
+
+/* Offset of the values in the image of a data_table: rows, columns and
+   reference count. */
+#define TABLE_HEADER_SIZE (3 * sizeof(int32_t))
+
+/* Layout of the file:
+
+   header
+   data tables, each at an offset multiple of 8
+   names, zero terminated
+   index, one entry for each spectrum
+
+   The header is written last so that an incomplete file is not taken as
+   a valid archive. */
+struct spectra_archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t number;
+    uint32_t reserved;
+    uint64_t names_offset;
+    uint64_t index_offset;
+};
+
+struct spectra_archive_entry {
+    uint64_t table_offset;
+    uint32_t name_offset;
+    int32_t system;
+    /* Angles are in radians as in struct system_config. */
+    double aoi;
+    double analyzer;
+    double numap;
+};
+
+static int
+map_file(struct spectra_archive *a, const char *filename)
+{
+#ifdef WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return 1;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return 1;
+    }
+    /* The view keeps the mapping object alive. */
+    a->data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (a->data == NULL) {
+        return 1;
+    }
+    a->size = size.QuadPart;
+    return 0;
+#else
+    struct stat info[1];
+    void *data;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, info) < 0 || info->st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    /* The mapping is private and writable so that the data tables behave
+       like any other one. The pages are copied only if written. */
+    data = mmap(NULL, info->st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+    a->data = data;
+    a->size = info->st_size;
+    return 0;
+#endif
+}
+
+static void
+unmap_file(struct spectra_archive *a)
+{
+#ifdef WIN32
+    UnmapViewOfFile(a->data);
+#else
+    munmap(a->data, a->size);
+#endif
+}
+
+static int
+check_entry(const struct spectra_archive *a, const struct spectra_archive_header *h,
+            const struct spectra_archive_entry *e)
+{
+    const uint64_t names_size = h->index_offset - h->names_offset;
+    const int32_t *tab;
+    uint64_t values;
+
+    if (e->name_offset >= names_size) {
+        return 1;
+    }
+    if (e->system <= SYSTEM_UNDEFINED || e->system >= SYSTEM_EXCEED_VALUE) {
+        return 1;
+    }
+    if (e->table_offset % 8 != 0 || e->table_offset + TABLE_HEADER_SIZE > h->names_offset) {
+        return 1;
+    }
+    tab = (const int32_t *) (a->data + e->table_offset);
+    if (tab[0] <= 0 || tab[1] <= 0 || tab[2] >= 0) {
+        return 1;
+    }
+    values = (uint64_t) tab[0] * (uint64_t) tab[1];
+    if (values > (h->names_offset - e->table_offset - TABLE_HEADER_SIZE) / sizeof(float)) {
+        return 1;
+    }
+    return 0;
+}
+
+struct spectra_archive *
+spectra_archive_open(const char *filename, str_ptr *error_msg)
+{
+    struct spectra_archive *a;
+    const struct spectra_archive_header *h;
+    uint32_t k;
+
+    assert(offsetof(struct data_table, heap) == TABLE_HEADER_SIZE);
+
+    a = emalloc(sizeof(struct spectra_archive));
+
+    if (map_file(a, filename)) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
+        free(a);
+        return NULL;
+    }
+
+    h = (const struct spectra_archive_header *) a->data;
+
+    if (a->size < sizeof(struct spectra_archive_header) || memcmp(h->magic, ARCHIVE_MAGIC, 8) != 0) {
+        goto invalid_archive;
+    }
+    if (h->version != ARCHIVE_VERSION || h->byte_order != ARCHIVE_BYTE_ORDER) {
+        goto invalid_archive;
+    }
+    if (h->names_offset < sizeof(struct spectra_archive_header) || h->names_offset >= h->index_offset ||
+        h->index_offset % 8 != 0 || h->index_offset > a->size ||
+        (a->size - h->index_offset) / sizeof(struct spectra_archive_entry) < h->number) {
+        goto invalid_archive;
+    }
+
+    a->number = h->number;
+    a->index = (const struct spectra_archive_entry *) (a->data + h->index_offset);
+    a->names = a->data + h->names_offset;
+
+    /* The names area is padded with zeroes so its last byte terminates
+       the last name. */
+    if (a->data[h->index_offset - 1] != 0) {
+        goto invalid_archive;
+    }
+
+    for (k = 0; k < h->number; k++) {
+        if (check_entry(a, h, &a->index[k])) {
+            goto invalid_archive;
+        }
+    }
+
+    return a;
+
+invalid_archive:
+    *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra archive %s is incorrect", filename);
+    unmap_file(a);
+    free(a);
+    return NULL;
+}
+
+void
+spectra_archive_close(struct spectra_archive *a)
+{
+    unmap_file(a);
+    free(a);
+}
+
+const char *
+spectra_archive_name(const struct spectra_archive *a, int index)
+{
+    assert(index >= 0 && index < a->number);
+    return a->names + a->index[index].name_offset;
+}
+
+struct spectrum *
+spectra_archive_get(const struct spectra_archive *a, int index)
+{
+    const struct spectra_archive_entry *e = &a->index[index];
+    struct spectrum *s;
+
+    assert(index >= 0 && index < a->number);
+
+    s = emalloc(sizeof(struct spectrum));
+    s->config.system   = e->system;
+    s->config.aoi      = e->aoi;
+    s->config.analyzer = e->analyzer;
+    s->config.numap    = e->numap;
+
+    /* The table's negative reference count prevents any attempt to
+       free it. */
+    data_view_init(s->table, (struct data_table *) (a->data + e->table_offset));
+
+    return s;
+}
+
+static int
+writer_write(struct spectra_archive_writer *w, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, w->f) != size) {
+        return 1;
+    }
+    w->offset += size;
+    return 0;
+}
+
+static int
+writer_align(struct spectra_archive_writer *w)
+{
+    static const char zeroes[8] = {0};
+    const size_t pad = (8 - w->offset % 8) % 8;
+    return writer_write(w, zeroes, pad);
+}
+
+struct spectra_archive_writer *
+spectra_archive_writer_new(const char *filename, str_ptr *error_msg)
+{
+    struct spectra_archive_header h[1];
+    struct spectra_archive_writer *w;
+    FILE *f = fopen(filename, "wb");
+
+    if (f == NULL) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot open file \"%s\" for writing", filename);
+        return NULL;
+    }
+
+    w = emalloc(sizeof(struct spectra_archive_writer));
+    w->f = f;
+    w->offset = 0;
+    str_init_from_c(w->filename, filename);
+    w->index = NULL;
+    w->number = 0;
+    w->alloc = 0;
+    w->names = NULL;
+    w->names_size = 0;
+    w->names_alloc = 0;
+
+    /* Room for the header, written when the writer is closed. */
+    memset(h, 0, sizeof(h));
+    if (writer_write(w, h, sizeof(h))) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Error writing file \"%s\"", filename);
+        fclose(f);
+        str_free(w->filename);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+int
+spectra_archive_writer_add(struct spectra_archive_writer *w, const char *name,
+                           const struct spectrum *s, str_ptr *error_msg)
+{
+    const struct data_view *view = s->table;
+    const size_t name_len = strlen(name) + 1;
+    struct spectra_archive_entry *e;
+    int32_t tab[3];
+    int j;
+
+    if (writer_align(w)) goto write_error;
+
+    if (w->number >= w->alloc) {
+        w->alloc = (w->alloc > 0 ? 2 * w->alloc : 64);
+        w->index = erealloc(w->index, w->alloc * sizeof(struct spectra_archive_entry));
+    }
+    if (w->names_size + name_len > w->names_alloc) {
+        w->names_alloc = 2 * (w->names_size + name_len);
+        w->names = erealloc(w->names, w->names_alloc);
+    }
+
+    e = &w->index[w->number];
+    e->table_offset = w->offset;
+    e->name_offset  = w->names_size;
+    e->system       = s->config.system;
+    e->aoi          = s->config.aoi;
+    e->analyzer     = s->config.analyzer;
+    e->numap        = s->config.numap;
+
+    /* The rows are written as seen through the data view so that a
+       range cut or a subsampling is taken into account. */
+    tab[0] = view->rows;
+    tab[1] = view->columns;
+    tab[2] = -1;
+    if (writer_write(w, tab, sizeof(tab))) goto write_error;
+    for (j = 0; j < view->rows; j++) {
+        if (writer_write(w, data_view_get_row(view, j), view->columns * sizeof(float))) goto write_error;
+    }
+
+    memcpy(w->names + w->names_size, name, name_len);
+    w->names_size += name_len;
+    w->number ++;
+    return 0;
+
+write_error:
+    *error_msg = new_error_message(LOADING_FILE_ERROR, "Error writing file \"%s\"", CSTR(w->filename));
+    return 1;
+}
+
+int
+spectra_archive_writer_close(struct spectra_archive_writer *w, str_ptr *error_msg)
+{
+    struct spectra_archive_header h[1];
+    int status = 1;
+
+    memset(h, 0, sizeof(h));
+    memcpy(h->magic, ARCHIVE_MAGIC, 8);
+    h->version = ARCHIVE_VERSION;
+    h->byte_order = ARCHIVE_BYTE_ORDER;
+    h->number = w->number;
+
+    h->names_offset = w->offset;
+    /* An empty name area still holds a zero byte. */
+    if (w->names_size == 0) {
+        if (writer_write(w, "", 1)) goto close_writer;
+    } else {
+        if (writer_write(w, w->names, w->names_size)) goto close_writer;
+    }
+    if (writer_align(w)) goto close_writer;
+
+    h->index_offset = w->offset;
+    if (writer_write(w, w->index, w->number * sizeof(struct spectra_archive_entry))) goto close_writer;
+
+    if (fseek(w->f, 0, SEEK_SET) != 0) goto close_writer;
+    if (fwrite(h, sizeof(h), 1, w->f) != 1) goto close_writer;
+
+    status = 0;
+
+close_writer:
+    if (fclose(w->f) != 0) {
+        status = 1;
+    }
+    if (status != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Error writing file \"%s\"", CSTR(w->filename));
+    }
+    str_free(w->filename);
+    free(w->index);
+    free(w->names);
+    free(w);
+    return status;
+}
@@ -0,0 +1,64 @@
+#ifndef SPECTRA_ARCHIVE_H
+#define SPECTRA_ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "defs.h"
+#include "spectra.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+/* Binary container for many spectra. The file holds an index with the name
+   and the system configuration of each spectrum and, for each spectrum,
+   the image of a data_table with a negative reference count. When an
+   archive is opened the file is memory mapped and the spectra's data
+   views point straight into the mapping: nothing is parsed or copied.
+
+   The data is written in the byte order of the machine. An archive written
+   with a different byte order is rejected when opened. */
+
+struct spectra_archive_entry;
+
+struct spectra_archive {
+    int number;
+    const struct spectra_archive_entry *index;
+    const char *names;
+
+    /* The memory mapped file. */
+    char *data;
+    size_t size;
+};
+
+struct spectra_archive_writer {
+    FILE *f;
+    uint64_t offset;
+    str_t filename;
+
+    struct spectra_archive_entry *index;
+    int number, alloc;
+
+    char *names;
+    size_t names_size, names_alloc;
+};
+
+extern struct spectra_archive * spectra_archive_open(const char *filename, str_ptr *error_msg);
+extern void                     spectra_archive_close(struct spectra_archive *a);
+
+extern const char *             spectra_archive_name(const struct spectra_archive *a, int index);
+
+/* The spectrum returned refers to the archive's mapping and should be
+   freed with spectra_free before the archive is closed. */
+extern struct spectrum *        spectra_archive_get(const struct spectra_archive *a, int index);
+
+extern struct spectra_archive_writer * spectra_archive_writer_new(const char *filename, str_ptr *error_msg);
+extern int  spectra_archive_writer_add(struct spectra_archive_writer *w, const char *name,
+                                       const struct spectrum *s, str_ptr *error_msg);
+/* Write the index and close the file. Returns zero on success. In any
+   case the writer is freed. */
+extern int  spectra_archive_writer_close(struct spectra_archive_writer *w, str_ptr *error_msg);
+
+__END_DECLS
+
+#endif
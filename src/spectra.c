@@ -7,26 +7,19 @@
 #include "error-messages.h"
 #include "data-table.h"
 #include "str.h"
+#include "str-util.h"
 
 
-static struct spectrum * load_ellips_spectrum(const char *filename, str_ptr *error_msg);
+static struct spectrum * read_ellips_spectrum(const char *filename, const char *text, str_ptr *error_msg);
 
 
 struct spectrum *
-load_ellips_spectrum(const char *filename, str_ptr *error_msg) {
+read_ellips_spectrum(const char *filename, const char *text, str_ptr *error_msg) {
     struct spectrum *s;
     struct system_config *cfg;
     struct data_table *data_table;
-    int iseof, nr;
+    const char *line, *next;
     str_t ln;
-    FILE *f;
-
-    f = fopen(filename, "r");
-
-    if(f == NULL) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
-        return NULL;
-    }
 
     str_init(ln, 64);
 
@@ -39,7 +32,7 @@ load_ellips_spectrum(const char *filename, str_ptr *error_msg) {
     cfg->analyzer = 25.0;
     cfg->numap    = 0.0;
 
-    str_getline(ln, f);
+    line = str_getline_text(ln, text);
     if(strstr(CSTR(ln), "SE ALPHA BETA")) {
         cfg->system = SYSTEM_ELLISS_AB;
     } else if(strstr(CSTR(ln), "SE PSI DELTA")) {
@@ -48,65 +41,47 @@ load_ellips_spectrum(const char *filename, str_ptr *error_msg) {
         goto invalid_s;
     }
 
-    for(;;) {
-        iseof = str_getline(ln, f);
+    for(/* */; line != NULL && *line != 0; line = next) {
+        next = str_getline_text(ln, line);
 
-        if(iseof != 0) {
-            break;
-        }
-
-        nr = sscanf(CSTR(ln), "AOI %lf", & cfg->aoi);
-        if(nr == 1) {
+        if(sscanf(CSTR(ln), "AOI %lf", & cfg->aoi) == 1) {
             continue;
         }
 
-        nr = sscanf(CSTR(ln), "NA %lf", & cfg->numap);
-        if(nr == 1) {
+        if(sscanf(CSTR(ln), "NA %lf", & cfg->numap) == 1) {
             continue;
         }
 
-        nr = sscanf(CSTR(ln), "A %lf", & cfg->analyzer);
-        if(nr == 1) {
+        if(sscanf(CSTR(ln), "A %lf", & cfg->analyzer) == 1) {
             continue;
         }
 
         break;
     }
 
+    if(line == NULL) {
+        goto invalid_s;
+    }
+
     /* the values get converted in radians */
     cfg->aoi      = DEGREE(cfg->aoi);
     cfg->analyzer = DEGREE(cfg->analyzer);
 
-    do {
-        float lambda, alpha, beta;
+    data_table = data_table_read_text(line, "sfff", 3);
 
-        nr = sscanf(CSTR(ln), "%*s %f %f %f\n", & lambda, & alpha, & beta);
-        if(nr < 3) {
-            goto invalid_s;
-        }
-
-        data_table = data_table_read_lines(f, "%*s %f %f %f\n", 1, 3);
-
-        if(data_table == NULL) {
-            goto invalid_s;
-        }
-
-        data_table_set(data_table, 0, 0, lambda);
-        data_table_set(data_table, 0, 1, alpha);
-        data_table_set(data_table, 0, 2, beta);
-    } while(0);
+    if(data_table == NULL) {
+        goto invalid_s;
+    }
 
     data_view_init(s->table, data_table);
 
     str_free(ln);
-    fclose(f);
 
     return s;
 invalid_s:
     *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra %s is incorrect", filename);
     free(s);
     str_free(ln);
-    fclose(f);
     return NULL;
 }
 
@@ -115,23 +90,18 @@ invalid_s:
 #define VASE_CONVERT_TO_ALPHA_BETA 1
 
 static struct spectrum *
-load_vase_spectrum(const char *filename, str_ptr *error_msg)
+read_vase_spectrum(const char *filename, const char *text, str_ptr *error_msg)
 {
     struct spectrum *s;
     struct system_config *cfg;
     struct data_table *data_table;
-
-    FILE *f = fopen(filename, "r");
-    if(f == NULL) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
-        return NULL;
-    }
+    const char *data;
 
     str_t ln;
     str_init(ln, 64);
-    str_getline(ln, f); /* Skip the first line. */
-    str_getline(ln, f);
-    if (!strstr(CSTR(ln), "nm")) {
+    data = str_getline_text(ln, text); /* Skip the first line. */
+    data = (data ? str_getline_text(ln, data) : NULL);
+    if (!data || !strstr(CSTR(ln), "nm")) {
         str_free(ln);
         *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra %s is incorrect", filename);
         return NULL;
@@ -143,17 +113,15 @@ load_vase_spectrum(const char *filename, str_ptr *error_msg)
     cfg->analyzer = (VASE_CONVERT_TO_ALPHA_BETA ? DEGREE(25.0) : DEGREE(0.0));
     cfg->numap    = 0.0;
 
-    /* In order to know the AOI we lookup just the first line and
-       reset the position just after. */
-    long data_pos = ftell(f);
+    /* The AOI is taken from the first line of data. */
     float aoi;
-    int nread = fscanf(f, "E %*f %f", &aoi);
-    if (nread == 0) goto invalid_vase;
+    str_getline_text(ln, data);
+    int nread = sscanf(CSTR(ln), " E %*f %f", &aoi);
+    if (nread < 1) goto invalid_vase;
     cfg->aoi = DEGREE(aoi);
-    fseek(f, data_pos, SEEK_SET);
 
     /* The following function reads the integrality of the tabular data. */
-    data_table = data_table_read_lines(f, "E %f %*f %f %f %*f %*f %*f %*f ", 0, 3);
+    data_table = data_table_read_text(data, "Efxffxxxx", 3);
     if(data_table == NULL) goto invalid_vase;
 
     int i;
@@ -177,14 +145,12 @@ load_vase_spectrum(const char *filename, str_ptr *error_msg)
     data_view_init(s->table, data_table);
 
     str_free(ln);
-    fclose(f);
     return s;
 
 invalid_vase:
     *error_msg = new_error_message(LOADING_FILE_ERROR, "Format of spectra %s is incorrect", filename);
     free(s);
     str_free(ln);
-    fclose(f);
     return NULL;
 
 }
@@ -204,32 +170,22 @@ spectra_free(struct spectrum *s)
 }
 
 struct spectrum *
-load_gener_spectrum(const char *filename, str_ptr *error_msg)
+read_gener_spectrum(const char *name, const char *text, str_ptr *error_msg)
 {
     struct spectrum *spectr;
     str_t ln;
-    FILE *f;
-
-    f = fopen(filename, "r");
-
-    if(f == NULL) {
-        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
-        return NULL;
-    }
 
     str_init(ln, 64);
-    str_getline(ln, f);
-
-    fclose(f);
+    str_getline_text(ln, text);
 
     if(strstr(CSTR(ln), "SE ALPHA BETA") || strstr(CSTR(ln), "SE PSI DELTA")) {
-        spectr = load_ellips_spectrum(filename, error_msg);
+        spectr = read_ellips_spectrum(name, text, error_msg);
     } else if(strstr(CSTR(ln), "VASE") || strstr(CSTR(ln), "M2000")) {
-        spectr = load_vase_spectrum(filename, error_msg);
+        spectr = read_vase_spectrum(name, text, error_msg);
     } else if(strstr(CSTR(ln), "\"Wavelength (nm)\"") && strstr(CSTR(ln), "\"Reflectance\"")) {
-        spectr = load_filmetrics_spectrum(filename, error_msg);
+        spectr = read_filmetrics_spectrum(name, text, error_msg);
     } else {
-        spectr = load_refl_data(filename, error_msg);
+        spectr = read_refl_data(name, text, error_msg);
     }
 
     str_free(ln);
@@ -237,6 +193,28 @@ load_gener_spectrum(const char *filename, str_ptr *error_msg)
     return spectr;
 }
 
+struct spectrum *
+load_gener_spectrum(const char *filename, str_ptr *error_msg)
+{
+    struct spectrum *spectr;
+    str_t text;
+
+    /* The whole file is read at once and the spectrum is parsed from
+       memory. */
+    str_init(text, 1024);
+    if(str_loadfile(filename, text) != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
+        str_free(text);
+        return NULL;
+    }
+
+    spectr = read_gener_spectrum(filename, CSTR(text), error_msg);
+
+    str_free(text);
+
+    return spectr;
+}
+
 void
 spectr_cut_range(struct spectrum *s, float inf, float sup)
 {
@@ -47,6 +47,10 @@ extern float const *     spectra_get_values(struct spectrum const *s, int j);
 
 extern struct spectrum * load_gener_spectrum(const char *filename, str_ptr *error_msg);
 
+/* Same as load_gener_spectrum for the text of a spectrum file already in
+   memory. The "name" is used in the error messages. */
+extern struct spectrum * read_gener_spectrum(const char *name, const char *text, str_ptr *error_msg);
+
 extern void              spectr_cut_range(struct spectrum *s,
         float inf, float sup);
 
@@ -237,6 +237,29 @@ str_getline(str_t d, FILE *f)
     return 0;
 }
 
+/* Same as str_getline for a text in memory. Return the beginning of the
+   next line or NULL if the text is already ended. */
+const char *
+str_getline_text(str_t d, const char *text)
+{
+    const char *end = strchr(text, '\n');
+    int len;
+
+    if(*text == 0) {
+        str_trunc(d, 0);
+        return NULL;
+    }
+
+    len = (end ? end - text : (int) strlen(text));
+    str_copy_c_substr(d, text, len);
+
+    if(d->length > 0 && d->heap[d->length - 1] == '\015') {
+        str_trunc(d, d->length - 1);
+    }
+
+    return (end ? end + 1 : text + len);
+}
+
 void
 str_vprintf(str_t d, const char *fmt, int append, va_list ap)
 {
@@ -66,6 +66,7 @@ extern void     str_trunc(str_t s, int len);
 extern void     str_get_basename(str_t to, const str_t from, int dirsep);
 extern void     str_dirname(str_t to, const str_t from, int dirsep);
 extern int      str_getline(str_t d, FILE *f);
+extern const char * str_getline_text(str_t d, const char *text);
 extern void     str_printf(str_t d, const char *fmt, ...);
 extern void     str_printf_add(str_t d, const char *fmt, ...);
 extern void     str_vprintf(str_t d, const char *fmt, int append,
@@ -0,0 +1,173 @@
+#include <math.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_blas.h>
+
+#include "stream-fit.h"
+#include "grid-search.h"
+#include "lmfit-normal.h"
+
+double
+stream_fit_clock(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double) count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1.0E-9 * t.tv_nsec;
+#endif
+}
+
+struct stream_fit *
+stream_fit_new(const struct batch_recipe *recipe, double deadline)
+{
+    struct stream_fit *sf = emalloc(sizeof(struct stream_fit));
+
+    sf->fit = fit_engine_new();
+    fit_engine_bind(sf->fit, recipe->stack, recipe->config, recipe->parameters);
+    sf->seeds = recipe->seeds_list;
+    sf->prepared = 0;
+
+    sf->x = gsl_vector_alloc(recipe->parameters->number);
+    sf->warm = 0;
+    fit_result_init(sf->grid, sf->fit);
+
+    sf->deadline = deadline;
+    return sf;
+}
+
+void
+stream_fit_free(struct stream_fit *sf)
+{
+    if (sf->prepared) {
+        fit_engine_disable(sf->fit);
+    }
+    fit_result_free(sf->grid);
+    gsl_vector_free(sf->x);
+    fit_engine_free(sf->fit);
+    free(sf);
+}
+
+/* Called before each iteration of the search. The search stops when the
+   next iteration could end after the deadline. The solvers do one more
+   iteration after the stop request so the time of two iterations, taken
+   from the last one, is required. */
+static int
+deadline_hook(void *data, float progress, const char *msg)
+{
+    struct stream_fit *sf = data;
+    const double now = stream_fit_clock();
+    const double step = now - sf->last_step;
+
+    sf->last_step = now;
+    if (sf->deadline <= 0.0 || msg != NULL) {
+        return 0;
+    }
+    if (now + 2 * step > sf->start + sf->deadline) {
+        sf->interrupted = 1;
+    }
+    return sf->interrupted;
+}
+
+/* Levenberg-Marquardt search starting from the last result, without
+   grid search. */
+static void
+stream_fit_warm(struct stream_fit *sf, struct stream_fit_result *result)
+{
+    struct fit_engine *fit = sf->fit;
+    struct fit_config *cfg = fit->config;
+    gsl_multifit_function_fdf *f = &fit->run->mffun;
+    gsl_multifit_fdfsolver *s;
+    struct lmfit_normal *ns;
+    double chi;
+
+    fit_engine_get_solver(fit, &s, &ns);
+
+    if (ns) {
+        result->fit_status = lmfit_normal_iter(sf->x, ns, cfg->nb_max_iters,
+                                               cfg->epsabs, cfg->epsrel, &result->iter,
+                                               deadline_hook, sf, NULL);
+        chi = gsl_blas_dnrm2(ns->f);
+    } else {
+        result->fit_status = lmfit_iter(sf->x, f, s, cfg->nb_max_iters,
+                                        cfg->epsabs, cfg->epsrel, &result->iter,
+                                        deadline_hook, sf, NULL);
+        chi = gsl_blas_dnrm2(s->f);
+    }
+    result->chisq = 1.0E6 * pow(chi, 2.0) / f->n;
+    result->grid_search = 0;
+}
+
+static void
+stream_fit_grid(struct stream_fit *sf, struct stream_fit_result *result)
+{
+    struct fit_result *grid = sf->grid;
+
+    /* Not set by lmfit_grid_run if the grid search is interrupted. */
+    grid->status = GSL_SUCCESS;
+    grid->iter = 0;
+
+    lmfit_grid_run(sf->fit, sf->seeds, LMFIT_PRESERVE_STACK, grid, deadline_hook, sf);
+    gsl_vector_memcpy(sf->x, sf->fit->run->results);
+
+    result->fit_status = grid->status;
+    result->iter = grid->iter;
+    result->chisq = grid->chisq;
+    result->grid_search = 1;
+}
+
+int
+stream_fit_spectrum(struct stream_fit *sf, struct spectrum *s,
+                    struct stream_fit_result *result)
+{
+    int status;
+
+    sf->start = stream_fit_clock();
+    sf->last_step = sf->start;
+    sf->interrupted = 0;
+
+    if (sf->prepared) {
+        status = fit_engine_rebind_spectrum(sf->fit, s);
+    } else {
+        status = fit_engine_prepare(sf->fit, s);
+    }
+    sf->prepared = (status == 0);
+
+    if (status) {
+        result->error_msg = new_error_message(FIT_ERROR, "unsupported kind of spectrum");
+        result->status = 1;
+        sf->warm = 0;
+        return 1;
+    }
+
+    if (sf->warm) {
+        stream_fit_warm(sf, result);
+    } else {
+        stream_fit_grid(sf, result);
+    }
+
+    /* A fit above the threshold may have lost the film: the next spectrum
+       goes through the grid search again. A grid search stopped by the
+       deadline is not done again, otherwise with a short deadline it
+       could be stopped for every spectrum: the next fit starts from its
+       best node instead. */
+    if (result->grid_search && sf->interrupted) {
+        sf->warm = 1;
+    } else {
+        sf->warm = (result->chisq <= sf->fit->config->chisq_threshold);
+    }
+
+    result->status = 0;
+    result->interrupted = sf->interrupted;
+    result->error_msg = NULL;
+    result->time = stream_fit_clock() - sf->start;
+    return 0;
+}
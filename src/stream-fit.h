@@ -0,0 +1,73 @@
+#ifndef STREAM_FIT_H
+#define STREAM_FIT_H
+
+#include <gsl/gsl_vector.h>
+
+#include "defs.h"
+#include "batch-recipe.h"
+#include "error-messages.h"
+#include "fit-engine.h"
+#include "fit_result.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+/* Fit of a stream of spectra acquired one after the other, like during an
+   in-situ monitoring of a deposition. The fit engine stays prepared from
+   a spectrum to the next so its caches are reused as long as the
+   wavelengths do not change. Each fit starts from the result of the
+   previous spectrum: the recipe's grid search is done only for the first
+   spectrum and after a fit whose chi-square is above the threshold. After
+   a grid search stopped by the deadline the next fit starts from its best
+   node. */
+struct stream_fit {
+    struct fit_engine *fit;
+    struct seeds *seeds;
+    int prepared;
+
+    /* Result of the last fit. If "warm" is not zero the next fit starts
+       from it. */
+    gsl_vector *x;
+    int warm;
+    struct fit_result grid[1];
+
+    /* Maximum time for the fit of a spectrum in seconds, zero if there is
+       no limit. */
+    double deadline;
+    /* Start of the current fit and of its last iteration. */
+    double start, last_step;
+    int interrupted;
+};
+
+struct stream_fit_result {
+    /* Zero if the spectrum was fitted. When not zero the "error_msg" field
+       gives the reason. */
+    int status;
+    int fit_status;
+    /* Not zero if the recipe's grid search was done. */
+    int grid_search;
+    /* Not zero if the fit was stopped to meet the deadline. */
+    int interrupted;
+    int iter;
+    double chisq;
+    /* Duration of the fit in seconds. */
+    double time;
+    str_ptr error_msg;
+};
+
+extern struct stream_fit * stream_fit_new(const struct batch_recipe *recipe, double deadline);
+extern void                stream_fit_free(struct stream_fit *sf);
+
+/* Fit the spectrum "s". The values of the fit parameters are stored in
+   sf->x. Returns non-zero if the spectrum cannot be fitted: the error
+   message is then given in result->error_msg and should be freed by the
+   caller. */
+extern int  stream_fit_spectrum(struct stream_fit *sf, struct spectrum *s,
+                                struct stream_fit_result *result);
+
+/* Monotonic time in seconds, for the timing of the fits. */
+extern double stream_fit_clock(void);
+
+__END_DECLS
+
+#endif
@@ -3,8 +3,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <gsl/gsl_deriv.h>
+#include <gsl/gsl_math.h>
 
 #include "test-deriv.h"
+#include "disp-fb.h"
 
 struct aux_param {
     int layer;
@@ -44,7 +46,7 @@ der_aux_f(double x, void *_p)
 
     mult_layer_se_jacob(p->spkind,
                         p->nb, p->ns, p->phi0, p->ds, p->lambda, p->anlz,
-                        e, NULL, NULL);
+                        e, NULL, NULL, NULL);
 
     return (p->channel == 0 ? e->alpha : e->beta);
 }
@@ -61,7 +63,7 @@ test_elliss_deriv(enum se_type spkind,
     size_t j, nb = _nb;
     size_t nblyr = nb - 2;
     double *myds;
-    cmpl *myns;
+    cmpl *myns, *jac_ws;
     ell_ab_t e;
     size_t noff;
 
@@ -74,9 +76,10 @@ test_elliss_deriv(enum se_type spkind,
 
     myds = emalloc(nblyr * sizeof(double));
     myns = emalloc(nb * sizeof(cmpl));
+    jac_ws = emalloc(SE_JACOB_WORKSPACE_SIZE(nb) * sizeof(cmpl));
 
     mult_layer_se_jacob(spkind, nb, ns, phi0, ds, lambda, anlz,
-                        e, jacob_th, jacob_n);
+                        e, jacob_th, jacob_n, jac_ws);
 
     p->nb = nb;
     p->spkind = spkind;
@@ -134,9 +137,155 @@ test_elliss_deriv(enum se_type spkind,
                result, -cimag(cmpl_vector_get(jacob_n, noff+j)), abserr);
     }
 
-    free(myds), free(myns);
+    free(myds), free(myns), free(jac_ws);
     gsl_vector_free(jacob_th);
     cmpl_vector_free(jacob_n);
 }
 
+struct disp_aux_param {
+    disp_t *d;
+    double lambda;
+    double *param;
+    int real_part;
+};
+
+static double
+disp_aux_f(double x, void *_p)
+{
+    struct disp_aux_param *p = (struct disp_aux_param *) _p;
+    cmpl n;
+
+    *p->param = x;
+    n = n_value(p->d, p->lambda);
+
+    return (p->real_part ? creal(n) : cimag(n));
+}
+
+/* Return the refractive index for the value "x" of the parameter. */
+static cmpl
+disp_aux_n(struct disp_aux_param *p, double x)
+{
+    *p->param = x;
+    return n_value(p->d, p->lambda);
+}
+
+/* Tell if the refractive index has a kink at the parameter's value "p0",
+   like when the extinction coefficient is clipped to zero. The one-sided
+   differences then disagree and the central difference is meaningless. */
+static int
+disp_aux_has_kink(struct disp_aux_param *p, double p0, double h)
+{
+    const cmpl n0 = disp_aux_n(p, p0);
+    const cmpl sf = (disp_aux_n(p, p0 + h) - n0) / h;
+    const cmpl sb = (n0 - disp_aux_n(p, p0 - h)) / h;
+    const double scale = GSL_MAX(sqrt(GSL_MAX(CSQABS(sf), CSQABS(sb))), TEST_DERIV_ABS_SCALE);
+    *p->param = p0;
+    return (sqrt(CSQABS(sf - sb)) > 0.1 * scale);
+}
+
+/* Compare the derivatives of the refractive index given by the
+   dispersion's class with the numeric derivatives. Return the number of
+   parameters whose derivative has a relative error above
+   TEST_DERIV_TOLERANCE. The parameters where the refractive index is not
+   differentiable are reported but not counted. */
+int
+test_disp_deriv(const disp_t *d, double lambda)
+{
+    const int nb_params = disp_get_number_of_params(d);
+    struct disp_aux_param p[1];
+    cmpl_vector *der;
+    int j, failed = 0;
+
+    if(nb_params == 0) return 0;
+
+    der = cmpl_vector_alloc(nb_params);
+    n_value_deriv(d, der, lambda);
+
+    p->d = disp_copy(d);
+    p->lambda = lambda;
+
+    printf("DISPERSION: %s, LAMBDA: %f\n", CSTR(d->name), lambda);
+
+    for(j = 0; j < nb_params; j++) {
+        gsl_function F;
+        double re, im, abserr, p0, h, err;
+        cmpl num, calc;
+
+        p->param = disp_map_param(p->d, j);
+        p0 = *p->param;
+        h = (fabs(p0) * 1e-4 < 1e-6 ? 1e-6 : fabs(p0) * 1e-4);
+
+        F.function = & disp_aux_f;
+        F.params = p;
+
+        p->real_part = 1;
+        gsl_deriv_central(&F, p0, h, &re, &abserr);
+        p->real_part = 0;
+        gsl_deriv_central(&F, p0, h, &im, &abserr);
+        *p->param = p0;
+
+        num = re + I * im;
+        calc = cmpl_vector_get(der, j);
+
+        if(disp_aux_has_kink(p, p0, h)) {
+            printf("param: %2i, not differentiable, calcul.: (%.6f, %.6f)\n", j,
+                   creal(calc), cimag(calc));
+            continue;
+        }
+
+        err = sqrt(CSQABS(calc - num));
+        if(CSQABS(num) > SQR(TEST_DERIV_ABS_SCALE)) {
+            err /= sqrt(CSQABS(num));
+        } else {
+            err /= TEST_DERIV_ABS_SCALE;
+        }
+
+        printf("param: %2i, numeric: (%.6f, %.6f), calcul.: (%.6f, %.6f), rel. err: %.2e%s\n", j,
+               re, im, creal(calc), cimag(calc), err,
+               err > TEST_DERIV_TOLERANCE ? " FAILED" : "");
+        if(err > TEST_DERIV_TOLERANCE) {
+            failed ++;
+        }
+    }
+
+    disp_free(p->d);
+    cmpl_vector_free(der);
+    return failed;
+}
+
+/* Photon energy in eV to wavelength in nm, as in disp-tauc-lorentz.c. */
+#define EV_TO_NM(e) (1240.0 / (e))
+
+/* Check the Tauc-Lorentz derivatives of both forms of the coefficients
+   below, near and above the gap. The second oscillator of the standard
+   form has C > 2 E0 and goes through the branch where alpha is not
+   real. Return the number of failed derivatives. */
+int
+test_tauc_lorentz_deriv(void)
+{
+    struct fb_osc std_osc[2] = {{120.0, 4.2, 1.8}, {15.0, 3.0, 7.0}};
+    struct fb_osc peak_osc[1] = {{3.5, 4.0, 2.5}};
+    const double eg = 2.5;
+    const double energies[] = {
+        1.2, 2.2, eg * (1 - 1e-4), eg * (1 + 1e-4), 2.8, 4.0, 5.5,
+    };
+    const int nb_energies = sizeof(energies) / sizeof(energies[0]);
+    disp_t *std_disp, *peak_disp;
+    int k, failed = 0;
+
+    std_disp = disp_new_tauc_lorentz("TL standard", TAUC_LORENTZ_STANDARD, 2, 1.1, eg, std_osc);
+    peak_disp = disp_new_tauc_lorentz("TL peak", TAUC_LORENTZ_RATIONAL, 1, 1.1, eg, peak_osc);
+
+    for(k = 0; k < nb_energies; k++) {
+        failed += test_disp_deriv(std_disp, EV_TO_NM(energies[k]));
+        failed += test_disp_deriv(peak_disp, EV_TO_NM(energies[k]));
+    }
+
+    printf("TAUC-LORENTZ DERIVATIVES: %d failed\n", failed);
+
+    disp_free(std_disp);
+    disp_free(peak_disp);
+    return failed;
+}
+
 #endif
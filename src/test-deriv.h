@@ -4,6 +4,7 @@
 #ifdef DEBUG_REGRESS
 
 #include "elliss.h"
+#include "dispers.h"
 
 void
 test_elliss_deriv(enum se_type spkind,
@@ -11,6 +12,18 @@ test_elliss_deriv(enum se_type spkind,
                   const double ds[], double lambda,
                   double anlz);
 
+/* Relative error above which an analytic derivative of the refractive
+   index is reported as wrong. Derivatives smaller in modulus than
+   TEST_DERIV_ABS_SCALE are compared with TEST_DERIV_ABS_SCALE instead. */
+#define TEST_DERIV_TOLERANCE 1e-6
+#define TEST_DERIV_ABS_SCALE 1e-3
+
+int
+test_disp_deriv(const disp_t *d, double lambda);
+
+int
+test_tauc_lorentz_deriv(void);
+
 #endif
 
 #endif
@@ -0,0 +1,133 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "thread-pool.h"
+
+struct pool_thread {
+    pthread_t thread;
+    int index;
+    struct thread_pool *pool;
+};
+
+struct thread_pool {
+    int size;
+    struct pool_thread *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    /* incremented each time a new work is started */
+    unsigned int generation;
+    int pending;
+    int quit;
+
+    thread_pool_func_t func;
+    void *data;
+};
+
+static void *
+pool_thread_run(void *arg)
+{
+    struct pool_thread *t = arg;
+    struct thread_pool *pool = t->pool;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == generation) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->quit) break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->func(pool->data, t->index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending --;
+        if (pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct thread_pool *
+thread_pool_new(int threads_number)
+{
+    struct thread_pool *pool = emalloc(sizeof(struct thread_pool));
+    int k;
+
+    pool->size = (threads_number > 1 ? threads_number : 1);
+    pool->threads = emalloc(pool->size * sizeof(struct pool_thread));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->quit = 0;
+    pool->func = NULL;
+    pool->data = NULL;
+
+    for (k = 1; k < pool->size; k++) {
+        struct pool_thread *t = &pool->threads[k];
+        t->index = k;
+        t->pool = pool;
+        pthread_create(&t->thread, NULL, pool_thread_run, t);
+    }
+    return pool;
+}
+
+void
+thread_pool_free(struct thread_pool *pool)
+{
+    int k;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (k = 1; k < pool->size; k++) {
+        pthread_join(pool->threads[k].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int
+thread_pool_size(const struct thread_pool *pool)
+{
+    return pool->size;
+}
+
+void
+thread_pool_run(struct thread_pool *pool, thread_pool_func_t func, void *data)
+{
+    if (pool->size == 1) {
+        func(data, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->data = data;
+    pool->pending = pool->size - 1;
+    pool->generation ++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    func(data, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
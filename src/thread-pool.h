@@ -0,0 +1,24 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "defs.h"
+
+__BEGIN_DECLS
+
+/* A fixed set of threads that execute together the same function. The
+   calling thread takes part to the work as the thread with index zero. */
+struct thread_pool;
+
+typedef void (*thread_pool_func_t)(void *data, int index);
+
+extern struct thread_pool *thread_pool_new(int threads_number);
+extern void thread_pool_free(struct thread_pool *pool);
+extern int  thread_pool_size(const struct thread_pool *pool);
+
+/* Call "func" once for each index from 0 to the pool's size minus one,
+   each from a different thread. Returns when all the calls are completed. */
+extern void thread_pool_run(struct thread_pool *pool, thread_pool_func_t func, void *data);
+
+__END_DECLS
+
+#endif